@@ -0,0 +1,751 @@
+#include <curl/curl.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "changefeed.h"
+#include "codec.h"
+#include "encoding.h"
+#include "etcdclient.h"
+#include "internal.h"
+#include "leasekeeper.h"
+#include "lock.h"
+#include "mirror.h"
+#include "mockserver.h"
+#include "queueconsumer.h"
+
+using namespace etcd;
+
+/**
+ * Runs every benchmark against an in-process mock etcd (or, with
+ * --etcd host:port, against a real one) and prints ops/sec, p50/p99
+ * latency and allocations per op of each, so changes can be compared
+ * against a baseline run.
+ *
+ *   etcdclient_bench [--iterations N] [--nodes N] [--threads N] [--leases N]
+ *                    [--contenders N] [--subscribers N] [--wait-delay MILLIS]
+ *                    [--etcd HOST:PORT] [--metrics true]
+ */
+
+struct Options {
+  size_t iterations = 2000;
+  size_t nodes = 1000;
+  int threads = 16;
+  size_t leases = 1000;
+  int contenders = 64;
+  int subscribers = 64;
+  int waitDelay = 0;
+  string etcd;
+  bool metrics = false;
+};
+
+typedef function<void (int thread, size_t iteration)> Operation;
+
+/* operator new calls made by the calling thread, see below */
+static thread_local unsigned long allocations = 0;
+
+/**
+ * Counts every allocation made through operator new, so run can report
+ * the allocations an operation makes besides the ones libcurl makes.
+ */
+void* operator new(size_t size) {
+  allocations++;
+  void *p = malloc(size > 0 ? size : 1);
+  if (p == NULL) {
+    throw bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+/**
+ * Calls op iterations times spread over threads, timing every call and
+ * counting the allocations it makes.
+ */
+void run(const string &name, int threads, size_t iterations, Operation op) {
+  vector<vector<double> > latencies(threads);
+  vector<unsigned long> allocated(threads, 0);
+  vector<thread> workers;
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (int t = 0; t < threads; t++) {
+    workers.push_back(thread([&, t]() {
+          vector<double> &timings = latencies[t];
+          timings.reserve(iterations / threads + 1);
+          for (size_t i = t; i < iterations; i += threads) {
+            chrono::steady_clock::time_point before = chrono::steady_clock::now();
+            unsigned long allocationsBefore = allocations;
+            op(t, i);
+            allocated[t] += allocations - allocationsBefore;
+            chrono::duration<double, micro> elapsed =
+              chrono::steady_clock::now() - before;
+            timings.push_back(elapsed.count());
+          }
+        }));
+  }
+  for (thread &worker : workers) {
+    worker.join();
+  }
+  chrono::duration<double> wall = chrono::steady_clock::now() - start;
+
+  vector<double> all;
+  for (const vector<double> &timings : latencies) {
+    all.insert(all.end(), timings.begin(), timings.end());
+  }
+  sort(all.begin(), all.end());
+
+  double p50 = all.empty() ? 0 : all[all.size() / 2];
+  double p99 = all.empty() ? 0 : all[min(all.size() - 1, all.size() * 99 / 100)];
+  unsigned long total = 0;
+  for (unsigned long count : allocated) {
+    total += count;
+  }
+  printf("%-32s %7d %9zu %12.0f %10.1f %10.1f %10.1f\n", name.c_str(), threads,
+         all.size(), all.size() / wall.count(), p50, p99,
+         all.empty() ? 0.0 : (double) total / all.size());
+  fflush(stdout);
+}
+
+/**
+ * Fails the run when a response carries an error, a benchmark of
+ * failing requests measures nothing useful.
+ */
+template<typename R>
+void check(const unique_ptr<R> &r, const string &what) {
+  if (r->getError() != NULL) {
+    cerr << what << ": " << r->getError()->getMessage() << endl;
+    exit(1);
+  }
+}
+
+string fetch(const string &url) {
+  CURL *curl = curl_easy_init();
+  string body;
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &writer);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+  curl_easy_perform(curl);
+  curl_easy_cleanup(curl);
+  return body;
+}
+
+/**
+ * Round-trips keys and values with characters which need escaping,
+ * through the encoder alone and through etcd, exiting on a mismatch.
+ */
+void checkEncoding(Session &session) {
+  vector<string> values = {
+    "", "plain", "a&b=c+d%e f;g", "{\"k\": \"v&w=x+y%z\"}", "caf\xc3\xa9 \xe2\x82\xac"
+  };
+  string ascii;
+  for (int c = 1; c < 0x80; c++) {
+    ascii += (char) c;
+  }
+  values.push_back(ascii);
+  string large(4 << 20, 'x');
+  for (size_t i = 0; i < large.size(); i += 997) {
+    large[i] = "&=+% "[i % 5];
+  }
+  values.push_back(large);
+
+  // arbitrary bytes only go through the encoder, etcd keeps text
+  minstd_rand random(42);
+  string binary;
+  for (size_t i = 0; i < (1 << 20); i++) {
+    binary += (char) random();
+  }
+  vector<string> encoded = values;
+  encoded.push_back(binary);
+  for (const string &value : encoded) {
+    string base64;
+    string bytes;
+    appendBase64(base64, value);
+    if (!appendBase64Decoded(bytes, base64.data(), base64.size())
+        || bytes != value) {
+      cerr << "base64 of a value of " << value.size()
+           << " bytes doesn't round-trip" << endl;
+      exit(1);
+    }
+    for (bool path : { false, true }) {
+      string escaped;
+      string decoded;
+      appendDecoded(decoded, appendEncoded(escaped, value, path));
+      if (decoded != value) {
+        cerr << "encoding a value of " << value.size()
+             << " bytes doesn't round-trip" << endl;
+        exit(1);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < values.size(); i++) {
+    string key = "/bench/encoding/" + to_string(i) + " ?#&=+%";
+    check(session.put(key, values[i]), "put " + key);
+    unique_ptr<GetResponse> r = session.get(key);
+    check(r, "get " + key);
+    if (r->getNode()->getKey() != key || r->getNode()->getValue() != values[i]) {
+      cerr << key << " didn't round-trip through etcd" << endl;
+      exit(1);
+    }
+  }
+}
+
+/**
+ * The lock recipe Lock replaces: every contender lists the line and
+ * waits for any change in it, so every change wakes all of them.
+ * Returns the key of the contender once it is first in line.
+ */
+string herdLock(Session &session, const string &dir) {
+  unique_ptr<PutResponse> own = session.addToQueue(dir, "", 10);
+  check(own, "addToQueue");
+  string key = own->getNode()->getKey();
+
+  for (;;) {
+    unique_ptr<GetResponse> line = session.listQueue(dir);
+    check(line, "listQueue");
+    int64_t newest = line->getNode()->getModifiedIndex();
+    for (const Node &node : line->getNode()->getNodes()) {
+      newest = max(newest, node.getModifiedIndex());
+    }
+    const vector<Node> &contenders = line->getNode()->getNodes();
+    if (contenders.empty()) {
+      cerr << key << " expired while waiting" << endl;
+      exit(1);
+    }
+    if (contenders[0].getKey() == key) {
+      return key;
+    }
+    session.wait(dir, true, newest + 1);
+  }
+}
+
+/**
+ * Waits until every subscriber saw count changes, exiting if that
+ * takes longer than five seconds.
+ */
+void awaitSeen(const vector<atomic<size_t> > &seen, size_t count) {
+  chrono::steady_clock::time_point deadline =
+    chrono::steady_clock::now() + chrono::seconds(5);
+  for (const atomic<size_t> &subscriber : seen) {
+    while (subscriber.load() < count) {
+      if (chrono::steady_clock::now() > deadline) {
+        cerr << "change not delivered in time" << endl;
+        exit(1);
+      }
+      this_thread::yield();
+    }
+  }
+}
+
+Options parseOptions(int argc, char *argv[]) {
+  Options options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    string name = argv[i];
+    const char *value = argv[i + 1];
+    if (name == "--iterations") {
+      options.iterations = strtoul(value, NULL, 10);
+    } else if (name == "--nodes") {
+      options.nodes = strtoul(value, NULL, 10);
+    } else if (name == "--threads") {
+      options.threads = atoi(value);
+    } else if (name == "--leases") {
+      options.leases = strtoul(value, NULL, 10);
+    } else if (name == "--contenders") {
+      options.contenders = atoi(value);
+    } else if (name == "--subscribers") {
+      options.subscribers = atoi(value);
+    } else if (name == "--wait-delay") {
+      options.waitDelay = atoi(value);
+    } else if (name == "--etcd") {
+      options.etcd = value;
+    } else if (name == "--metrics") {
+      options.metrics = string(value) == "true";
+    } else {
+      cerr << "unknown option " << name << endl;
+      exit(2);
+    }
+  }
+  return options;
+}
+
+int main(int argc, char *argv[]) {
+  Options options = parseOptions(argc, argv);
+  size_t iterations = options.iterations;
+
+  unique_ptr<MockServer> mock;
+  Host host("127.0.0.1", 0);
+  if (options.etcd.empty()) {
+    mock.reset(new MockServer());
+    mock->setWaitDelay(options.waitDelay);
+    host = Host("127.0.0.1", mock->getPort());
+  } else {
+    size_t colon = options.etcd.rfind(':');
+    host = Host(options.etcd.substr(0, colon),
+                atol(options.etcd.substr(colon + 1).c_str()));
+  }
+
+  vector<Host> hosts { host };
+  Session session(hosts, PoolOptions(options.threads, 60));
+  string value(64, 'v');
+
+  session.deleteDirectory("/bench");
+  check(session.put("/bench/key", value), "put /bench/key");
+  checkEncoding(session);
+
+  printf("%-32s %7s %9s %12s %10s %10s %10s\n",
+         "benchmark", "threads", "ops", "ops/sec", "p50 us", "p99 us",
+         "allocs/op");
+
+  run("get", 1, iterations, [&](int, size_t) {
+      check(session.get("/bench/key"), "get");
+    });
+
+  run("get missing (errorCode 100)", 1, iterations, [&](int, size_t) {
+      session.get("/bench/missing");
+    });
+
+  run("put", 1, iterations, [&](int, size_t i) {
+      check(session.put("/bench/put/" + to_string(i % 100), value), "put");
+    });
+
+  unique_ptr<PutResponse> counter = session.put("/bench/counter", "0");
+  check(counter, "put /bench/counter");
+  int64_t counterIndex = counter->getNode()->getModifiedIndex();
+  run("compareAndSwap", 1, iterations, [&](int, size_t i) {
+      unique_ptr<PutResponse> r =
+        session.compareAndSwap("/bench/counter", to_string(i + 1), counterIndex);
+      check(r, "compareAndSwap");
+      counterIndex = r->getNode()->getModifiedIndex();
+    });
+
+  vector<pair<string, string> > tree;
+  for (size_t i = 0; i < options.nodes; i++) {
+    tree.push_back(make_pair("/bench/tree/" + to_string(i % 10)
+                             + "/" + to_string(i), value));
+  }
+  for (const unique_ptr<PutResponse> &r : session.putMany(tree)) {
+    check(r, "putMany");
+  }
+
+  string nodes = to_string(options.nodes);
+  size_t treeIterations = max<size_t>(iterations / 10, 10);
+  run("get recursive " + nodes + " nodes", 1, treeIterations, [&](int, size_t) {
+      check(session.get("/bench/tree", true), "get recursive");
+    });
+
+  run("getTree " + nodes + " nodes", 1, treeIterations, [&](int, size_t) {
+      check(session.getTree("/bench/tree"), "getTree");
+    });
+
+  run("getStream " + nodes + " nodes", 1, treeIterations, [&](int, size_t) {
+      check(session.getStream("/bench/tree", [](const Node&) { return true; }),
+            "getStream");
+    });
+
+  // the same keys through the v3 gateway, in one range and in pages
+  check(session.kvDeletePrefix("/bench/"), "kvDeletePrefix");
+  for (const pair<string, string> &entry : tree) {
+    check(session.kvPut(entry.first, entry.second), "kvPut");
+  }
+  run("kvPrefix " + nodes + " keys", 1, treeIterations, [&](int, size_t) {
+      check(session.kvPrefix("/bench/tree/", RangeOptions()), "kvPrefix");
+    });
+  check(session.kvPrefix("", RangeOptions().setCountOnly(true)),
+        "kvPrefix of the whole keyspace");
+
+  run("kvScan " + nodes + " keys, pages of 100", 1, treeIterations,
+      [&](int, size_t) {
+        unique_ptr<RangeResponse> r =
+          session.kvScan("/bench/tree/", 100, [](const KeyValue&) {
+              return true;
+            });
+        check(r, "kvScan");
+        if ((size_t) r->getCount() != tree.size()) {
+          cerr << "kvScan visited " << r->getCount() << " keys" << endl;
+          exit(1);
+        }
+      });
+
+  int64_t waitIndex = session.get("/bench/key")->getNode()->getModifiedIndex();
+  run("wait (index in history)", 1, iterations, [&](int, size_t) {
+      check(session.wait("/bench/key", waitIndex), "wait");
+    });
+
+  run("put then wait", 1, iterations, [&](int, size_t) {
+      unique_ptr<PutResponse> put = session.put("/bench/watched", value);
+      check(put, "put");
+      int64_t index = put->getNode()->getModifiedIndex();
+      check(session.wait("/bench/watched", index), "wait");
+    });
+
+  string body = fetch(base_url(host, "/bench/tree") + "?recursive=true");
+  run("parse + readNode " + nodes + " nodes", 1, treeIterations, [&](int, size_t) {
+      string copy = body;
+      ParsedResponse resp(copy);
+      readNode(resp.getDocument()["node"]);
+    });
+
+  run("parse + NodeTree " + nodes + " nodes", 1, treeIterations, [&](int, size_t) {
+      string copy = body;
+      ParsedResponse resp(copy);
+      delete NodeTree::read(resp.getDocument()["node"]);
+    });
+
+  // a value with nothing to escape, and JSON escaping every few bytes
+  string text(65536, 'v');
+  string json;
+  while (json.size() < 65536) {
+    json += "{\"name\": \"a&b\", \"size\": 100},";
+  }
+  string escaped;
+  run("percent-encode 64 KiB text", 1, iterations, [&](int, size_t) {
+      escaped.clear();
+      appendEncoded(escaped, text, false);
+    });
+  run("percent-encode 64 KiB JSON", 1, iterations, [&](int, size_t) {
+      escaped.clear();
+      appendEncoded(escaped, json, false);
+    });
+
+  string base64;
+  string decoded;
+  appendBase64(base64, text);
+  run("base64 encode 64 KiB", 1, iterations, [&](int, size_t) {
+      escaped.clear();
+      appendBase64(escaped, text);
+    });
+  run("base64 decode 64 KiB", 1, iterations, [&](int, size_t) {
+      decoded.clear();
+      appendBase64Decoded(decoded, base64.data(), base64.size());
+    });
+
+  // compression of a large JSON value, and what it saves through etcd
+  string blob;
+  while (blob.size() < (256 << 10)) {
+    blob += "{\"service\": \"api-" + to_string(blob.size() % 977)
+      + "\", \"enabled\": true, \"replicas\": 3,"
+      + " \"limits\": {\"cpu\": \"500m\", \"memory\": \"1Gi\"}},";
+  }
+  string packed;
+  run("compress 256 KiB JSON", 1, treeIterations, [&](int, size_t) {
+      packed.clear();
+      appendCompressed(packed, blob);
+    });
+  string unpacked;
+  run("decompress 256 KiB JSON", 1, treeIterations, [&](int, size_t) {
+      unpacked.clear();
+      appendDecompressed(unpacked, packed.data(), packed.size());
+    });
+  printf("%-32s %7s %9.1f\n", "  compression ratio", "",
+         (double) blob.size() / packed.size());
+
+  Session compressing(hosts);
+  compressing.setCompression(64 << 10);
+  check(compressing.put("/bench/blob/compressed", blob), "put compressed");
+  unique_ptr<GetResponse> stored = session.get("/bench/blob/compressed");
+  check(stored, "get compressed");
+  if (stored->getNode()->getValue() != blob
+      || stored->getNode()->getRawValue().size() >= blob.size()) {
+    cerr << "compressed value didn't round-trip" << endl;
+    exit(1);
+  }
+  for (bool compress : { false, true }) {
+    Session &client = compress ? compressing : session;
+    string key = compress ? "/bench/blob/compressed" : "/bench/blob/plain";
+    string suffix = compress ? " (compressed)" : "";
+    run("put 256 KiB JSON" + suffix, 1, treeIterations, [&](int, size_t) {
+        check(client.put(key, blob), "put blob");
+      });
+    run("get + getValue 256 KiB JSON" + suffix, 1, treeIterations,
+        [&](int, size_t) {
+          unique_ptr<GetResponse> r = session.get(key);
+          check(r, "get blob");
+          r->getNode()->getValue();
+        });
+  }
+
+  for (int threads = 1; threads <= options.threads; threads *= 2) {
+    run("get concurrent", threads, iterations * threads, [&](int, size_t) {
+        check(session.get("/bench/key"), "get");
+      });
+  }
+
+  // lookups in a local mirror of the tree, and the lag of its updates
+  {
+    Mirror mirror(hosts, "/bench/tree");
+    vector<string> treeKeys;
+    for (const pair<string, string> &entry : tree) {
+      treeKeys.push_back(entry.first);
+    }
+    for (int threads = 1; threads <= options.threads; threads *= 4) {
+      run("Mirror get", threads, iterations * 100, [&](int, size_t i) {
+          if (mirror.snapshot()->get(treeKeys[i % treeKeys.size()]) == NULL) {
+            cerr << "mirror misses " << treeKeys[i % treeKeys.size()] << endl;
+            exit(1);
+          }
+        });
+    }
+    run("Mirror forEach " + nodes + " nodes", 1, treeIterations, [&](int, size_t) {
+        size_t visited = 0;
+        mirror.snapshot()->forEach("/bench/tree", [&](const Node&) {
+            visited++;
+            return true;
+          });
+      });
+    run("put then Mirror waitFor", 1, iterations, [&](int, size_t i) {
+        unique_ptr<PutResponse> put =
+          session.put(treeKeys[i % treeKeys.size()], to_string(i));
+        check(put, "put");
+        if (mirror.waitFor(put->getNode()->getModifiedIndex(), 5000) == NULL) {
+          cerr << "mirror fell behind" << endl;
+          exit(1);
+        }
+      });
+  }
+
+  // consumers in separate "processes" draining one queue
+  for (size_t i = 0; i < iterations; i++) {
+    check(session.addToQueue("/bench/queue", value), "addToQueue");
+  }
+  {
+    const int consumerCount = 4;
+    vector<unique_ptr<QueueConsumer> > consumers;
+    for (int i = 0; i < consumerCount; i++) {
+      consumers.push_back(unique_ptr<QueueConsumer>(
+        new QueueConsumer(hosts, "/bench/queue")));
+    }
+    run("QueueConsumer take", consumerCount, iterations, [&](int t, size_t) {
+        if (consumers[t]->take(5000) == NULL) {
+          cerr << "queue drained early" << endl;
+          exit(1);
+        }
+      });
+
+    unsigned long conflicts = 0;
+    for (const unique_ptr<QueueConsumer> &consumer : consumers) {
+      conflicts += consumer->getStats().getConflicts();
+    }
+    printf("%-32s %7d %9lu\n", "  claims lost to other consumers",
+           consumerCount, conflicts);
+  }
+
+  // gets while every thread also has a wait pending, over HTTP/1.1 and
+  // as HTTP/2 streams, against the mock which speaks both
+  if (mock) {
+    for (uint maxStreams : { 0u, 100u }) {
+      string protocol = maxStreams > 0 ? "HTTP/2" : "HTTP/1.1";
+      Session transport(hosts, PoolOptions(options.threads, 60, maxStreams));
+      unsigned long accepted = mock->getConnections();
+
+      int64_t from = mock->getIndex() + 1;
+      vector<thread> waiters;
+      for (int i = 0; i < options.threads; i++) {
+        waiters.push_back(thread([&]() {
+              check(transport.wait("/bench/released", from), "wait");
+            }));
+      }
+      run("get, waits pending (" + protocol + ")", options.threads, iterations,
+          [&](int, size_t) {
+            check(transport.get("/bench/key"), "get");
+          });
+
+      check(session.put("/bench/released", value), "put");
+      for (thread &waiter : waiters) {
+        waiter.join();
+      }
+      printf("%-32s %7s %9lu\n", ("  sockets opened (" + protocol + ")").c_str(),
+             "", mock->getConnections() - accepted);
+    }
+  }
+
+  // one change delivered to a growing number of readers in the process,
+  // through one watch and the ring of a ChangeFeed against a watch each
+  for (int subscribers = 1; subscribers <= options.subscribers; subscribers *= 4) {
+    string suffix = " " + to_string(subscribers) + " subscribers";
+    size_t changes = iterations / 10;
+    {
+      ChangeFeed feed(hosts, "/bench/feed");
+      vector<atomic<size_t> > seen(subscribers);
+      atomic<int> ready(0);
+      atomic<bool> done(false);
+      vector<thread> readers;
+      for (int i = 0; i < subscribers; i++) {
+        seen[i] = 0;
+        shared_ptr<Subscription> subscription(feed.subscribe("/bench/feed"));
+        readers.push_back(thread([&, i, subscription]() {
+              while (!done) {
+                shared_ptr<const ChangeEvent> event = subscription->next(100);
+                if (!event) {
+                  continue;
+                }
+                if (event->getAction() == "get") {
+                  ready++;
+                } else {
+                  seen[i]++;
+                }
+              }
+            }));
+      }
+      // changes their first read already saw aren't delivered again
+      while (ready < subscribers) {
+        this_thread::yield();
+      }
+
+      unsigned long served = mock ? mock->getRequests() : 0;
+      run("put, ChangeFeed" + suffix, 1, changes, [&](int, size_t i) {
+          check(session.put("/bench/feed/key", to_string(i)), "put");
+          awaitSeen(seen, i + 1);
+        });
+      if (mock) {
+        printf("%-32s %7d %9.1f\n", "  etcd requests per change",
+               subscribers, (double) (mock->getRequests() - served) / changes);
+      }
+      done = true;
+      for (thread &reader : readers) {
+        reader.join();
+      }
+    }
+    {
+      unique_ptr<PutResponse> start = session.put("/bench/feed/key", value);
+      check(start, "put");
+      vector<atomic<size_t> > seen(subscribers);
+      Watcher watcher(hosts);
+      for (int i = 0; i < subscribers; i++) {
+        seen[i] = 0;
+        watcher.watch("/bench/feed", true, start->getNode()->getModifiedIndex() + 1,
+                      [&, i](GetResponse *r) {
+                        if (r->getError() == NULL) {
+                          seen[i]++;
+                        }
+                      });
+      }
+
+      unsigned long served = mock ? mock->getRequests() : 0;
+      run("put, Watcher" + suffix, 1, changes, [&](int, size_t i) {
+          check(session.put("/bench/feed/key", to_string(i)), "put");
+          awaitSeen(seen, i + 1);
+        });
+      if (mock) {
+        printf("%-32s %7d %9.1f\n", "  etcd requests per change",
+               subscribers, (double) (mock->getRequests() - served) / changes);
+      }
+    }
+  }
+
+  // a subscriber which falls behind a small ring reads its prefix again
+  // instead of holding up the feed
+  {
+    ChangeFeed feed(hosts, "/bench/feed", 64);
+    unique_ptr<Subscription> slow = feed.subscribe("/bench/feed");
+    if (!slow->next(5000)) {
+      cerr << "subscription failed to read its prefix" << endl;
+      exit(1);
+    }
+    uint64_t from = feed.getPublished();
+    for (int i = 0; i < 256; i++) {
+      check(session.put("/bench/feed/key", to_string(i)), "put");
+    }
+    while (feed.getPublished() < from + 256) {
+      this_thread::yield();
+    }
+    shared_ptr<const ChangeEvent> event = slow->poll();
+    if (!event || event->getAction() != "get"
+        || event->getNode() == NULL
+        || event->getNode()->getNodes().empty()
+        || event->getNode()->getNodes()[0].getValue() != "255") {
+      cerr << "slow subscriber not resynced" << endl;
+      exit(1);
+    }
+    printf("%-32s %7s %9lu\n", "  slow subscriber resyncs", "",
+           slow->getResyncs());
+  }
+
+  // lock handovers as contenders scale, each waking the next in line
+  // only, against every contender waking up on every change
+  for (int contenders = 1; contenders <= options.contenders; contenders *= 4) {
+    size_t acquisitions = max<size_t>(iterations / 10, contenders * 4);
+    string suffix = " " + to_string(contenders) + " contenders";
+    {
+      vector<unique_ptr<Lock> > locks;
+      for (int i = 0; i < contenders; i++) {
+        locks.push_back(unique_ptr<Lock>(new Lock(hosts, "/bench/lock", 10)));
+      }
+      unsigned long served = mock ? mock->getRequests() : 0;
+      run("Lock" + suffix, contenders, acquisitions, [&](int t, size_t) {
+          if (!locks[t]->lock(10000)) {
+            cerr << "lock not acquired in time" << endl;
+            exit(1);
+          }
+          locks[t]->unlock();
+        });
+      if (mock) {
+        printf("%-32s %7d %9.1f\n", "  etcd requests per acquisition",
+               contenders, (double) (mock->getRequests() - served) / acquisitions);
+      }
+    }
+    {
+      vector<unique_ptr<Session> > sessions;
+      for (int i = 0; i < contenders; i++) {
+        sessions.push_back(unique_ptr<Session>(new Session(hosts)));
+      }
+      unsigned long served = mock ? mock->getRequests() : 0;
+      run("listQueue + wait lock" + suffix, contenders, acquisitions,
+          [&](int t, size_t) {
+            check(sessions[t]->deleteKey(herdLock(*sessions[t], "/bench/herd")),
+                  "deleteKey");
+          });
+      if (mock) {
+        printf("%-32s %7d %9.1f\n", "  etcd requests per acquisition",
+               contenders, (double) (mock->getRequests() - served) / acquisitions);
+      }
+    }
+  }
+
+  // keepalive of many short leases from the one keeper thread
+  for (size_t i = 0; i < options.leases; i++) {
+    check(session.put("/bench/lease/" + to_string(i), value, 3), "put lease");
+  }
+  {
+    LeaseKeeper keeper(session);
+    for (size_t i = 0; i < options.leases; i++) {
+      keeper.keep("/bench/lease/" + to_string(i), 3);
+    }
+    this_thread::sleep_for(chrono::seconds(5));
+    printf("%-32s %7d %9lu %12.0f %10s %10s %10s\n",
+           ("LeaseKeeper " + to_string(options.leases) + " keys").c_str(), 1,
+           keeper.getRefreshed(), keeper.getRefreshed() / 5.0, "-", "-", "-");
+    if (keeper.getFailures() > 0) {
+      cerr << keeper.getFailures() << " lease refreshes failed" << endl;
+    }
+  }
+
+  ConnectionStats stats = session.getConnectionStats();
+  printf("\n%lu connections reused, %lu created", stats.getReused(),
+         stats.getCreated());
+  if (mock) {
+    printf(", %lu requests served by the mock", mock->getRequests());
+  }
+  printf("\n");
+
+  if (options.metrics) {
+    printf("\n%s", session.getMetrics().toPrometheus().c_str());
+  }
+
+  session.deleteDirectory("/bench");
+  session.kvDeletePrefix("/bench/");
+  return 0;
+}
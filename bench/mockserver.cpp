@@ -0,0 +1,1262 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <nghttp2/nghttp2.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <stdexcept>
+#include "mockserver.h"
+
+namespace {
+  const char *statusText(int status) {
+    switch (status) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 412: return "Precondition Failed";
+    case 501: return "Not Implemented";
+    default: return "Internal Server Error";
+    }
+  }
+
+  int errorStatus(int code) {
+    switch (code) {
+    case 100: return 404;
+    case 101: return 412;
+    case 102:
+    case 104:
+    case 107:
+    case 108: return 403;
+    default: return 400;
+    }
+  }
+
+  int fromHex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+  }
+
+  string decode(const string &s, bool form) {
+    string out;
+    out.reserve(s.size());
+    for (size_t i = 0; i < s.size(); i++) {
+      if (s[i] == '%' && i + 2 < s.size()
+          && fromHex(s[i + 1]) >= 0 && fromHex(s[i + 2]) >= 0) {
+        out += (char) (fromHex(s[i + 1]) * 16 + fromHex(s[i + 2]));
+        i += 2;
+      } else if (form && s[i] == '+') {
+        out += ' ';
+      } else {
+        out += s[i];
+      }
+    }
+    return out;
+  }
+
+  void parseForm(const string &s, map<string, string> &out) {
+    size_t start = 0;
+    while (start < s.size()) {
+      size_t end = s.find('&', start);
+      if (end == string::npos) {
+        end = s.size();
+      }
+      string pair = s.substr(start, end - start);
+      size_t eq = pair.find('=');
+      if (eq == string::npos) {
+        out[decode(pair, true)] = "";
+      } else {
+        out[decode(pair.substr(0, eq), true)] = decode(pair.substr(eq + 1), true);
+      }
+      start = end + 1;
+    }
+  }
+
+  string escape(const string &s) {
+    string out;
+    out.reserve(s.size() + 2);
+    for (char c : s) {
+      switch (c) {
+      case '"': out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      case '\t': out += "\\t"; break;
+      default:
+        if ((unsigned char) c < 0x20) {
+          char hex[8];
+          snprintf(hex, sizeof(hex), "\\u%04x", c);
+          out += hex;
+        } else {
+          out += c;
+        }
+      }
+    }
+    return out;
+  }
+
+  string lower(string s) {
+    transform(s.begin(), s.end(), s.begin(), ::tolower);
+    return s;
+  }
+
+  bool isTrue(const map<string, string> &values, const string &name) {
+    map<string, string>::const_iterator it = values.find(name);
+    return it != values.end() && it->second == "true";
+  }
+
+  /**
+   * Key without a trailing slash, "/" for the root.
+   */
+  string normalize(string key) {
+    if (key.empty() || key[0] != '/') {
+      key = "/" + key;
+    }
+    while (key.size() > 1 && key[key.size() - 1] == '/') {
+      key.erase(key.size() - 1);
+    }
+    return key;
+  }
+
+  string childPrefix(const string &key) {
+    return key == "/" ? key : key + "/";
+  }
+
+  bool isUnder(const string &key, const string &dir) {
+    string prefix = childPrefix(dir);
+    return key.compare(0, prefix.size(), prefix) == 0 && key != dir;
+  }
+
+  const char BASE64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  string toBase64(const string &s) {
+    string out;
+    size_t i = 0;
+    for (; i + 2 < s.size(); i += 3) {
+      unsigned n = (unsigned char) s[i] << 16
+        | (unsigned char) s[i + 1] << 8
+        | (unsigned char) s[i + 2];
+      out += BASE64[n >> 18];
+      out += BASE64[(n >> 12) & 63];
+      out += BASE64[(n >> 6) & 63];
+      out += BASE64[n & 63];
+    }
+    if (i < s.size()) {
+      unsigned n = (unsigned char) s[i] << 16;
+      if (i + 1 < s.size()) {
+        n |= (unsigned char) s[i + 1] << 8;
+      }
+      out += BASE64[n >> 18];
+      out += BASE64[(n >> 12) & 63];
+      out += i + 1 < s.size() ? BASE64[(n >> 6) & 63] : '=';
+      out += '=';
+    }
+    return out;
+  }
+
+  string fromBase64(const string &s) {
+    string out;
+    unsigned n = 0;
+    int bits = 0;
+    for (char c : s) {
+      const char *at = strchr(BASE64, c);
+      if (c == '=' || c == '\0' || at == NULL) {
+        continue;
+      }
+      n = n << 6 | (at - BASE64);
+      bits += 6;
+      if (bits >= 8) {
+        bits -= 8;
+        out += (char) ((n >> bits) & 0xff);
+      }
+    }
+    return out;
+  }
+
+  /**
+   * Members of a flat JSON object, such as the body of a v3 request,
+   * with their values as written (strings unquoted, escapes dropped).
+   * Nested objects and arrays aren't supported.
+   */
+  void parseJson(const string &s, map<string, string> &out) {
+    size_t i = s.find('{');
+    while (i != string::npos && i < s.size()) {
+      size_t open = s.find('"', i);
+      if (open == string::npos) {
+        return;
+      }
+      size_t close = s.find('"', open + 1);
+      size_t colon = s.find(':', close);
+      if (close == string::npos || colon == string::npos) {
+        return;
+      }
+      string name = s.substr(open + 1, close - open - 1);
+
+      size_t start = s.find_first_not_of(" \t\r\n", colon + 1);
+      if (start == string::npos) {
+        return;
+      }
+      string value;
+      if (s[start] == '"') {
+        size_t end = start + 1;
+        while (end < s.size() && s[end] != '"') {
+          if (s[end] == '\\' && end + 1 < s.size()) {
+            end++;
+          }
+          value += s[end++];
+        }
+        i = end + 1;
+      } else {
+        size_t end = s.find_first_of(",}", start);
+        value = s.substr(start, end == string::npos ? string::npos : end - start);
+        value.erase(value.find_last_not_of(" \t\r\n") + 1);
+        i = end;
+      }
+      out[name] = value;
+    }
+  }
+
+  bool sendAll(int fd, const string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+      ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+        return false;
+      }
+      sent += n;
+    }
+    return true;
+  }
+}
+
+MockServer::MockServer() :
+  historySize(1000),
+  cleared(0),
+  index(0),
+  revision(1) {
+  Entry root = { "", true, 0, "", 0, 0 };
+  entries["/"] = root;
+
+  listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listenFd < 0) {
+    throw runtime_error("mock server: socket failed");
+  }
+
+  int one = 1;
+  setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  if (::bind(listenFd, (sockaddr*) &addr, sizeof(addr)) < 0
+      || listen(listenFd, 128) < 0) {
+    close(listenFd);
+    throw runtime_error("mock server: bind failed");
+  }
+
+  socklen_t length = sizeof(addr);
+  getsockname(listenFd, (sockaddr*) &addr, &length);
+  port = ntohs(addr.sin_port);
+
+  acceptor = thread(&MockServer::acceptLoop, this);
+}
+
+MockServer::~MockServer() {
+  stopping = true;
+  shutdown(listenFd, SHUT_RDWR);
+  close(listenFd);
+  acceptor.join();
+
+  {
+    lock_guard<mutex> guard(connectionsLock);
+    for (int fd : connections) {
+      shutdown(fd, SHUT_RDWR);
+    }
+  }
+  changed.notify_all();
+
+  for (thread &worker : workers) {
+    worker.join();
+  }
+}
+
+void MockServer::setHistorySize(size_t size) {
+  lock_guard<mutex> guard(lock);
+  historySize = size;
+  while (history.size() > historySize) {
+    cleared = history.front().node.modifiedIndex;
+    history.pop_front();
+  }
+}
+
+uint64_t MockServer::getIndex() {
+  lock_guard<mutex> guard(lock);
+  return index;
+}
+
+void MockServer::acceptLoop() {
+  while (!stopping) {
+    int fd = accept(listenFd, NULL, NULL);
+    if (fd < 0) {
+      if (stopping) {
+        break;
+      }
+      continue;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    accepted++;
+
+    lock_guard<mutex> guard(connectionsLock);
+    connections.push_back(fd);
+    workers.push_back(thread(&MockServer::serve, this, fd));
+  }
+}
+
+/**
+ * Reads requests off one keep-alive connection until the client closes
+ * it or the server stops.
+ */
+void MockServer::serve(int fd) {
+  string buffer;
+  char chunk[16384];
+
+  while (!stopping) {
+    size_t headerEnd;
+    bool open = true;
+    while ((headerEnd = buffer.find("\r\n\r\n")) == string::npos) {
+      ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+      if (n <= 0) {
+        open = false;
+        break;
+      }
+      buffer.append(chunk, n);
+    }
+    if (!open) {
+      break;
+    }
+
+    if (buffer.compare(0, 14, "PRI * HTTP/2.0") == 0) {
+      serveHttp2(fd, buffer);
+      break;
+    }
+
+    istringstream head(buffer.substr(0, headerEnd));
+    string target, version, line;
+    Request request;
+    head >> request.method >> target >> version;
+    getline(head, line);
+
+    size_t contentLength = 0;
+    bool expectContinue = false;
+    while (getline(head, line)) {
+      size_t colon = line.find(':');
+      if (colon == string::npos) {
+        continue;
+      }
+      string name = lower(line.substr(0, colon));
+      string value = line.substr(colon + 1);
+      value.erase(0, value.find_first_not_of(" \t"));
+      value.erase(value.find_last_not_of(" \t\r") + 1);
+      if (name == "content-length") {
+        contentLength = strtoul(value.c_str(), NULL, 10);
+      } else if (name == "expect" && lower(value) == "100-continue") {
+        expectContinue = true;
+      }
+    }
+
+    buffer.erase(0, headerEnd + 4);
+    if (expectContinue && buffer.size() < contentLength
+        && !sendAll(fd, "HTTP/1.1 100 Continue\r\n\r\n")) {
+      break;
+    }
+    while (buffer.size() < contentLength) {
+      ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+      if (n <= 0) {
+        open = false;
+        break;
+      }
+      buffer.append(chunk, n);
+    }
+    if (!open) {
+      break;
+    }
+
+    string body = buffer.substr(0, contentLength);
+    buffer.erase(0, contentLength);
+
+    setTarget(request, target);
+    parseForm(body, request.form);
+    request.body = body;
+
+    int status = 200;
+    string response = handle(request, status);
+    requests++;
+
+    ostringstream out;
+    out << "HTTP/1.1 " << status << " " << statusText(status) << "\r\n"
+        << "Content-Type: application/json\r\n"
+        << "X-Etcd-Index: " << getIndex() << "\r\n"
+        << "Content-Length: " << response.size() << "\r\n"
+        << "\r\n"
+        << response;
+    if (!sendAll(fd, out.str())) {
+      break;
+    }
+  }
+
+  lock_guard<mutex> guard(connectionsLock);
+  connections.erase(find(connections.begin(), connections.end(), fd));
+  close(fd);
+}
+
+void MockServer::setTarget(Request &request, const string &target) {
+  size_t question = target.find('?');
+  request.path = decode(target.substr(0, question), false);
+  if (question != string::npos) {
+    parseForm(target.substr(question + 1), request.query);
+  }
+}
+
+/**
+ * One h2c connection. The nghttp2 session is only used by the thread
+ * serving the connection; the threads answering its streams queue
+ * their answers in ready and wake it up through a pipe.
+ */
+struct MockServer::Http2Connection {
+  struct Incoming {
+    Request request;
+    string body;
+  };
+
+  // headers of a stream, its body as well once complete
+  struct Answer {
+    int32_t stream;
+    int status;
+    string body;
+    bool complete;
+  };
+
+  struct Outgoing {
+    string body;
+    size_t sent;
+    bool started;
+    bool complete;
+  };
+
+  Http2Connection(MockServer *server, int fd);
+  ~Http2Connection();
+
+  bool receive(const char *data, size_t size);
+  bool flush();
+  void answer(int32_t stream, const Request &request);
+  void post(const Answer &answer);
+
+  static ssize_t onSend(nghttp2_session*, const uint8_t *data, size_t length,
+                        int, void *self);
+  static int onBeginHeaders(nghttp2_session*, const nghttp2_frame *frame,
+                            void *self);
+  static int onHeader(nghttp2_session*, const nghttp2_frame *frame,
+                      const uint8_t *name, size_t nameLength,
+                      const uint8_t *value, size_t valueLength,
+                      uint8_t, void *self);
+  static int onData(nghttp2_session*, uint8_t, int32_t stream,
+                    const uint8_t *data, size_t length, void *self);
+  static int onFrame(nghttp2_session*, const nghttp2_frame *frame,
+                     void *self);
+  static int onClose(nghttp2_session*, int32_t stream, uint32_t, void *self);
+  static ssize_t readBody(nghttp2_session*, int32_t stream, uint8_t *buffer,
+                          size_t length, uint32_t *flags,
+                          nghttp2_data_source*, void *self);
+
+  MockServer *server;
+  int fd;
+  int wake[2];
+  nghttp2_session *session;
+  map<int32_t, Incoming> incoming;
+  map<int32_t, Outgoing> outgoing;
+
+  mutex lock;
+  condition_variable idle;
+  vector<Answer> ready;
+  size_t answering;
+};
+
+MockServer::Http2Connection::Http2Connection(MockServer *server, int fd) :
+  server(server),
+  fd(fd),
+  session(NULL),
+  answering(0) {
+
+  if (pipe(wake) < 0) {
+    throw runtime_error("mock server: pipe failed");
+  }
+
+  nghttp2_session_callbacks *callbacks;
+  nghttp2_session_callbacks_new(&callbacks);
+  nghttp2_session_callbacks_set_send_callback(callbacks, &onSend);
+  nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, &onBeginHeaders);
+  nghttp2_session_callbacks_set_on_header_callback(callbacks, &onHeader);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, &onData);
+  nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, &onFrame);
+  nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, &onClose);
+  nghttp2_session_server_new(&session, callbacks, this);
+  nghttp2_session_callbacks_del(callbacks);
+
+  nghttp2_settings_entry settings[] = {
+    { NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 1000 }
+  };
+  nghttp2_submit_settings(session, NGHTTP2_FLAG_NONE, settings, 1);
+}
+
+/**
+ * Waits for the streams still being answered, which return once the
+ * server stops if nothing else answers their waits.
+ */
+MockServer::Http2Connection::~Http2Connection() {
+  {
+    unique_lock<mutex> guard(lock);
+    idle.wait(guard, [this]() { return answering == 0; });
+  }
+  nghttp2_session_del(session);
+  close(wake[0]);
+  close(wake[1]);
+}
+
+bool MockServer::Http2Connection::receive(const char *data, size_t size) {
+  return nghttp2_session_mem_recv(session, (const uint8_t*) data, size) >= 0;
+}
+
+/**
+ * Submits the answers which are ready and sends whatever the session
+ * has to send, returning false once the connection is done.
+ */
+bool MockServer::Http2Connection::flush() {
+  vector<Answer> answers;
+  {
+    lock_guard<mutex> guard(lock);
+    answers.swap(ready);
+  }
+
+  for (Answer &answer : answers) {
+    // the client may have reset the stream in the meantime
+    map<int32_t, Outgoing>::iterator it = outgoing.find(answer.stream);
+    if (it == outgoing.end()) {
+      continue;
+    }
+    Outgoing &out = it->second;
+    if (answer.complete) {
+      out.body.swap(answer.body);
+      out.complete = true;
+    }
+    if (out.started) {
+      nghttp2_session_resume_data(session, answer.stream);
+      continue;
+    }
+    out.started = true;
+
+    string status = to_string(answer.status);
+    string index = to_string(server->getIndex());
+    nghttp2_nv headers[] = {
+      { (uint8_t*) ":status", (uint8_t*) status.data(), 7, status.size(),
+        NGHTTP2_NV_FLAG_NONE },
+      { (uint8_t*) "content-type", (uint8_t*) "application/json", 12, 16,
+        NGHTTP2_NV_FLAG_NONE },
+      { (uint8_t*) "x-etcd-index", (uint8_t*) index.data(), 12, index.size(),
+        NGHTTP2_NV_FLAG_NONE }
+    };
+    nghttp2_data_provider provider;
+    provider.source.ptr = NULL;
+    provider.read_callback = &readBody;
+    nghttp2_submit_response(session, answer.stream, headers, 3, &provider);
+  }
+
+  return nghttp2_session_send(session) == 0
+    && (nghttp2_session_want_read(session) || nghttp2_session_want_write(session));
+}
+
+/**
+ * Answers request on a thread of its own, as a wait may take a while.
+ */
+void MockServer::Http2Connection::answer(int32_t stream, const Request &request) {
+  {
+    lock_guard<mutex> guard(lock);
+    answering++;
+  }
+  Outgoing out = { "", 0, false, false };
+  outgoing[stream] = out;
+
+  Request waiting = request;
+  waiting.waiting = [this, stream]() {
+    Answer headers = { stream, 200, "", false };
+    post(headers);
+  };
+
+  thread([this, stream, waiting]() {
+      Answer answer = { stream, 200, "", true };
+      answer.body = server->handle(waiting, answer.status);
+      server->requests++;
+      post(answer);
+
+      lock_guard<mutex> guard(lock);
+      answering--;
+      idle.notify_all();
+    }).detach();
+}
+
+void MockServer::Http2Connection::post(const Answer &answer) {
+  {
+    lock_guard<mutex> guard(lock);
+    ready.push_back(answer);
+  }
+  char byte = 0;
+  if (write(wake[1], &byte, 1) < 0) {
+    // the connection polls again shortly anyway
+  }
+}
+
+ssize_t MockServer::Http2Connection::onSend(nghttp2_session*, const uint8_t *data,
+                                            size_t length, int, void *self) {
+  Http2Connection *connection = (Http2Connection*) self;
+  if (!sendAll(connection->fd, string((const char*) data, length))) {
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  }
+  return length;
+}
+
+int MockServer::Http2Connection::onBeginHeaders(nghttp2_session*,
+                                                const nghttp2_frame *frame,
+                                                void *self) {
+  if (frame->hd.type == NGHTTP2_HEADERS
+      && frame->headers.cat == NGHTTP2_HCAT_REQUEST) {
+    ((Http2Connection*) self)->incoming[frame->hd.stream_id] = Incoming();
+  }
+  return 0;
+}
+
+int MockServer::Http2Connection::onHeader(nghttp2_session*,
+                                          const nghttp2_frame *frame,
+                                          const uint8_t *name, size_t nameLength,
+                                          const uint8_t *value, size_t valueLength,
+                                          uint8_t, void *self) {
+  Http2Connection *connection = (Http2Connection*) self;
+  map<int32_t, Incoming>::iterator it =
+    connection->incoming.find(frame->hd.stream_id);
+  if (it == connection->incoming.end()) {
+    return 0;
+  }
+
+  string header((const char*) name, nameLength);
+  string content((const char*) value, valueLength);
+  if (header == ":method") {
+    it->second.request.method = content;
+  } else if (header == ":path") {
+    setTarget(it->second.request, content);
+  }
+  return 0;
+}
+
+int MockServer::Http2Connection::onData(nghttp2_session*, uint8_t,
+                                        int32_t stream, const uint8_t *data,
+                                        size_t length, void *self) {
+  Http2Connection *connection = (Http2Connection*) self;
+  map<int32_t, Incoming>::iterator it = connection->incoming.find(stream);
+  if (it != connection->incoming.end()) {
+    it->second.body.append((const char*) data, length);
+  }
+  return 0;
+}
+
+int MockServer::Http2Connection::onFrame(nghttp2_session*,
+                                         const nghttp2_frame *frame,
+                                         void *self) {
+  Http2Connection *connection = (Http2Connection*) self;
+  if ((frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA)
+      || (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) == 0) {
+    return 0;
+  }
+
+  map<int32_t, Incoming>::iterator it =
+    connection->incoming.find(frame->hd.stream_id);
+  if (it == connection->incoming.end()) {
+    return 0;
+  }
+  parseForm(it->second.body, it->second.request.form);
+  it->second.request.body = it->second.body;
+  connection->answer(it->first, it->second.request);
+  connection->incoming.erase(it);
+  return 0;
+}
+
+int MockServer::Http2Connection::onClose(nghttp2_session*, int32_t stream,
+                                         uint32_t, void *self) {
+  Http2Connection *connection = (Http2Connection*) self;
+  connection->incoming.erase(stream);
+  connection->outgoing.erase(stream);
+  return 0;
+}
+
+ssize_t MockServer::Http2Connection::readBody(nghttp2_session*, int32_t stream,
+                                              uint8_t *buffer, size_t length,
+                                              uint32_t *flags,
+                                              nghttp2_data_source*, void *self) {
+  Outgoing &out = ((Http2Connection*) self)->outgoing[stream];
+  if (!out.complete) {
+    return NGHTTP2_ERR_DEFERRED;
+  }
+  size_t n = min(length, out.body.size() - out.sent);
+  memcpy(buffer, out.body.data() + out.sent, n);
+  out.sent += n;
+  if (out.sent == out.body.size()) {
+    *flags |= NGHTTP2_DATA_FLAG_EOF;
+  }
+  return n;
+}
+
+/**
+ * Serves a connection which started with the HTTP/2 preface, of which
+ * received holds what was read so far.
+ */
+void MockServer::serveHttp2(int fd, const string &received) {
+  Http2Connection connection(this, fd);
+  if (!connection.receive(received.data(), received.size())) {
+    return;
+  }
+
+  char chunk[16384];
+  while (!stopping && connection.flush()) {
+    pollfd fds[] = { { fd, POLLIN, 0 }, { connection.wake[0], POLLIN, 0 } };
+    if (poll(fds, 2, 100) < 0) {
+      break;
+    }
+    if (fds[1].revents & POLLIN) {
+      if (read(connection.wake[0], chunk, sizeof(chunk)) < 0) {
+        break;
+      }
+    }
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+      if (n <= 0 || !connection.receive(chunk, n)) {
+        break;
+      }
+    }
+  }
+}
+
+/**
+ * Value of a form field, or of the query parameter of the same name.
+ */
+string MockServer::param(const Request &request, const string &name) {
+  map<string, string>::const_iterator it = request.form.find(name);
+  if (it != request.form.end()) {
+    return it->second;
+  }
+  it = request.query.find(name);
+  return it != request.query.end() ? it->second : "";
+}
+
+string MockServer::handle(const Request &request, int &status) {
+  if (request.path == "/v2/stats/self") {
+    return "{\"name\":\"mock\",\"state\":\"StateLeader\"}";
+  }
+
+  if (request.path.compare(0, 4, "/v3/") == 0 && request.method == "POST") {
+    return handleV3(request, status);
+  }
+
+  if (request.path.compare(0, 8, "/v2/keys") != 0) {
+    status = 404;
+    return "404 page not found\n";
+  }
+
+  if (request.method == "GET") {
+    return handleGet(request, status);
+  } else if (request.method == "PUT" || request.method == "POST") {
+    return handleSet(request, status);
+  } else if (request.method == "DELETE") {
+    return handleDelete(request, status);
+  }
+
+  status = 405;
+  return "";
+}
+
+string MockServer::error(int code, const string &cause, int &status) {
+  const char *message;
+  switch (code) {
+  case 100: message = "Key not found"; break;
+  case 101: message = "Compare failed"; break;
+  case 102: message = "Not a file"; break;
+  case 104: message = "Not a directory"; break;
+  case 105: message = "Key already exists"; break;
+  case 107: message = "Root is read only"; break;
+  case 108: message = "Directory not empty"; break;
+  case 401: message = "The event in requested index is outdated and cleared"; break;
+  default: message = "Error";
+  }
+
+  status = errorStatus(code);
+  ostringstream out;
+  out << "{\"errorCode\":" << code
+      << ",\"message\":\"" << message
+      << "\",\"cause\":\"" << escape(cause)
+      << "\",\"index\":" << index << "}";
+  return out.str();
+}
+
+string MockServer::nodeJson(const string &key, const Entry &entry,
+                            bool recursive, bool expand) {
+  ostringstream out;
+  out << "{\"key\":\"" << escape(key) << "\"";
+  if (entry.dir) {
+    out << ",\"dir\":true";
+    if (expand) {
+      out << ",\"nodes\":[";
+      string prefix = childPrefix(key);
+      bool first = true;
+      map<string, Entry>::iterator it = entries.lower_bound(prefix);
+      while (it != entries.end()
+             && it->first.compare(0, prefix.size(), prefix) == 0) {
+        if (it->first == key) {
+          ++it;
+          continue;
+        }
+        size_t slash = it->first.find('/', prefix.size());
+        if (slash != string::npos) {
+          // a grandchild, skip past the rest of its directory
+          it = entries.lower_bound(it->first.substr(0, slash) + "0");
+          continue;
+        }
+        out << (first ? "" : ",")
+            << nodeJson(it->first, it->second, recursive, recursive);
+        first = false;
+        ++it;
+      }
+      out << "]";
+    }
+  } else {
+    out << ",\"value\":\"" << escape(entry.value) << "\"";
+  }
+  if (entry.ttl > 0) {
+    out << ",\"expiration\":\"" << entry.expiration
+        << "\",\"ttl\":" << entry.ttl;
+  }
+  if (key != "/") {
+    out << ",\"modifiedIndex\":" << entry.modifiedIndex
+        << ",\"createdIndex\":" << entry.createdIndex;
+  }
+  out << "}";
+  return out.str();
+}
+
+string MockServer::handleGet(const Request &request, int &status) {
+  string key = normalize(request.path.substr(8));
+  if (isTrue(request.query, "wait")) {
+    return handleWait(request, key, status);
+  }
+
+  lock_guard<mutex> guard(lock);
+  map<string, Entry>::iterator it = entries.find(key);
+  if (it == entries.end()) {
+    return error(100, key, status);
+  }
+
+  return "{\"action\":\"get\",\"node\":"
+    + nodeJson(key, it->second, isTrue(request.query, "recursive"), true)
+    + "}";
+}
+
+/**
+ * Answers with the first change to key (or below it, when recursive) at
+ * or after waitIndex, waiting for one if it hasn't happened yet.
+ */
+string MockServer::handleWait(const Request &request, const string &key,
+                              int &status) {
+  bool recursive = isTrue(request.query, "recursive");
+  string waitIndex = param(request, "waitIndex");
+
+  unique_lock<mutex> guard(lock);
+  uint64_t from = waitIndex.empty()
+    ? index + 1
+    : strtoull(waitIndex.c_str(), NULL, 10);
+
+  if (from <= cleared) {
+    ostringstream cause;
+    cause << "the requested history has been cleared ["
+          << cleared + 1 << "/" << from << "]";
+    return error(401, cause.str(), status);
+  }
+
+  if (request.waiting) {
+    request.waiting();
+  }
+  while (!stopping) {
+    for (const Event &event : history) {
+      if (event.node.modifiedIndex < from
+          || !(event.key == key || (recursive && isUnder(event.key, key)))) {
+        continue;
+      }
+
+      string body = "{\"action\":\"" + event.action + "\",\"node\":"
+        + nodeJson(event.key, event.node, false, false) + "}";
+      guard.unlock();
+      if (waitDelay > 0) {
+        this_thread::sleep_for(chrono::milliseconds(waitDelay));
+      }
+      return body;
+    }
+    changed.wait_for(guard, chrono::milliseconds(100));
+  }
+
+  status = 500;
+  return "";
+}
+
+/**
+ * Creates the missing directories above key, failing if one of them
+ * is a file.
+ */
+bool MockServer::makeParents(const string &key, int &status, string &body) {
+  vector<string> missing;
+  for (size_t slash = key.rfind('/'); slash > 0; slash = key.rfind('/', slash - 1)) {
+    string parent = key.substr(0, slash);
+    map<string, Entry>::iterator it = entries.find(parent);
+    if (it != entries.end()) {
+      if (!it->second.dir) {
+        body = error(104, parent, status);
+        return false;
+      }
+      break;
+    }
+    missing.push_back(parent);
+  }
+
+  for (const string &parent : missing) {
+    Entry dir = { "", true, 0, "", index + 1, index + 1 };
+    entries[parent] = dir;
+  }
+  return true;
+}
+
+void MockServer::record(const string &action, const string &key,
+                        const Entry &node) {
+  Event event = { action, key, node };
+  history.push_back(event);
+  while (history.size() > historySize) {
+    cleared = history.front().node.modifiedIndex;
+    history.pop_front();
+  }
+  changed.notify_all();
+}
+
+/**
+ * Checks the prevValue and prevIndex conditions of request against
+ * entry, describing the mismatch in cause the way etcd does.
+ */
+bool MockServer::compare(const Request &request, const Entry &entry,
+                         string &cause) {
+  string prevValue = param(request, "prevValue");
+  string prevIndex = param(request, "prevIndex");
+  bool valueMatches = prevValue.empty() || prevValue == entry.value;
+  bool indexMatches = prevIndex.empty()
+    || strtoull(prevIndex.c_str(), NULL, 10) == entry.modifiedIndex;
+
+  ostringstream out;
+  if (!valueMatches) {
+    out << "[" << prevValue << " != " << entry.value << "]";
+  }
+  if (!indexMatches) {
+    out << (valueMatches ? "" : " ")
+        << "[" << prevIndex << " != " << entry.modifiedIndex << "]";
+  }
+  cause = out.str();
+  return valueMatches && indexMatches;
+}
+
+string MockServer::handleSet(const Request &request, int &status) {
+  string key = normalize(request.path.substr(8));
+  bool dir = param(request, "dir") == "true";
+  string ttl = param(request, "ttl");
+  string prevExist = param(request, "prevExist");
+  bool refresh = param(request, "refresh") == "true";
+  bool conditional = !param(request, "prevValue").empty()
+    || !param(request, "prevIndex").empty();
+
+  lock_guard<mutex> guard(lock);
+  string action = "set";
+  if (request.method == "POST") {
+    map<string, Entry>::iterator parent = entries.find(key);
+    if (parent != entries.end() && !parent->second.dir) {
+      return error(104, key, status);
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "/%020llu", (unsigned long long) index + 1);
+    key = (key == "/" ? "" : key) + name;
+    action = "create";
+  }
+
+  if (key == "/") {
+    return error(107, key, status);
+  }
+
+  map<string, Entry>::iterator existing = entries.find(key);
+  if (existing != entries.end() && existing->second.dir) {
+    return error(102, key, status);
+  }
+
+  if (existing == entries.end()) {
+    if (prevExist == "true" || refresh || conditional) {
+      return error(100, key, status);
+    }
+  } else {
+    string cause;
+    if (prevExist == "false") {
+      return error(105, key, status);
+    }
+    if (!compare(request, existing->second, cause)) {
+      return error(101, cause, status);
+    }
+  }
+
+  if (prevExist == "false") {
+    action = "create";
+  } else if (conditional) {
+    action = "compareAndSwap";
+  } else if (prevExist == "true" || refresh) {
+    action = "update";
+  }
+
+  string body;
+  if (!makeParents(key, status, body)) {
+    return body;
+  }
+
+  index++;
+  Entry entry = { refresh ? existing->second.value : param(request, "value"), dir,
+                  atoi(ttl.c_str()), "", index, index };
+  if (entry.ttl > 0) {
+    time_t expires = time(NULL) + entry.ttl;
+    tm utc;
+    gmtime_r(&expires, &utc);
+    char formatted[32];
+    strftime(formatted, sizeof(formatted), "%Y-%m-%dT%H:%M:%SZ", &utc);
+    entry.expiration = formatted;
+  }
+
+  string prevNode;
+  if (existing != entries.end()) {
+    entry.createdIndex = existing->second.createdIndex;
+    prevNode = ",\"prevNode\":"
+      + nodeJson(key, existing->second, false, false);
+  } else {
+    status = 201;
+  }
+
+  entries[key] = entry;
+  if (!refresh) {
+    record(action, key, entry);
+  }
+
+  return "{\"action\":\"" + action + "\",\"node\":"
+    + nodeJson(key, entry, false, false) + prevNode + "}";
+}
+
+string MockServer::handleDelete(const Request &request, int &status) {
+  string key = normalize(request.path.substr(8));
+  bool dir = param(request, "dir") == "true";
+  bool recursive = param(request, "recursive") == "true";
+
+  lock_guard<mutex> guard(lock);
+  if (key == "/") {
+    return error(107, key, status);
+  }
+
+  map<string, Entry>::iterator it = entries.find(key);
+  if (it == entries.end()) {
+    return error(100, key, status);
+  }
+
+  Entry previous = it->second;
+  if (previous.dir && !dir && !recursive) {
+    return error(102, key, status);
+  }
+
+  string action = "delete";
+  if (!param(request, "prevValue").empty()
+      || !param(request, "prevIndex").empty()) {
+    string cause;
+    if (!compare(request, previous, cause)) {
+      return error(101, cause, status);
+    }
+    action = "compareAndDelete";
+  }
+
+  string prefix = childPrefix(key);
+  map<string, Entry>::iterator child = entries.lower_bound(prefix);
+  bool hasChildren = child != entries.end()
+    && child->first.compare(0, prefix.size(), prefix) == 0;
+  if (hasChildren && !recursive) {
+    return error(108, key, status);
+  }
+
+  while (child != entries.end()
+         && child->first.compare(0, prefix.size(), prefix) == 0) {
+    child = entries.erase(child);
+  }
+  entries.erase(key);
+
+  index++;
+  Entry removed = { "", previous.dir, 0, "", previous.createdIndex, index };
+  record(action, key, removed);
+
+  string node = "{\"key\":\"" + escape(key) + "\"";
+  if (previous.dir) {
+    node += ",\"dir\":true";
+  }
+  ostringstream indexes;
+  indexes << ",\"modifiedIndex\":" << index
+          << ",\"createdIndex\":" << previous.createdIndex << "}";
+
+  return "{\"action\":\"" + action + "\",\"node\":" + node + indexes.str()
+    + ",\"prevNode\":" + nodeJson(key, previous, false, false) + "}";
+}
+
+/**
+ * The pairs of a v3 range: key alone if end is empty, every key from
+ * key on if end is "\0", the keys from key up to end otherwise.
+ */
+static bool inRange(const string &k, const string &key, const string &end) {
+  if (end.empty()) {
+    return k == key;
+  }
+  return k >= key && (end == string(1, '\0') || k < end);
+}
+
+string MockServer::pairJson(const string &key, const Pair &pair,
+                            bool keysOnly) {
+  ostringstream out;
+  out << "{\"key\":\"" << toBase64(key)
+      << "\",\"create_revision\":\"" << pair.createRevision
+      << "\",\"mod_revision\":\"" << pair.modRevision
+      << "\",\"version\":\"" << pair.version << "\"";
+  if (pair.lease != 0) {
+    out << ",\"lease\":\"" << pair.lease << "\"";
+  }
+  if (!keysOnly && !pair.value.empty()) {
+    out << ",\"value\":\"" << toBase64(pair.value) << "\"";
+  }
+  out << "}";
+  return out.str();
+}
+
+/**
+ * Answers the range, put and deleterange calls of the v3 JSON gateway.
+ * Ranges are always read as of the latest revision, the mock keeps no
+ * older ones.
+ */
+string MockServer::handleV3(const Request &request, int &status) {
+  map<string, string> fields;
+  parseJson(request.body, fields);
+  string key = fromBase64(fields["key"]);
+  string end = fromBase64(fields["range_end"]);
+
+  // like etcd, which wants "\0" for the start of the keyspace
+  if (key.empty()) {
+    status = 400;
+    return "{\"error\":\"etcdserver: key is not provided\",\"code\":3,"
+      "\"message\":\"etcdserver: key is not provided\"}";
+  }
+
+  lock_guard<mutex> guard(lock);
+  ostringstream out;
+
+  if (request.path == "/v3/kv/range") {
+    int64_t limit = strtoll(fields["limit"].c_str(), NULL, 10);
+    bool keysOnly = fields["keys_only"] == "true";
+    bool countOnly = fields["count_only"] == "true";
+    int64_t count = 0;
+    bool more = false;
+    out << "{\"header\":{\"revision\":\"" << revision << "\"}";
+    if (!countOnly) {
+      out << ",\"kvs\":[";
+    }
+    for (map<string, Pair>::iterator it = pairs.lower_bound(key);
+         it != pairs.end() && inRange(it->first, key, end);
+         ++it) {
+      if (limit > 0 && count >= limit) {
+        more = true;
+      } else if (!countOnly) {
+        out << (count > 0 ? "," : "") << pairJson(it->first, it->second, keysOnly);
+      }
+      count++;
+    }
+    if (!countOnly) {
+      out << "]";
+    }
+    if (more) {
+      out << ",\"more\":true";
+    }
+    out << ",\"count\":\"" << count << "\"}";
+    return out.str();
+  }
+
+  if (request.path == "/v3/kv/put") {
+    revision++;
+    map<string, Pair>::iterator it = pairs.find(key);
+    string previous;
+    if (it != pairs.end() && fields["prev_kv"] == "true") {
+      previous = ",\"prev_kv\":" + pairJson(key, it->second, false);
+    }
+    Pair &pair = pairs[key];
+    if (pair.version == 0) {
+      pair.createRevision = revision;
+    }
+    pair.value = fromBase64(fields["value"]);
+    pair.modRevision = revision;
+    pair.version++;
+    pair.lease = strtoll(fields["lease"].c_str(), NULL, 10);
+    out << "{\"header\":{\"revision\":\"" << revision << "\"}"
+        << previous << "}";
+    return out.str();
+  }
+
+  if (request.path == "/v3/kv/deleterange") {
+    int64_t deleted = 0;
+    map<string, Pair>::iterator it = pairs.lower_bound(key);
+    while (it != pairs.end() && inRange(it->first, key, end)) {
+      it = pairs.erase(it);
+      deleted++;
+    }
+    if (deleted > 0) {
+      revision++;
+    }
+    out << "{\"header\":{\"revision\":\"" << revision << "\"}";
+    if (deleted > 0) {
+      out << ",\"deleted\":\"" << deleted << "\"";
+    }
+    out << "}";
+    return out.str();
+  }
+
+  // the gateway answers unknown calls with gRPC code 12 (unimplemented)
+  status = 501;
+  return "{\"error\":\"not implemented\",\"code\":12,"
+    "\"message\":\"not implemented\"}";
+}
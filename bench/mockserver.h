@@ -0,0 +1,159 @@
+#ifndef ETCDCLIENT_BENCH_MOCKSERVER_cxx_
+#define ETCDCLIENT_BENCH_MOCKSERVER_cxx_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/**
+ * In-process etcd stand-in listening on a loopback port, speaking enough
+ * of the v2 keys API for the client to be measured without a cluster:
+ * GET (recursive, sorted, wait/waitIndex), PUT (value, ttl, dir,
+ * prevValue, prevIndex, prevExist, refresh), POST (in-order keys) and
+ * DELETE (dir, recursive, prevValue, prevIndex), plus /v2/stats/self
+ * reporting itself as the leader. Of the v3 JSON gateway it answers
+ * /v3/kv/range (limit, keys_only, count_only), /v3/kv/put and
+ * /v3/kv/deleterange, on a keyspace of its own.
+ *
+ * Failures are answered the way etcd answers them, with an errorCode
+ * body (100 key not found, 101 compare failed, 102 not a file, 104 not
+ * a directory, 105 key already exists, 108 directory not empty, 401
+ * event index cleared). Waits are answered
+ * from a bounded history of changes, or once a matching change happens,
+ * optionally after a configured delay.
+ *
+ * Each connection is served by its own thread with keep-alive, TTLs are
+ * reported but never expire. Connections opening with the HTTP/2
+ * preface are served as h2c, each of their streams answered on a
+ * thread of its own so that a pending wait holds up no other stream.
+ * Like etcd, they send the headers of a valid wait right away.
+ */
+class MockServer {
+public:
+  MockServer();
+  ~MockServer();
+
+  int getPort() const { return port; }
+
+  /**
+   * Delays every answer to a wait by millis, in addition to the time
+   * spent waiting for a matching change.
+   */
+  void setWaitDelay(int millis) { waitDelay = millis; }
+
+  /**
+   * Number of changes kept for answering waits on past indexes, waits
+   * before the oldest of them fail with error 401.
+   */
+  void setHistorySize(size_t size);
+
+  /**
+   * Number of requests answered since the server started.
+   */
+  unsigned long getRequests() const { return requests; }
+
+  /**
+   * Number of connections accepted since the server started.
+   */
+  unsigned long getConnections() const { return accepted; }
+
+  /**
+   * Index of the latest change (X-Etcd-Index).
+   */
+  uint64_t getIndex();
+
+private:
+  struct Entry {
+    string value;
+    bool dir;
+    int ttl;
+    string expiration;
+    uint64_t createdIndex;
+    uint64_t modifiedIndex;
+  };
+
+  struct Event {
+    string action;
+    string key;
+    Entry node;
+  };
+
+  // pair of the v3 keyspace, which is kept apart from the v2 one
+  struct Pair {
+    Pair() : createRevision(0), modRevision(0), version(0), lease(0) {}
+
+    string value;
+    int64_t createRevision;
+    int64_t modRevision;
+    int64_t version;
+    int64_t lease;
+  };
+
+  struct Request {
+    string method;
+    string path;
+    map<string, string> query;
+    map<string, string> form;
+    string body;
+    // called once a wait is known to be valid, before it blocks
+    function<void ()> waiting;
+  };
+
+  struct Http2Connection;
+
+  MockServer(const MockServer&);
+  MockServer& operator=(const MockServer&);
+
+  void acceptLoop();
+  void serve(int fd);
+  void serveHttp2(int fd, const string &received);
+  static void setTarget(Request &request, const string &target);
+  string handle(const Request &request, int &status);
+  string handleGet(const Request &request, int &status);
+  string handleWait(const Request &request, const string &key, int &status);
+  string handleSet(const Request &request, int &status);
+  string handleDelete(const Request &request, int &status);
+  string handleV3(const Request &request, int &status);
+  static string pairJson(const string &key, const Pair &pair, bool keysOnly);
+  string error(int code, const string &cause, int &status);
+  bool compare(const Request &request, const Entry &entry, string &cause);
+  static string param(const Request &request, const string &name);
+
+  bool makeParents(const string &key, int &status, string &body);
+  void record(const string &action, const string &key, const Entry &node);
+  string nodeJson(const string &key, const Entry &entry,
+                  bool recursive, bool sorted);
+
+  int listenFd;
+  int port;
+  atomic<bool> stopping { false };
+  atomic<int> waitDelay { 0 };
+  atomic<unsigned long> requests { 0 };
+  atomic<unsigned long> accepted { 0 };
+
+  mutex lock;
+  condition_variable changed;
+  map<string, Entry> entries;
+  deque<Event> history;
+  size_t historySize;
+  uint64_t cleared;
+  uint64_t index;
+  map<string, Pair> pairs;
+  int64_t revision;
+
+  mutex connectionsLock;
+  vector<int> connections;
+  vector<thread> workers;
+  thread acceptor;
+};
+
+#endif
@@ -0,0 +1,194 @@
+#include <curl/curl.h>
+#include <future>
+#include <memory>
+#include <sstream>
+#include <string>
+#include "rapidjson/document.h"
+#include "asyncsession.h"
+#include "encoding.h"
+#include "eventloop.h"
+#include "internal.h"
+
+using namespace std;
+using namespace rapidjson;
+using namespace etcd;
+
+/**
+ * Wraps a promise into a callback fulfilling it.
+ */
+template <typename R>
+function<void (unique_ptr<R>)> fulfil(shared_ptr<promise<unique_ptr<R> > > p) {
+  return [p](unique_ptr<R> r) {
+    p->set_value(move(r));
+  };
+}
+
+AsyncSession::AsyncSession(vector<Host> hosts) :
+  hostNo(0),
+  hosts(hosts),
+  loop(new EventLoop) {}
+
+AsyncSession::~AsyncSession() {
+  if (loop->isLoopThread()) {
+    // destroyed by one of its callbacks, which the loop thread is still
+    // running, so the loop is left to finish and delete itself
+    loop.release()->stopDetached();
+    return;
+  }
+  loop->stop();
+}
+
+Host &AsyncSession::nextHost() {
+  return hosts[hostNo++ % hosts.size()];
+}
+
+void AsyncSession::getHelper(string url, GetCallback cb) {
+  loop->submit([url](CURL *curl) {
+      curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    },
+    [url, cb](CURLcode res, long status, string &body) {
+      if (res != CURLE_OK) {
+        ResponseError *error =
+          ResponseError::transport(res, curl_easy_strerror(res), url);
+        cb(failure<GetResponse>(unique_ptr<ResponseError>(error)));
+        return;
+      }
+
+      ParsedResponse resp(body, status);
+      unique_ptr<ResponseError> error(checkResponse(resp, url));
+      if (error) {
+        cb(failure<GetResponse>(move(error)));
+        return;
+      }
+      cb(readGetResponse(resp.getDocument()));
+    });
+}
+
+void AsyncSession::putHelper(string url,
+                             string postData,
+                             string method,
+                             PutCallback cb) {
+
+  loop->submit([url, postData, method](CURL *curl) {
+      curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method.c_str());
+      curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+      if (!postData.empty()) {
+        curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, postData.c_str());
+      }
+    },
+    [url, cb](CURLcode res, long status, string &body) {
+      if (res != CURLE_OK) {
+        ResponseError *error =
+          ResponseError::transport(res, curl_easy_strerror(res), url);
+        cb(failure<PutResponse>(unique_ptr<ResponseError>(error)));
+        return;
+      }
+
+      ParsedResponse resp(body, status);
+      unique_ptr<ResponseError> error(checkResponse(resp, url));
+      if (error) {
+        cb(failure<PutResponse>(move(error)));
+        return;
+      }
+      cb(readPutResponse(resp.getDocument()));
+    });
+}
+
+future<unique_ptr<GetResponse> > AsyncSession::getAsync(string key) {
+  return getAsync(key, false);
+}
+
+void AsyncSession::getAsync(string key, GetCallback cb) {
+  getAsync(key, false, cb);
+}
+
+future<unique_ptr<GetResponse> > AsyncSession::getAsync(string key,
+                                                        bool recursive) {
+  auto p = make_shared<promise<unique_ptr<GetResponse> > >();
+  getAsync(key, recursive, fulfil(p));
+  return p->get_future();
+}
+
+void AsyncSession::getAsync(string key, bool recursive, GetCallback cb) {
+  ostringstream url;
+  url << base_url(nextHost(), key) << (recursive ? "?recursive=true" : "");
+  getHelper(url.str(), cb);
+}
+
+future<unique_ptr<GetResponse> > AsyncSession::waitAsync(string key,
+                                                         bool recursive,
+                                                         int64_t waitIndex) {
+  auto p = make_shared<promise<unique_ptr<GetResponse> > >();
+  waitAsync(key, recursive, waitIndex, fulfil(p));
+  return p->get_future();
+}
+
+void AsyncSession::waitAsync(string key,
+                             bool recursive,
+                             int64_t waitIndex,
+                             GetCallback cb) {
+  ostringstream url;
+  url << base_url(nextHost(), key) << "?wait=true";
+  if (waitIndex > 0) {
+    url << "&waitIndex=" << waitIndex;
+  }
+  if (recursive) {
+    url << "&recursive=true";
+  }
+  getHelper(url.str(), cb);
+}
+
+future<unique_ptr<PutResponse> > AsyncSession::putAsync(string key,
+                                                        string value) {
+  auto p = make_shared<promise<unique_ptr<PutResponse> > >();
+  putAsync(key, value, fulfil(p));
+  return p->get_future();
+}
+
+void AsyncSession::putAsync(string key, string value, PutCallback cb) {
+  string postData = "value=";
+  appendEncoded(postData, value, false);
+  putHelper(base_url(nextHost(), key), postData, "PUT", cb);
+}
+
+future<unique_ptr<PutResponse> > AsyncSession::putAsync(string key,
+                                                        string value,
+                                                        int ttl) {
+  auto p = make_shared<promise<unique_ptr<PutResponse> > >();
+  putAsync(key, value, ttl, fulfil(p));
+  return p->get_future();
+}
+
+void AsyncSession::putAsync(string key,
+                            string value,
+                            int ttl,
+                            PutCallback cb) {
+  string postData = "value=";
+  appendEncoded(postData, value, false).append("&ttl=" + to_string(ttl));
+  putHelper(base_url(nextHost(), key), postData, "PUT", cb);
+}
+
+future<unique_ptr<PutResponse> > AsyncSession::addToQueueAsync(string key,
+                                                               string value) {
+  auto p = make_shared<promise<unique_ptr<PutResponse> > >();
+  addToQueueAsync(key, value, fulfil(p));
+  return p->get_future();
+}
+
+void AsyncSession::addToQueueAsync(string key,
+                                   string value,
+                                   PutCallback cb) {
+  string postData = "value=";
+  appendEncoded(postData, value, false);
+  putHelper(base_url(nextHost(), key), postData, "POST", cb);
+}
+
+future<unique_ptr<PutResponse> > AsyncSession::deleteKeyAsync(string key) {
+  auto p = make_shared<promise<unique_ptr<PutResponse> > >();
+  deleteKeyAsync(key, fulfil(p));
+  return p->get_future();
+}
+
+void AsyncSession::deleteKeyAsync(string key, PutCallback cb) {
+  putHelper(base_url(nextHost(), key), "", "DELETE", cb);
+}
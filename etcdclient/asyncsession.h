@@ -0,0 +1,109 @@
+#ifndef LIBETCDCLIENT_ASYNCSESSION_cxx_
+#define LIBETCDCLIENT_ASYNCSESSION_cxx_
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+#include "etcdclient.h"
+
+using namespace std;
+
+namespace etcd {
+  class EventLoop;
+
+  /**
+   * Non-blocking etcd client session. Requests are queued on a single
+   * event loop thread which keeps any number of them in flight at once,
+   * round-robin over the known hosts.
+   *
+   * Every request comes in two flavours, returning a future or calling
+   * a callback on completion. Callbacks run on the event loop thread and
+   * must not block. Failures to reach etcd are reported as responses
+   * with a TRANSPORT ResponseError rather than thrown.
+   */
+  class AsyncSession {
+  public:
+    typedef function<void (unique_ptr<GetResponse>)> GetCallback;
+    typedef function<void (unique_ptr<PutResponse>)> PutCallback;
+
+    AsyncSession(vector<Host> hosts);
+
+    /**
+     * Stops the event loop, outstanding requests complete with a
+     * TRANSPORT error. A session destroyed from one of its callbacks
+     * returns right away, the rest complete once the callback returns.
+     */
+    ~AsyncSession();
+
+    /**
+     * Send GET request to etcd server (non-recursive).
+     */
+    future<unique_ptr<GetResponse> > getAsync(string key);
+    void getAsync(string key, GetCallback cb);
+
+    /**
+     * Send GET request to etcd server.
+     */
+    future<unique_ptr<GetResponse> > getAsync(string key, bool recursive);
+    void getAsync(string key, bool recursive, GetCallback cb);
+
+    /**
+     * Waits for the next change in key or the directory at key, starting
+     * at waitIndex. A waitIndex of 0 waits for the next change from now.
+     */
+    future<unique_ptr<GetResponse> > waitAsync(string key,
+                                               bool recursive,
+                                               int64_t waitIndex);
+    void waitAsync(string key,
+                   bool recursive,
+                   int64_t waitIndex,
+                   GetCallback cb);
+
+    /**
+     * Send PUT request to etcd server to set or update the
+     * value of the node specified at key.
+     */
+    future<unique_ptr<PutResponse> > putAsync(string key, string value);
+    void putAsync(string key, string value, PutCallback cb);
+
+    /**
+     * Send PUT request to etcd server to set or update the
+     * value and ttl of the node specified at key.
+     */
+    future<unique_ptr<PutResponse> > putAsync(string key,
+                                              string value,
+                                              int ttl);
+    void putAsync(string key, string value, int ttl, PutCallback cb);
+
+    /**
+     * Send POST request to etcd server to atomically add an in-order
+     * key to a directory specified by key.
+     */
+    future<unique_ptr<PutResponse> > addToQueueAsync(string key,
+                                                     string value);
+    void addToQueueAsync(string key, string value, PutCallback cb);
+
+    /**
+     * Send DELETE request to etcd server for the node at key.
+     */
+    future<unique_ptr<PutResponse> > deleteKeyAsync(string key);
+    void deleteKeyAsync(string key, PutCallback cb);
+
+  private:
+    AsyncSession(const AsyncSession&);
+    AsyncSession& operator=(const AsyncSession&);
+
+    void getHelper(string url, GetCallback cb);
+    void putHelper(string url, string postData, string method, PutCallback cb);
+    Host &nextHost();
+
+    atomic<uint> hostNo;
+    vector<Host> hosts;
+    unique_ptr<EventLoop> loop;
+  };
+}
+
+#endif
@@ -0,0 +1,269 @@
+#include <curl/curl.h>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "etcdclient.h"
+#include "codec.h"
+#include "encoding.h"
+#include "hostselector.h"
+#include "internal.h"
+#include "metrics.h"
+
+using namespace std;
+using namespace etcd;
+
+/* requests of a batch in flight at once */
+static const size_t MAX_BATCH_CONCURRENCY = 32;
+
+struct BatchRequest {
+  const string *key;
+  const char *method;
+  string postData;
+  bool retry;
+};
+
+struct BatchResult {
+  CURLcode res;
+  long status;
+  string url;
+  string body;
+};
+
+struct InFlight {
+  size_t index;
+  uint host;
+  chrono::steady_clock::time_point start;
+};
+
+/**
+ * Sends all requests over one multi handle, at most
+ * MAX_BATCH_CONCURRENCY at a time. Reads which fail to reach their host
+ * are sent again to another host, in rounds, until every host was tried.
+ *
+ * The latency recorded for each request under op runs from the start of
+ * the batch, which is how long its caller waited for it.
+ */
+void send_many(ConnectionPool &pool,
+               HostSelector &selector,
+               MetricsRecorder &metrics,
+               const Logger &logger,
+               const vector<string> &prefixes,
+               int leader,
+               Metrics::Operation op,
+               const vector<BatchRequest> &requests,
+               vector<BatchResult> &results) {
+
+  chrono::steady_clock::time_point requested = chrono::steady_clock::now();
+
+  results.resize(requests.size());
+  vector<uint64_t> tried(requests.size(), 0);
+  vector<size_t> pending;
+  for (size_t i = 0; i < requests.size(); i++) {
+    pending.push_back(i);
+  }
+
+  for (size_t round = 0; !pending.empty() && round < prefixes.size(); round++) {
+    CURLM *multi = pool.acquireMulti();
+    map<CURL*, InFlight> inFlight;
+    size_t next = 0;
+
+    while (next < pending.size() || !inFlight.empty()) {
+      while (inFlight.size() < MAX_BATCH_CONCURRENCY && next < pending.size()) {
+        size_t index = pending[next++];
+        const BatchRequest &request = requests[index];
+        BatchResult &result = results[index];
+
+        uint host = leader != HostSelector::NONE && !request.retry
+          ? leader
+          : selector.select(tried[index]);
+        tried[index] |= host < 64 ? 1ull << host : 0;
+
+        result.url.assign(prefixes[host]);
+        appendEncoded(result.url, *request.key, true);
+        result.body.clear();
+        result.status = 0;
+        CURL *curl = pool.acquire(host);
+        if (curl == NULL) {
+          result.res = CURLE_FAILED_INIT;
+          continue;
+        }
+
+        curl_easy_setopt(curl, CURLOPT_URL, result.url.c_str());
+        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.method);
+        if (!request.postData.empty()) {
+          curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request.postData.c_str());
+        }
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &writer);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &result.body);
+
+        InFlight transfer = { index, host, chrono::steady_clock::now() };
+        inFlight[curl] = transfer;
+        curl_multi_add_handle(multi, curl);
+      }
+
+      int running = 0;
+      curl_multi_perform(multi, &running);
+
+      CURLMsg *msg;
+      int left = 0;
+      while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+        if (msg->msg != CURLMSG_DONE) {
+          continue;
+        }
+
+        CURL *curl = msg->easy_handle;
+        CURLcode res = msg->data.result;
+        InFlight transfer = inFlight[curl];
+        inFlight.erase(curl);
+        curl_multi_remove_handle(multi, curl);
+        results[transfer.index].res = res;
+
+        const string &url = results[transfer.index].url;
+        bool retried = round > 0;
+        if (res == CURLE_OK) {
+          chrono::steady_clock::time_point end = chrono::steady_clock::now();
+          chrono::duration<double> elapsed = end - transfer.start;
+          chrono::duration<double> total = end - requested;
+          selector.succeeded(transfer.host, elapsed.count());
+          metrics.succeeded(transfer.host, curl, retried);
+          metrics.request(op, total.count());
+          curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE,
+                            &results[transfer.index].status);
+          pool.release(transfer.host, curl);
+
+          if (logger.isEnabled(LEVEL_INFO)) {
+            ostringstream message;
+            message << url << " took " << elapsed.count() * 1000 << "ms";
+            logger.log(LEVEL_INFO, message.str());
+          }
+        } else {
+          selector.failed(transfer.host);
+          metrics.failed(transfer.host, retried);
+          pool.discard(curl);
+
+          if (!requests[transfer.index].retry || round + 1 >= prefixes.size()) {
+            chrono::duration<double> total =
+              chrono::steady_clock::now() - requested;
+            metrics.request(op, total.count());
+          }
+
+          if (logger.isEnabled(LEVEL_ERROR)) {
+            logger.log(LEVEL_ERROR, url + " failed: " + curl_easy_strerror(res));
+          }
+        }
+      }
+
+      if (!inFlight.empty()) {
+        curl_multi_poll(multi, NULL, 0, 1000, NULL);
+      }
+    }
+
+    pool.releaseMulti(multi);
+
+    vector<size_t> failed;
+    for (size_t index : pending) {
+      if (results[index].res != CURLE_OK && requests[index].retry) {
+        failed.push_back(index);
+      }
+    }
+    pending.swap(failed);
+  }
+}
+
+/**
+ * Reads the response of a request with read, or the error in its place
+ * if it didn't reach etcd or isn't a valid etcd response.
+ */
+template <typename R>
+unique_ptr<R> readResult(BatchResult &result,
+                         unique_ptr<R> (*read)(rapidjson::Document&)) {
+  if (result.res != CURLE_OK) {
+    return failure<R>(unique_ptr<ResponseError>(
+      ResponseError::transport(result.res,
+                               curl_easy_strerror(result.res),
+                               result.url)));
+  }
+
+  ParsedResponse resp(result.body, result.status);
+  unique_ptr<ResponseError> error(checkResponse(resp, result.url));
+  if (error) {
+    return failure<R>(move(error));
+  }
+  return read(resp.getDocument());
+}
+
+vector<unique_ptr<PutResponse> > readPutResults(vector<BatchResult> &results) {
+  vector<unique_ptr<PutResponse> > responses;
+  responses.reserve(results.size());
+  for (BatchResult &result : results) {
+    responses.push_back(readResult(result, &readPutResponse));
+  }
+  return responses;
+}
+
+vector<unique_ptr<GetResponse> > Session::getMany(
+  const vector<string> &keys) {
+  vector<BatchRequest> requests(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    requests[i].key = &keys[i];
+    requests[i].method = "GET";
+    requests[i].retry = true;
+  }
+
+  vector<BatchResult> results;
+  send_many(*pool, *selector, *metrics, logger, prefixes, HostSelector::NONE,
+            Metrics::GET, requests, results);
+
+  vector<unique_ptr<GetResponse> > responses;
+  responses.reserve(results.size());
+  for (BatchResult &result : results) {
+    responses.push_back(readResult(result, &readGetResponse));
+  }
+  return responses;
+}
+
+vector<unique_ptr<PutResponse> > Session::putMany(
+  const vector<pair<string, string> > &entries) {
+
+  vector<BatchRequest> requests(entries.size());
+  string compressed;
+  for (size_t i = 0; i < entries.size(); i++) {
+    requests[i].key = &entries[i].first;
+    requests[i].method = "PUT";
+    requests[i].postData.assign("value=");
+    appendEncoded(requests[i].postData,
+                  storedValue(entries[i].second, compression, compressed),
+                  false);
+    requests[i].retry = false;
+  }
+
+  int leader = selector->getPreferLeader() ? findLeader() : HostSelector::NONE;
+  vector<BatchResult> results;
+  send_many(*pool, *selector, *metrics, logger, prefixes, leader,
+            Metrics::PUT, requests, results);
+
+  return readPutResults(results);
+}
+
+vector<unique_ptr<PutResponse> > Session::refreshMany(
+  const vector<pair<string, int> > &keys) {
+
+  vector<BatchRequest> requests(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    requests[i].key = &keys[i].first;
+    requests[i].method = "PUT";
+    requests[i].postData.append("ttl=").append(to_string(keys[i].second))
+      .append("&refresh=true&prevExist=true");
+    requests[i].retry = true;
+  }
+
+  int leader = selector->getPreferLeader() ? findLeader() : HostSelector::NONE;
+  vector<BatchResult> results;
+  send_many(*pool, *selector, *metrics, logger, prefixes, leader,
+            Metrics::PUT, requests, results);
+
+  return readPutResults(results);
+}
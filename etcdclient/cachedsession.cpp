@@ -0,0 +1,181 @@
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "cachedsession.h"
+#include "internal.h"
+
+using namespace std;
+using namespace etcd;
+
+/* default bound on how long a node is served from the cache, in seconds */
+static const long DEFAULT_MAX_STALENESS = 60;
+
+CachedSession::CachedSession(vector<Host> hosts, string prefix) :
+  CachedSession(hosts, prefix, DEFAULT_MAX_STALENESS) {}
+
+CachedSession::CachedSession(vector<Host> hosts,
+                             string prefix,
+                             long maxStaleness) :
+  session(hosts),
+  prefix(prefix),
+  maxStaleness(maxStaleness),
+  epoch(0),
+  hits(0),
+  misses(0),
+  invalidations(0),
+  watcher(hosts) {
+
+  // resume after the current etcd index, so no change made before a
+  // miss reads a key is missed. Without it, start from the oldest change
+  // etcd may still have, which has the watch read the prefix once its
+  // history is cleared and the cache cleared
+  int64_t index = current_index(session, prefix);
+  int64_t waitIndex = index > 0 ? index + 1 : 1;
+
+  watcher.watch(prefix, true, waitIndex, [this](GetResponse *r) {
+      onChange(r);
+    });
+}
+
+/**
+ * Whether key is covered by the watch on the prefix, i.e. is the
+ * prefix itself or anything in the directory at prefix.
+ */
+bool CachedSession::isCached(const string &key) const {
+  if (key.compare(0, prefix.size(), prefix) != 0) {
+    return false;
+  }
+  return key.size() == prefix.size()
+    || prefix.empty()
+    || prefix[prefix.size() - 1] == '/'
+    || key[prefix.size()] == '/';
+}
+
+/**
+ * Time until which node may be served, the earlier of its expiration
+ * and the staleness bound.
+ */
+CachedSession::clock::time_point CachedSession::expiry(const Node &node) const {
+  long seconds = maxStaleness;
+  if (node.getTtl() >= 0 && node.getTtl() < seconds) {
+    seconds = node.getTtl();
+  }
+  return clock::now() + chrono::seconds(seconds);
+}
+
+unique_ptr<GetResponse> CachedSession::get(string key) {
+  if (!isCached(key)) {
+    return session.get(key);
+  }
+
+  uint64_t fetchEpoch;
+  {
+    lock_guard<mutex> guard(lock);
+    auto it = entries.find(key);
+    if (it != entries.end()) {
+      if (it->second.expires > clock::now()) {
+        hits++;
+        unique_ptr<Node> node(new Node(*it->second.node));
+        return unique_ptr<GetResponse>(GetResponse::success(move(node)));
+      }
+      entries.erase(it);
+    }
+    fetchEpoch = epoch;
+  }
+
+  misses++;
+  unique_ptr<GetResponse> r = session.get(key);
+  if (r->getError() != NULL) {
+    return r;
+  }
+
+  // a change seen while the request was in flight may be newer than the
+  // response, so it is only cached if nothing was invalidated meanwhile.
+  lock_guard<mutex> guard(lock);
+  if (epoch == fetchEpoch) {
+    Entry &entry = entries[key];
+    entry.node.reset(new Node(*r->getNode()));
+    entry.expires = expiry(*r->getNode());
+  }
+  return r;
+}
+
+void CachedSession::clear() {
+  lock_guard<mutex> guard(lock);
+  invalidations += entries.size();
+  entries.clear();
+  epoch++;
+}
+
+CacheStats CachedSession::getStats() const {
+  return CacheStats(hits, misses, invalidations);
+}
+
+/**
+ * Drops every directory above key, whose listings include it or a
+ * directory holding it. Called with the lock held.
+ */
+void CachedSession::invalidateAncestors(const string &key) {
+  size_t end = key.find_last_of('/');
+  while (end != string::npos && end > 0) {
+    if (entries.erase(key.substr(0, end)) > 0) {
+      invalidations++;
+    }
+    end = key.find_last_of('/', end - 1);
+  }
+  if (key != "/" && entries.erase("/") > 0) {
+    invalidations++;
+  }
+}
+
+/**
+ * Drops key, everything below it and every directory above it. Called
+ * with the lock held.
+ */
+void CachedSession::invalidate(const string &key) {
+  epoch++;
+  invalidateAncestors(key);
+
+  string below = key + "/";
+  for (auto it = entries.begin(); it != entries.end();) {
+    if (it->first == key || it->first.compare(0, below.size(), below) == 0) {
+      it = entries.erase(it);
+      invalidations++;
+    } else {
+      ++it;
+    }
+  }
+}
+
+void CachedSession::onChange(GetResponse *r) {
+  if (r->getError() != NULL) {
+    return;
+  }
+
+  // the watch fell too far behind and re-read the prefix, any change
+  // in between may have been missed.
+  if (r->getAction() == "get") {
+    clear();
+    return;
+  }
+
+  Node *node = r->getNode();
+  const string action = r->getAction();
+  lock_guard<mutex> guard(lock);
+
+  bool updated = action == "set"
+    || action == "update"
+    || action == "compareAndSwap";
+
+  auto it = entries.find(node->getKey());
+  if (updated && !node->isDirectory() && it != entries.end()) {
+    it->second.node.reset(new Node(*node));
+    it->second.expires = expiry(*node);
+    epoch++;
+    invalidateAncestors(node->getKey());
+    return;
+  }
+
+  invalidate(node->getKey());
+}
@@ -0,0 +1,109 @@
+#ifndef LIBETCDCLIENT_CACHEDSESSION_cxx_
+#define LIBETCDCLIENT_CACHEDSESSION_cxx_
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "etcdclient.h"
+#include "watcher.h"
+
+using namespace std;
+
+namespace etcd {
+  class CacheStats;
+
+  /**
+   * Session serving repeated GETs of keys below a prefix from memory.
+   *
+   * The first read of a key goes to etcd, later reads are answered from
+   * the cache. A recursive watch on the prefix updates or drops cached
+   * nodes as they change, cached nodes with a ttl are dropped when they
+   * expire, and no node is served longer than maxStaleness seconds after
+   * it was read, bounding staleness should the watch fall behind.
+   */
+  class CachedSession {
+  public:
+    CachedSession(vector<Host> hosts, string prefix);
+    CachedSession(vector<Host> hosts, string prefix, long maxStaleness);
+
+    /**
+     * GET of key, served from the cache when key is below the prefix.
+     */
+    unique_ptr<GetResponse> get(string key);
+
+    /**
+     * Drops every cached node.
+     */
+    void clear();
+
+    /**
+     * Hit, miss and invalidation counters of the cache.
+     */
+    CacheStats getStats() const;
+
+    /**
+     * Underlying session, for requests which aren't cached.
+     */
+    Session& getSession() { return session; }
+
+  private:
+    typedef chrono::steady_clock clock;
+
+    struct Entry {
+      unique_ptr<Node> node;
+      clock::time_point expires;
+    };
+
+    CachedSession(const CachedSession&);
+    CachedSession& operator=(const CachedSession&);
+
+    bool isCached(const string &key) const;
+    clock::time_point expiry(const Node &node) const;
+    void onChange(GetResponse *r);
+    void invalidate(const string &key);
+    void invalidateAncestors(const string &key);
+
+    Session session;
+    string prefix;
+    long maxStaleness;
+
+    mutable mutex lock;
+    unordered_map<string, Entry> entries;
+    uint64_t epoch;
+
+    atomic<unsigned long> hits;
+    atomic<unsigned long> misses;
+    atomic<unsigned long> invalidations;
+
+    // declared last, so the watch stops before the cache goes away
+    Watcher watcher;
+  };
+
+  /**
+   * Snapshot of the counters of a CachedSession.
+   */
+  class CacheStats {
+  public:
+    CacheStats(unsigned long hits,
+               unsigned long misses,
+               unsigned long invalidations) :
+      hits(hits),
+      misses(misses),
+      invalidations(invalidations) {}
+
+    unsigned long getHits() const { return hits; }
+    unsigned long getMisses() const { return misses; }
+    unsigned long getInvalidations() const { return invalidations; }
+
+  private:
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long invalidations;
+  };
+}
+
+#endif
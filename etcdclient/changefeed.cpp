@@ -0,0 +1,304 @@
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "changefeed.h"
+#include "internal.h"
+
+using namespace std;
+using namespace etcd;
+
+const size_t ChangeFeed::DEFAULT_CAPACITY;
+
+/* pause before reading the state of a prefix again after a failed read */
+static const long RESYNC_RETRY_MS = 100;
+
+/* overwritten events kept before the ones no reader announced are freed */
+static const size_t RECLAIM_BATCH = 64;
+
+/**
+ * Whether key is dir or below it.
+ */
+static bool isWithin(const string &key, const string &dir) {
+  return key.compare(0, dir.size(), dir) == 0
+    && (key.size() == dir.size() || key[dir.size()] == '/' || dir == "/");
+}
+
+/**
+ * The node at key in the tree below node, NULL if there is none.
+ */
+static const Node* find(const Node &node, const string &key) {
+  if (node.getKey() == key) {
+    return &node;
+  }
+  for (const Node &child : node.getNodes()) {
+    if (isWithin(key, child.getKey())) {
+      return find(child, key);
+    }
+  }
+  return NULL;
+}
+
+ChangeFeed::ChangeFeed(vector<Host> hosts, string root) :
+  ChangeFeed(hosts, root, DEFAULT_CAPACITY) {}
+
+ChangeFeed::ChangeFeed(vector<Host> hosts, string root, size_t capacity) :
+  session(hosts),
+  root(directory_key(root)),
+  ring(max<size_t>(capacity, 1)),
+  published(0),
+  owners(ring.size()),
+  reclaimAt(RECLAIM_BATCH),
+  sleepers(0),
+  stopped(false),
+  watcher(hosts) {
+
+  for (atomic<const ChangeEvent*> &slot : ring) {
+    slot = NULL;
+  }
+
+  // resume after the current etcd index, subscriptions read their
+  // prefix after this and skip the changes their read reflects. Without
+  // it, start from the oldest change etcd may still have, which has the
+  // watch read the root again once its history is cleared
+  int64_t index = current_index(session, this->root);
+  int64_t waitIndex = index > 0 ? index + 1 : 1;
+
+  watcher.watch(this->root, true, waitIndex, [this](GetResponse *r) {
+      onChange(r);
+    });
+}
+
+ChangeFeed::~ChangeFeed() {
+  stop();
+}
+
+unique_ptr<Subscription> ChangeFeed::subscribe(string prefix) {
+  unique_ptr<Subscription> subscription(
+    new Subscription(*this, directory_key(prefix)));
+  lock_guard<mutex> guard(subscriptionsLock);
+  subscriptions.push_back(subscription.get());
+  return subscription;
+}
+
+void ChangeFeed::onChange(GetResponse *r) {
+  ResponseError *error = r->getError();
+  if (error != NULL) {
+    // the root was read again after its history was cleared, and is
+    // gone; other errors of the watch are retried by the watcher
+    if (error->isKeyNotFound()) {
+      publish("get", shared_ptr<const Node>());
+    }
+    return;
+  }
+  publish(r->getAction(), make_shared<Node>(*r->getNode()));
+}
+
+/**
+ * Stores the next event in the ring, overwriting the oldest one. Only
+ * the watcher thread publishes, readers never block it: they only take
+ * the lock to sleep, which is skipped while none does.
+ */
+void ChangeFeed::publish(string action, shared_ptr<const Node> node) {
+  uint64_t sequence = published.load();
+  size_t slot = sequence % ring.size();
+  shared_ptr<const ChangeEvent> event =
+    make_shared<ChangeEvent>(sequence, move(action), move(node));
+
+  ring[slot].store(event.get());
+  if (owners[slot]) {
+    retired.push_back(move(owners[slot]));
+  }
+  owners[slot] = move(event);
+  published.store(sequence + 1);
+
+  if (retired.size() >= reclaimAt) {
+    reclaim();
+  }
+
+  if (sleepers.load() > 0) {
+    lock_guard<mutex> guard(sleepLock);
+    wakeup.notify_all();
+  }
+}
+
+/**
+ * Frees the overwritten events no reader announced. A reader announces
+ * an event before checking that its slot still holds it, so one which
+ * isn't announced once it left the ring can't be taken anymore.
+ */
+void ChangeFeed::reclaim() {
+  vector<const ChangeEvent*> announced;
+  {
+    lock_guard<mutex> guard(subscriptionsLock);
+    for (Subscription *subscription : subscriptions) {
+      const ChangeEvent *event = subscription->hazard.load();
+      if (event != NULL) {
+        announced.push_back(event);
+      }
+    }
+  }
+  sort(announced.begin(), announced.end());
+
+  vector<shared_ptr<const ChangeEvent> > kept;
+  for (shared_ptr<const ChangeEvent> &event : retired) {
+    if (binary_search(announced.begin(), announced.end(), event.get())) {
+      kept.push_back(move(event));
+    }
+  }
+  retired.swap(kept);
+  reclaimAt = retired.size() + RECLAIM_BATCH;
+}
+
+/**
+ * Waits at most timeoutMillis for the event at sequence to be
+ * published, returning false on timeout or once stopped.
+ */
+bool ChangeFeed::await(uint64_t sequence, long timeoutMillis) {
+  unique_lock<mutex> guard(sleepLock);
+  sleepers++;
+  bool arrived = wakeup.wait_for(guard, chrono::milliseconds(timeoutMillis), [&]() {
+      return stopped.load() || published.load() > sequence;
+    });
+  sleepers--;
+  return arrived && !stopped.load();
+}
+
+void ChangeFeed::stop() {
+  {
+    lock_guard<mutex> guard(sleepLock);
+    stopped = true;
+  }
+  wakeup.notify_all();
+  watcher.stop();
+}
+
+Subscription::Subscription(ChangeFeed &feed, string prefix) :
+  feed(feed),
+  prefix(prefix),
+  cursor(0),
+  readIndex(0),
+  stale(true),
+  resyncs(0),
+  hazard(NULL) {}
+
+Subscription::~Subscription() {
+  lock_guard<mutex> guard(feed.subscriptionsLock);
+  vector<Subscription*> &subscriptions = feed.subscriptions;
+  subscriptions.erase(find(subscriptions.begin(), subscriptions.end(), this));
+}
+
+bool Subscription::matches(const string &key) const {
+  // changes below the prefix, and to the directories holding it
+  return isWithin(key, prefix) || isWithin(prefix, key);
+}
+
+/**
+ * Reads the state of the prefix, which the changes published after
+ * cursor carry on from. NULL if it couldn't be read.
+ */
+shared_ptr<const ChangeEvent> Subscription::resync() {
+  uint64_t from = feed.published.load();
+  unique_ptr<GetResponse> r = feed.session.get(prefix, true);
+  ResponseError *error = r->getError();
+
+  shared_ptr<const Node> node;
+  if (error == NULL && r->getNode() != NULL) {
+    node = make_shared<Node>(*r->getNode());
+    readIndex = newest_index(*node);
+  } else if (error != NULL && error->isKeyNotFound()) {
+    readIndex = error->getIndex();
+  } else {
+    return NULL;
+  }
+
+  cursor = from;
+  stale = false;
+  return make_shared<ChangeEvent>(from, "get", node);
+}
+
+/**
+ * A fresh read of the root narrowed down to the prefix.
+ */
+shared_ptr<const ChangeEvent> Subscription::narrow(const ChangeEvent &event) const {
+  const Node *node = event.getNode() != NULL
+    ? find(*event.getNode(), prefix)
+    : NULL;
+  return make_shared<ChangeEvent>(
+    event.getSequence(), "get",
+    node != NULL ? make_shared<Node>(*node) : shared_ptr<Node>());
+}
+
+shared_ptr<const ChangeEvent> Subscription::poll() {
+  if (stale) {
+    return resync();
+  }
+
+  vector<atomic<const ChangeEvent*> > &ring = feed.ring;
+  while (true) {
+    uint64_t published = feed.published.load();
+    if (cursor >= published) {
+      return NULL;
+    }
+
+    // announced before taking it, so the feed doesn't free it meanwhile
+    atomic<const ChangeEvent*> &slot = ring[cursor % ring.size()];
+    const ChangeEvent *current;
+    do {
+      current = slot.load();
+      hazard.store(current);
+    } while (current != slot.load());
+
+    shared_ptr<const ChangeEvent> event;
+    if (current != NULL && current->getSequence() == cursor) {
+      event = current->shared_from_this();
+    }
+    hazard.store(NULL);
+
+    if (!event) {
+      // overwritten before it was read, changes were missed
+      stale = true;
+      resyncs++;
+      return resync();
+    }
+    cursor++;
+
+    const Node *node = event->getNode();
+    if (event->getAction() == "get") {
+      return narrow(*event);
+    }
+    if (node == NULL
+        || !matches(node->getKey())
+        || node->getModifiedIndex() <= readIndex) {
+      // another prefix, or reflected by the last read already
+      continue;
+    }
+    return event;
+  }
+}
+
+shared_ptr<const ChangeEvent> Subscription::next(long timeoutMillis) {
+  chrono::steady_clock::time_point deadline =
+    chrono::steady_clock::now() + chrono::milliseconds(timeoutMillis);
+
+  while (!feed.stopped.load()) {
+    shared_ptr<const ChangeEvent> event = poll();
+    if (event) {
+      return event;
+    }
+
+    long left = chrono::duration_cast<chrono::milliseconds>(
+      deadline - chrono::steady_clock::now()).count();
+    if (left <= 0) {
+      return NULL;
+    }
+    if (stale) {
+      this_thread::sleep_for(chrono::milliseconds(min(left, RESYNC_RETRY_MS)));
+    } else if (!feed.await(cursor, left)) {
+      return NULL;
+    }
+  }
+  return NULL;
+}
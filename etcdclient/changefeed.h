@@ -0,0 +1,179 @@
+#ifndef LIBETCDCLIENT_CHANGEFEED_cxx_
+#define LIBETCDCLIENT_CHANGEFEED_cxx_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "etcdclient.h"
+#include "watcher.h"
+
+using namespace std;
+
+namespace etcd {
+  class ChangeFeed;
+
+  /**
+   * Change to a key published by a ChangeFeed, as a watch reports it:
+   * action names the change ("set", "delete", "expire", ...), node is
+   * the node after it (for deletes, the node with the index of the
+   * delete).
+   *
+   * Action "get" instead carries the whole state of a subscription's
+   * prefix, after which the changes before it no longer matter. node
+   * is then NULL if the prefix doesn't exist.
+   */
+  class ChangeEvent : public enable_shared_from_this<ChangeEvent> {
+  public:
+    ChangeEvent(uint64_t sequence, string action, shared_ptr<const Node> node) :
+      sequence(sequence),
+      action(move(action)),
+      node(move(node)) {}
+
+    /**
+     * Position of the event in the feed.
+     */
+    uint64_t getSequence() const { return sequence; }
+    const string& getAction() const { return action; }
+    const Node* getNode() const { return node.get(); }
+
+  private:
+    uint64_t sequence;
+    string action;
+    shared_ptr<const Node> node;
+  };
+
+  /**
+   * Reader of the changes of a ChangeFeed below a prefix, used by one
+   * thread at a time. It starts with the state of the prefix (action
+   * "get"), followed by every change since.
+   *
+   * A subscription which falls more than the capacity of the feed
+   * behind has missed changes. It then reads its prefix again and
+   * continues with that state, the feed never waits for it.
+   */
+  class Subscription {
+  public:
+    ~Subscription();
+
+    /**
+     * The next change, NULL if there is none yet.
+     */
+    shared_ptr<const ChangeEvent> poll();
+
+    /**
+     * The next change, waiting at most timeoutMillis for one. Returns
+     * NULL on timeout or once the feed stopped.
+     */
+    shared_ptr<const ChangeEvent> next(long timeoutMillis);
+
+    const string& getPrefix() const { return prefix; }
+
+    /**
+     * Times the subscription fell behind and read its prefix again.
+     */
+    unsigned long getResyncs() const { return resyncs; }
+
+  private:
+    friend class ChangeFeed;
+
+    Subscription(ChangeFeed &feed, string prefix);
+    Subscription(const Subscription&);
+    Subscription& operator=(const Subscription&);
+
+    bool matches(const string &key) const;
+    shared_ptr<const ChangeEvent> resync();
+    shared_ptr<const ChangeEvent> narrow(const ChangeEvent &event) const;
+
+    ChangeFeed &feed;
+    string prefix;
+    uint64_t cursor;
+    int64_t readIndex;
+    bool stale;
+    unsigned long resyncs;
+
+    // event of the ring being read, which the feed doesn't free meanwhile
+    atomic<const ChangeEvent*> hazard;
+  };
+
+  /**
+   * Changes below a directory in etcd (such as /services), watched once
+   * for any number of readers within the process.
+   *
+   * A single recursive watch on the directory parses each change once
+   * and publishes it into a ring of the last capacity changes. Readers
+   * subscribe to a prefix below the directory and each follow the ring
+   * at their own pace without locking it; an extra subscription costs
+   * no request to etcd besides reading the state of its prefix once.
+   * Readers waiting for a change sleep until the next is published.
+   *
+   * The slots of the ring are atomic pointers. A reader announces the
+   * event it is about to take (a hazard pointer) and checks the slot
+   * still holds it, the watcher thread frees overwritten events in
+   * batches, skipping the ones a reader announced.
+   */
+  class ChangeFeed {
+  public:
+    static const size_t DEFAULT_CAPACITY = 4096;
+
+    ChangeFeed(vector<Host> hosts, string root);
+    ChangeFeed(vector<Host> hosts, string root, size_t capacity);
+    ~ChangeFeed();
+
+    /**
+     * Subscribes to the changes of prefix, which is at or below the
+     * root of the feed. The subscription must not outlive the feed.
+     */
+    unique_ptr<Subscription> subscribe(string prefix);
+
+    /**
+     * Number of changes published since the feed started.
+     */
+    uint64_t getPublished() const { return published; }
+
+    /**
+     * Stops watching, waking up the readers waiting for a change.
+     */
+    void stop();
+
+    Session& getSession() { return session; }
+
+  private:
+    friend class Subscription;
+
+    ChangeFeed(const ChangeFeed&);
+    ChangeFeed& operator=(const ChangeFeed&);
+
+    void onChange(GetResponse *r);
+    void publish(string action, shared_ptr<const Node> node);
+    void reclaim();
+    bool await(uint64_t sequence, long timeoutMillis);
+
+    Session session;
+    string root;
+    vector<atomic<const ChangeEvent*> > ring;
+    atomic<uint64_t> published;
+
+    // only touched by the watcher thread: the owners of the events in
+    // the ring, and of overwritten ones a reader may still be taking
+    vector<shared_ptr<const ChangeEvent> > owners;
+    vector<shared_ptr<const ChangeEvent> > retired;
+    size_t reclaimAt;
+
+    // only locked to subscribe, unsubscribe and reclaim
+    mutex subscriptionsLock;
+    vector<Subscription*> subscriptions;
+
+    mutex sleepLock;
+    condition_variable wakeup;
+    atomic<int> sleepers;
+    atomic<bool> stopped;
+
+    Watcher watcher;
+  };
+}
+
+#endif
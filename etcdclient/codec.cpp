@@ -0,0 +1,89 @@
+#include <zlib.h>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include "codec.h"
+#include "encoding.h"
+
+using namespace std;
+
+static const char MAGIC[] = "\x1fz:";
+static const size_t MAGIC_SIZE = sizeof(MAGIC) - 1;
+
+/* the default of zlib, values are compressed once and read many times */
+static const int LEVEL = Z_DEFAULT_COMPRESSION;
+
+/* bounds on a decompressed value: deflate never packs more than 1032
+   bytes into one, and no value is inflated beyond 64 MiB */
+static const size_t MAX_RATIO = 1032;
+static const size_t MAX_DECOMPRESSED = 64 << 20;
+
+bool isCompressed(const char *data, size_t size) {
+  return size >= MAGIC_SIZE && memcmp(data, MAGIC, MAGIC_SIZE) == 0;
+}
+
+bool appendCompressed(string &out, const string &value) {
+  uLongf size = compressBound(value.size());
+  string deflated(size, '\0');
+  if (compress2((Bytef*) &deflated[0], &size,
+                (const Bytef*) value.data(), value.size(), LEVEL) != Z_OK) {
+    return false;
+  }
+  deflated.resize(size);
+
+  out.append(MAGIC, MAGIC_SIZE);
+  appendBase64(out, deflated);
+  return true;
+}
+
+bool appendDecompressed(string &out, const char *data, size_t size) {
+  string deflated;
+  if (!isCompressed(data, size)
+      || !appendBase64Decoded(deflated, data + MAGIC_SIZE, size - MAGIC_SIZE)) {
+    return false;
+  }
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit(&stream) != Z_OK) {
+    return false;
+  }
+  stream.next_in = (Bytef*) &deflated[0];
+  stream.avail_in = deflated.size();
+
+  // JSON usually compresses 4 to 10 times, the output grows by doubling
+  // when that guess falls short, up to the limit a valid value can't
+  // exceed so a corrupt or hostile one can't take up all memory
+  size_t limit = min(deflated.size() * MAX_RATIO, MAX_DECOMPRESSED);
+  size_t start = out.size();
+  size_t grow = min(max<size_t>(deflated.size() * 4, 4096), limit);
+  int res;
+  do {
+    size_t used = out.size();
+    out.resize(used + grow);
+    stream.next_out = (Bytef*) &out[used];
+    stream.avail_out = grow;
+    res = inflate(&stream, Z_NO_FLUSH);
+    out.resize(out.size() - stream.avail_out);
+    size_t inflated = out.size() - start;
+    grow = min(max(grow, inflated), limit - inflated);
+  } while (res == Z_OK && grow > 0);
+  inflateEnd(&stream);
+
+  if (res != Z_STREAM_END) {
+    out.resize(start);
+    return false;
+  }
+  return true;
+}
+
+const string& storedValue(const string &value, size_t threshold, string &scratch) {
+  if (threshold == 0 || value.size() < threshold) {
+    return value;
+  }
+  scratch.clear();
+  if (!appendCompressed(scratch, value)) {
+    return value;
+  }
+  return scratch.size() < value.size() ? scratch : value;
+}
@@ -0,0 +1,44 @@
+#ifndef LIBETCDCLIENT_CODEC_cxx_
+#define LIBETCDCLIENT_CODEC_cxx_
+
+#include <cstddef>
+#include <string>
+
+using namespace std;
+
+/*
+ * Compression of large values, not installed with the public headers.
+ *
+ * A compressed value is a marker ("\x1fz:", which text values don't
+ * start with) followed by the zlib stream of the value in base64, so it
+ * stays a string etcd and its JSON carry as is. Values without the
+ * marker are read as they are.
+ */
+
+/**
+ * Whether the size bytes at data start with the marker of a compressed
+ * value.
+ */
+bool isCompressed(const char *data, size_t size);
+
+/**
+ * Appends value to out compressed, returning false (with out unchanged)
+ * if zlib failed to compress it.
+ */
+bool appendCompressed(string &out, const string &value);
+
+/**
+ * Appends the value compressed in the size bytes at data to out,
+ * returning false (with out unchanged) if they aren't a compressed
+ * value or it inflates beyond 64 MiB.
+ */
+bool appendDecompressed(string &out, const char *data, size_t size);
+
+/**
+ * value as it is stored when values of threshold bytes or more are
+ * compressed (none if threshold is 0): compressed into scratch if it
+ * is that large and compresses smaller, value itself otherwise.
+ */
+const string& storedValue(const string &value, size_t threshold, string &scratch);
+
+#endif
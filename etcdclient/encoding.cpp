@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "encoding.h"
+
+using namespace std;
+
+static const char HEX[] = "0123456789ABCDEF";
+
+static const uint64_t ONES = 0x0101010101010101ull;
+static const uint64_t HIGH = 0x8080808080808080ull;
+
+/**
+ * High bit set in each byte of word within [lo, hi]. Every byte of word
+ * must be below 0x80, so the additions never carry into the next byte.
+ */
+static inline uint64_t inRange(uint64_t word, unsigned char lo, unsigned char hi) {
+  return (word + ONES * (0x80 - lo)) & ~(word + ONES * (0x7f - hi)) & HIGH;
+}
+
+/**
+ * Whether none of the 8 bytes of word needs escaping.
+ */
+static inline bool unreserved(uint64_t word, bool path) {
+  if ((word & HIGH) != 0) {
+    return false;
+  }
+
+  uint64_t safe = inRange(word, 'A', 'Z')
+    | inRange(word, 'a', 'z')
+    | inRange(word, '_', '_')
+    | inRange(word, '~', '~');
+  // "-./" and the digits are adjacent, a path takes all of them
+  safe |= path
+    ? inRange(word, '-', '9')
+    : inRange(word, '-', '.') | inRange(word, '0', '9');
+  return safe == HIGH;
+}
+
+static inline bool unreserved(unsigned char c, bool path) {
+  return (c >= 'A' && c <= 'Z')
+    || (c >= 'a' && c <= 'z')
+    || (c >= '0' && c <= '9')
+    || c == '-' || c == '.' || c == '_' || c == '~'
+    || (path && c == '/');
+}
+
+string& appendEncoded(string &out, const string &s, bool path) {
+  const char *data = s.data();
+  size_t size = s.size();
+  out.reserve(out.size() + size);
+
+  // bytes from run on are unreserved and not appended yet
+  size_t run = 0;
+  size_t i = 0;
+  while (i < size) {
+    if (i + 8 <= size) {
+      uint64_t word;
+      memcpy(&word, data + i, 8);
+      if (unreserved(word, path)) {
+        i += 8;
+        continue;
+      }
+    }
+
+    for (size_t end = min(i + 8, size); i < end; i++) {
+      unsigned char c = data[i];
+      if (unreserved(c, path)) {
+        continue;
+      }
+      char escaped[3] = { '%', HEX[c >> 4], HEX[c & 0xf] };
+      out.append(data + run, i - run).append(escaped, 3);
+      run = i + 1;
+    }
+  }
+  return out.append(data + run, size - run);
+}
+
+static int fromHex(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+string& appendDecoded(string &out, const string &s) {
+  out.reserve(out.size() + s.size());
+
+  size_t run = 0;
+  size_t i = s.find_first_of("%+");
+  while (i != string::npos) {
+    out.append(s, run, i - run);
+    if (s[i] == '+') {
+      out += ' ';
+      run = i + 1;
+    } else if (i + 2 < s.size() && fromHex(s[i + 1]) >= 0 && fromHex(s[i + 2]) >= 0) {
+      out += (char) (fromHex(s[i + 1]) * 16 + fromHex(s[i + 2]));
+      run = i + 3;
+    } else {
+      out += '%';
+      run = i + 1;
+    }
+    i = s.find_first_of("%+", run);
+  }
+  return out.append(s, run, string::npos);
+}
+
+static const char BASE64[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+string& appendBase64(string &out, const string &s) {
+  const unsigned char *data = (const unsigned char*) s.data();
+  size_t size = s.size();
+  size_t start = out.size();
+  out.resize(start + (size + 2) / 3 * 4);
+  char *to = &out[start];
+
+  size_t i = 0;
+  for (; i + 3 <= size; i += 3) {
+    uint32_t bits = data[i] << 16 | data[i + 1] << 8 | data[i + 2];
+    *to++ = BASE64[bits >> 18];
+    *to++ = BASE64[(bits >> 12) & 0x3f];
+    *to++ = BASE64[(bits >> 6) & 0x3f];
+    *to++ = BASE64[bits & 0x3f];
+  }
+  if (i < size) {
+    uint32_t bits = data[i] << 16 | (i + 1 < size ? data[i + 1] << 8 : 0);
+    *to++ = BASE64[bits >> 18];
+    *to++ = BASE64[(bits >> 12) & 0x3f];
+    *to++ = i + 1 < size ? BASE64[(bits >> 6) & 0x3f] : '=';
+    *to++ = '=';
+  }
+  return out;
+}
+
+static int fromBase64(char c) {
+  if (c >= 'A' && c <= 'Z') return c - 'A';
+  if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+  if (c >= '0' && c <= '9') return c - '0' + 52;
+  if (c == '+' || c == '-') return 62;
+  if (c == '/' || c == '_') return 63;
+  return -1;
+}
+
+bool appendBase64Decoded(string &out, const char *data, size_t size) {
+  while (size > 0 && data[size - 1] == '=') {
+    size--;
+  }
+  if (size % 4 == 1) {
+    return false;
+  }
+  out.reserve(out.size() + size * 3 / 4);
+
+  uint32_t bits = 0;
+  int pending = 0;
+  for (size_t i = 0; i < size; i++) {
+    int sextet = fromBase64(data[i]);
+    if (sextet < 0) {
+      return false;
+    }
+    bits = bits << 6 | sextet;
+    pending += 6;
+    if (pending >= 8) {
+      pending -= 8;
+      out += (char) ((bits >> pending) & 0xff);
+    }
+  }
+  return true;
+}
@@ -0,0 +1,41 @@
+#ifndef LIBETCDCLIENT_ENCODING_cxx_
+#define LIBETCDCLIENT_ENCODING_cxx_
+
+#include <string>
+
+using namespace std;
+
+/*
+ * Percent-encoding of keys and form values, and base64 of v3 keys and
+ * values, not installed with the public headers.
+ */
+
+/**
+ * Appends s to out with every byte but the unreserved characters of
+ * RFC 3986 (letters, digits and "-._~") escaped as %XX. Slashes are
+ * kept as well when s is a path, so keys keep their directories.
+ *
+ * Runs of unreserved characters are found a word at a time and copied
+ * in one go, a string with nothing to escape is appended unchanged.
+ */
+string& appendEncoded(string &out, const string &s, bool path);
+
+/**
+ * Appends s to out with %XX escapes decoded and '+' read as a space,
+ * as a form value is. Malformed escapes are kept as they are.
+ */
+string& appendDecoded(string &out, const string &s);
+
+/**
+ * Appends s to out in padded base64 (RFC 4648), which is how the v3
+ * gateway of etcd takes and returns keys and values.
+ */
+string& appendBase64(string &out, const string &s);
+
+/**
+ * Appends the bytes encoded in the size characters of base64 at data
+ * to out, returning false if they aren't valid base64.
+ */
+bool appendBase64Decoded(string &out, const char *data, size_t size);
+
+#endif
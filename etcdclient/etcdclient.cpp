@@ -1,15 +1,27 @@
 #include <curl/curl.h>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <vector>
 #include <memory>
 #include <functional>
 #include <string>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
 #include "rapidjson/document.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/prettywriter.h"
 #include "rapidjson/stringbuffer.h"
 #include "etcdclient.h"
+#include "codec.h"
+#include "encoding.h"
+#include "hostselector.h"
+#include "internal.h"
+#include "metrics.h"
 
 using namespace std;
 using namespace rapidjson;
@@ -27,71 +39,557 @@ int writer(char *data, size_t size, size_t nmemb, string *buffer){
   return result;
 }
 
-unique_ptr<Document> with_curl(function<void (CURL*)> process) {
+/**
+ * Initializes libcurl once, curl_global_init is not thread-safe and
+ * would otherwise run from whichever thread makes the first request.
+ */
+void init_curl() {
+  static once_flag initialized;
+  call_once(initialized, []() {
+      curl_global_init(CURL_GLOBAL_ALL);
+    });
+}
+
+/**
+ * Has curl speak HTTP/2 from the start, and wait for a connection to
+ * the host being set up rather than opening its own, so its request
+ * becomes another stream on that connection. curl multiplexes once the
+ * first response headers came back, which etcd sends for a wait right
+ * away.
+ */
+static void useHttp2(CURL *curl) {
+  curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+  curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+}
+
+ConnectionPool::~ConnectionPool() {
+  for (size_t host = 0; host < size; host++) {
+    for (IdleHandle &handle : hosts[host].idle) {
+      curl_easy_cleanup(handle.curl);
+    }
+  }
+
+  for (CURLM *multi : idleMultis) {
+    curl_multi_cleanup(multi);
+  }
+}
+
+CURL *ConnectionPool::acquire(uint host) {
+  CURL *curl = NULL;
+  vector<CURL*> expired;
+  {
+    HostPool &pool = hosts[host];
+    lock_guard<mutex> guard(pool.lock);
+    clock::time_point oldest =
+      clock::now() - chrono::seconds(options.getIdleTimeout());
+
+    // the most recently used handle is at the back, once that one
+    // has been idle for too long all of them have.
+    while (!pool.idle.empty()) {
+      IdleHandle handle = pool.idle.back();
+      pool.idle.pop_back();
+      if (handle.since > oldest) {
+        curl = handle.curl;
+        break;
+      }
+      expired.push_back(handle.curl);
+    }
+  }
+
+  for (CURL *handle : expired) {
+    curl_easy_cleanup(handle);
+  }
+
+  if (curl == NULL) {
+    curl = curl_easy_init();
+    if (curl == NULL) {
+      return NULL;
+    }
+  }
+
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, 1L);
+  curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, options.getIdleTimeout());
+  if (options.getMaxStreams() > 0) {
+    useHttp2(curl);
+  }
+  return curl;
+}
+
+void ConnectionPool::count(CURL *curl) {
+  long connects = 0;
+  curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+  if (connects == 0) {
+    reused++;
+  } else {
+    created += connects;
+  }
+}
+
+void ConnectionPool::release(uint host, CURL *curl) {
+  count(curl);
+
+  // reset clears the options set for this request but keeps the
+  // connection cache of the handle.
+  curl_easy_reset(curl);
+
+  CURL *evicted = NULL;
+  {
+    HostPool &pool = hosts[host];
+    lock_guard<mutex> guard(pool.lock);
+    if (pool.idle.size() >= options.getMaxIdle()) {
+      evicted = pool.idle.front().curl;
+      pool.idle.erase(pool.idle.begin());
+    }
+
+    IdleHandle handle = { curl, clock::now() };
+    pool.idle.push_back(handle);
+  }
+
+  if (evicted != NULL) {
+    curl_easy_cleanup(evicted);
+  }
+}
+
+void ConnectionPool::discard(CURL *curl) {
+  curl_easy_cleanup(curl);
+}
+
+CURLM *ConnectionPool::acquireMulti() {
+  {
+    lock_guard<mutex> guard(multiLock);
+    if (!idleMultis.empty()) {
+      CURLM *multi = idleMultis.back();
+      idleMultis.pop_back();
+      return multi;
+    }
+  }
+
+  CURLM *multi = curl_multi_init();
+  if (multi != NULL && options.getMaxStreams() > 0) {
+    curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS,
+                      (long) options.getMaxStreams());
+  }
+  return multi;
+}
+
+void ConnectionPool::releaseMulti(CURLM *multi) {
+  lock_guard<mutex> guard(multiLock);
+  idleMultis.push_back(multi);
+}
+
+ConnectionStats ConnectionPool::getStats() const {
+  return ConnectionStats(reused, created);
+}
+
+/**
+ * Performs request as a stream on the multiplexer of the pool, waiting
+ * for it to complete. The streams of concurrent callers to a host
+ * share its connection instead of holding one each.
+ */
+static unique_ptr<ParsedResponse> with_stream(ConnectionPool &pool,
+                                              uint host,
+                                              const HttpRequest &request,
+                                              CURLcode &res,
+                                              MetricsRecorder *metrics,
+                                              bool retried) {
+  mutex lock;
+  condition_variable completed;
+  bool done = false;
+  long status = 0;
+  string result;
+  CURL *handle = NULL;
+
+  pool.getMultiplexer()->submit([&](CURL *curl) {
+      handle = curl;
+      curl_easy_setopt(curl, CURLOPT_URL, request.url);
+      if (request.method != NULL) {
+        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.method);
+      }
+      if (request.postData != NULL) {
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) request.postData->size());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request.postData->c_str());
+      }
+      useHttp2(curl);
+    }, [&](CURLcode code, long responseStatus, string &body) {
+      if (code == CURLE_OK) {
+        if (metrics != NULL) {
+          metrics->succeeded(host, handle, retried);
+        }
+        pool.count(handle);
+      }
+
+      // notified under the lock, the waiting caller owns all of this
+      lock_guard<mutex> guard(lock);
+      res = code;
+      status = responseStatus;
+      result.swap(body);
+      done = true;
+      completed.notify_one();
+    });
+
+  unique_lock<mutex> guard(lock);
+  completed.wait(guard, [&]() { return done; });
+  if (res != CURLE_OK) {
+    return NULL;
+  }
+  return unique_ptr<ParsedResponse>(new ParsedResponse(result, status));
+}
+
+unique_ptr<ParsedResponse> with_curl(ConnectionPool &pool,
+                                     uint host,
+                                     const HttpRequest &request,
+                                     CURLcode &res,
+                                     MetricsRecorder *metrics,
+                                     bool retried) {
+  if (pool.getMultiplexer() != NULL) {
+    return with_stream(pool, host, request, res, metrics, retried);
+  }
+
   CURL *curl;
-  CURLcode res;
-  curl = curl_easy_init();
+  curl = pool.acquire(host);
   string result;
   if (curl) {
-    process(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, request.url);
+    if (request.method != NULL) {
+      curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.method);
+    }
+    if (request.postData != NULL) {
+      curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) request.postData->size());
+      curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request.postData->c_str());
+    }
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &writer);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &result);
     res = curl_easy_perform(curl);
     if (res != CURLE_OK){
-      cerr << "curl_easy_perform() failed: " << curl_easy_strerror(res) << endl;
-      throw res;
+      pool.discard(curl);
+      return NULL;
+    }
+    if (metrics != NULL) {
+      metrics->succeeded(host, curl, retried);
     }
-    curl_easy_cleanup(curl);
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    pool.release(host, curl);
+
+    return unique_ptr<ParsedResponse>(new ParsedResponse(result, status));
+  }
+  res = CURLE_FAILED_INIT;
+  return NULL;
+}
+
+ParsedResponse::ParsedResponse(string &result, long status) :
+  status(status),
+  allocator(buffer, sizeof(buffer)),
+  document(&allocator) {
+
+  body.swap(result);
+  document.ParseInsitu(&body[0]);
+}
+
+string host_url(const Host &host) {
+  return "http://" + host.getHost() + ":" + to_string(host.getPort());
+}
 
-    Document *d = new Document;
-    d->Parse(result.c_str());
-    return std::unique_ptr<Document>(std::move(d));
+string base_url(const Host &host, const string &key) {
+  string url = host_url(host) + "/v2/keys";
+  return appendEncoded(url, key, true);
+}
+
+string directory_key(string key) {
+  while (key.size() > 1 && key[key.size() - 1] == '/') {
+    key.erase(key.size() - 1);
+  }
+  return key.empty() ? "/" : key;
+}
+
+/* hidden key read for the current etcd index, see current_index */
+static const char INDEX_PROBE[] = "_etcdclient_index";
+
+int64_t current_index(Session &session, const string &dir) {
+  string key = directory_key(dir);
+  unique_ptr<GetResponse> r =
+    session.get((key == "/" ? key : key + "/") + INDEX_PROBE);
+  ResponseError *error = r->getError();
+  return error != NULL && error->isKeyNotFound() ? error->getIndex() : 0;
+}
+
+int64_t newest_index(const Node &node) {
+  int64_t newest = node.getModifiedIndex();
+  for (const Node &child : node.getNodes()) {
+    newest = max(newest, newest_index(child));
   }
-  throw "Curl failed to initialize";
+  return newest;
 }
 
-string base_url(const Host &host, const string key) {
-  ostringstream url;
-  url << "http://" << host.getHost() << ":" << host.getPort() << "/v2/keys" << key;
-  return url.str();
+/**
+ * Buffers the url and body of a request are built in, kept per thread
+ * so every request a thread sends reuses their capacity instead of
+ * allocating its own. A request only needs them until it is sent.
+ */
+struct RequestBuffers {
+  string url;
+  string form;
+  string compressed;
+};
+
+static RequestBuffers& buffers() {
+  static thread_local RequestBuffers buffers;
+  return buffers;
+}
+
+static string& appendNumber(string &s, long long n) {
+  char digits[24];
+  int length = snprintf(digits, sizeof(digits), "%lld", n);
+  return s.append(digits, length);
 }
 
-Host &Session::nextHost() {
-  return hosts[hostNo++ % hosts.size()];
+unique_ptr<ParsedResponse> send(ConnectionPool &pool,
+                                HostSelector &selector,
+                                MetricsRecorder &metrics,
+                                const Logger &logger,
+                                const vector<string> &prefixes,
+                                int leader,
+                                const KeyRequest &request,
+                                bool retry,
+                                Metrics::Operation op,
+                                unique_ptr<ResponseError> &error) {
+  size_t attempts = retry ? prefixes.size() : 1;
+  uint64_t tried = 0;
+  chrono::steady_clock::time_point requested = chrono::steady_clock::now();
+  string &url = buffers().url;
+
+  for (size_t attempt = 1; ; attempt++) {
+    uint host = leader != HostSelector::NONE
+      ? leader
+      : selector.select(tried);
+    tried |= host < 64 ? 1ull << host : 0;
+    leader = HostSelector::NONE;
+
+    url.assign(prefixes[host]);
+    appendEncoded(url, request.key, true).append(request.query);
+    HttpRequest http = { url.c_str(), request.method, request.postData };
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    CURLcode res;
+    unique_ptr<ParsedResponse> resp =
+      with_curl(pool, host, http, res, &metrics, attempt > 1);
+    if (resp) {
+      chrono::steady_clock::time_point end = chrono::steady_clock::now();
+      chrono::duration<double> elapsed = end - start;
+      chrono::duration<double> total = end - requested;
+      selector.succeeded(host, op != Metrics::WAIT ? elapsed.count() : -1);
+      metrics.request(op, total.count());
+
+      if (logger.isEnabled(LEVEL_INFO)) {
+        ostringstream message;
+        message << url << " took " << elapsed.count() * 1000 << "ms";
+        logger.log(LEVEL_INFO, message.str());
+      }
+      if (logger.isEnabled(LEVEL_DEBUG) && !resp->failed()) {
+        logger.log(LEVEL_DEBUG, jsonToString(resp->getDocument()));
+      }
+      error.reset(checkResponse(*resp, url));
+      return resp;
+    }
+
+    selector.failed(host);
+    metrics.failed(host, attempt > 1);
+    if (logger.isEnabled(LEVEL_ERROR)) {
+      logger.log(LEVEL_ERROR, url + " failed: " + curl_easy_strerror(res));
+    }
+    if (attempt >= attempts) {
+      chrono::duration<double> total = chrono::steady_clock::now() - requested;
+      metrics.request(op, total.count());
+      error.reset(ResponseError::transport(res, curl_easy_strerror(res), url));
+      return NULL;
+    }
+  }
+}
+
+/**
+ * Urls of the api endpoint at path of hosts, which every request
+ * appends its key to.
+ */
+static vector<string> apiPrefixes(const vector<Host> &hosts, const char *path) {
+  vector<string> prefixes;
+  for (const Host &host : hosts) {
+    prefixes.push_back(host_url(host) + path);
+  }
+  return prefixes;
+}
+
+Session::Session(vector<Host> hosts) :
+  hosts(hosts),
+  pool(make_shared<ConnectionPool>(hosts.size(), PoolOptions())),
+  selector(make_shared<HostSelector>(hosts)),
+  metrics(make_shared<MetricsRecorder>(hosts)),
+  compression(0),
+  prefixes(apiPrefixes(hosts, "/v2/keys")),
+  v3Prefixes(apiPrefixes(hosts, "/v3")) {
+
+  init_curl();
+}
+
+Session::Session(vector<Host> hosts, PoolOptions poolOptions) :
+  hosts(hosts),
+  pool(make_shared<ConnectionPool>(hosts.size(), poolOptions)),
+  selector(make_shared<HostSelector>(hosts)),
+  metrics(make_shared<MetricsRecorder>(hosts)),
+  compression(0),
+  prefixes(apiPrefixes(hosts, "/v2/keys")),
+  v3Prefixes(apiPrefixes(hosts, "/v3")) {
+
+  init_curl();
+}
+
+ConnectionStats Session::getConnectionStats() const {
+  return pool->getStats();
+}
+
+void Session::setPreferLeader(bool prefer) {
+  selector->setPreferLeader(prefer);
+}
+
+vector<HostHealth> Session::getHostHealth() const {
+  return selector->getHealth();
+}
+
+Metrics Session::getMetrics() const {
+  return metrics->snapshot();
+}
+
+void Session::setLogger(Logger logger) {
+  this->logger = logger;
+}
+
+void Session::setCompression(size_t threshold) {
+  compression = threshold;
+}
+
+/**
+ * Looks up the leader on the stats endpoint of the hosts, returning
+ * HostSelector::NONE if none of them reports being the leader. Either
+ * result is remembered for a while, see HostSelector::setLeader.
+ */
+int Session::findLeader() {
+  if (!selector->isLeaderLookupDue()) {
+    return selector->getLeader();
+  }
+
+  for (uint host = 0; host < hosts.size(); host++) {
+    string url = host_url(hosts[host]) + "/v2/stats/self";
+    HttpRequest request = { url.c_str(), NULL, NULL };
+    CURLcode res;
+    unique_ptr<ParsedResponse> resp = with_curl(*pool, host, request, res);
+    if (!resp) {
+      selector->failed(host);
+      continue;
+    }
+
+    Document &d = resp->getDocument();
+    if (resp->failed() || !d.IsObject()) {
+      continue;
+    }
+
+    Value::MemberIterator state = d.FindMember("state");
+    if (state != d.MemberEnd()
+        && state->value.IsString()
+        && strcmp(state->value.GetString(), "StateLeader") == 0) {
+      selector->setLeader(host);
+      return host;
+    }
+  }
+
+  selector->setLeader(HostSelector::NONE);
+  return HostSelector::NONE;
 }
 
 bool isDirectory(const Value &doc) {
-  if (doc.HasMember("dir")) {
-    return doc["dir"].IsTrue();
+  Value::ConstMemberIterator dir = doc.FindMember("dir");
+  if (dir != doc.MemberEnd()) {
+    return dir->value.IsTrue();
   }
 
   return false;
 }
 
+/**
+ * Copies a string value, the length is known so no strlen is needed.
+ */
+string readString(const Value &value) {
+  return string(value.GetString(), value.GetStringLength());
+}
+
+/**
+ * String member of an error, "" if it is missing (etcd leaves out an
+ * empty cause).
+ */
+static string errorString(const Value &error, const char *name) {
+  Value::ConstMemberIterator member = error.FindMember(name);
+  if (member == error.MemberEnd() || !member->value.IsString()) {
+    return "";
+  }
+  return readString(member->value);
+}
+
+/**
+ * Number member of an error, 0 if it is missing.
+ */
+static int64_t errorNumber(const Value &error, const char *name) {
+  Value::ConstMemberIterator member = error.FindMember(name);
+  if (member == error.MemberEnd() || !member->value.IsInt64()) {
+    return 0;
+  }
+  return member->value.GetInt64();
+}
+
 /**
  * Checks the response for an error. If an error code is present,
  * a ResponseError is returned, otherwise NULL.
  */
 ResponseError *checkForError(Document &resp) {
-  if (resp.HasMember("errorCode")) {
-    return new ResponseError(
-      resp["errorCode"].GetInt(),
-      resp["message"].GetString(),
-      resp["cause"].GetString(),
-      resp["index"].GetInt());
-  } else {
+  if (!resp.IsObject() || !resp.HasMember("errorCode")) {
+    return NULL;
+  }
+  return new ResponseError(
+    (int) errorNumber(resp, "errorCode"),
+    errorString(resp, "message"),
+    errorString(resp, "cause"),
+    errorNumber(resp, "index"));
+}
+
+ResponseError* checkResponse(ParsedResponse &resp, const string &url) {
+  Document &d = resp.getDocument();
+  bool object = !resp.failed() && d.IsObject();
+  if (object && d.HasMember("errorCode")) {
     return NULL;
   }
+
+  long status = resp.getStatus();
+  if (status >= 300) {
+    ostringstream message;
+    message << "HTTP status " << status;
+    return ResponseError::http(status, message.str(), url);
+  }
+  if (!object) {
+    ostringstream message;
+    message << "invalid JSON at offset " << d.GetErrorOffset();
+    return ResponseError::transport(CURLE_WEIRD_SERVER_REPLY, message.str(), url);
+  }
+  return NULL;
 }
 
 unique_ptr<Node> readNode(Value &root);
 
 vector<Node> readChildNodes(Value &parentNode) {
   vector<Node> nodes;
-  if (parentNode.HasMember("nodes")) {
-    Value &dirNodes = parentNode["nodes"];
-    for (SizeType i = 0; i < dirNodes.Size(); i++) {
-      nodes.push_back(*readNode(dirNodes[i]));
+  Value::MemberIterator dirNodes = parentNode.FindMember("nodes");
+  if (dirNodes != parentNode.MemberEnd()) {
+    Value &children = dirNodes->value;
+    nodes.reserve(children.Size());
+    for (SizeType i = 0; i < children.Size(); i++) {
+      nodes.push_back(move(*readNode(children[i])));
     }
   }
 
@@ -100,40 +598,43 @@ vector<Node> readChildNodes(Value &parentNode) {
 
 unique_ptr<Node> readNode(Value &root) {
   Node *node;
-  string key = root["key"].GetString();
-  int modifiedIndex = root["modifiedIndex"].GetInt();
-  int createdIndex = root["createdIndex"].GetInt();
+  string key = readString(root["key"]);
+  int64_t modifiedIndex = root["modifiedIndex"].GetInt64();
+  int64_t createdIndex = root["createdIndex"].GetInt64();
   string expiration = "";
   int ttl = -1;
 
-  if (root.HasMember("expiration")) {
-    expiration = root["expiration"].GetString();
+  Value::MemberIterator member = root.FindMember("expiration");
+  if (member != root.MemberEnd()) {
+    expiration = readString(member->value);
   }
 
-  if (root.HasMember("ttl")) {
-    ttl = root["ttl"].GetInt();
+  member = root.FindMember("ttl");
+  if (member != root.MemberEnd()) {
+    ttl = member->value.GetInt();
   }
 
   if (!isDirectory(root)) {
     string value = "";
 
-    if (root.HasMember("value")) {
-      value = root["value"].GetString();
+    member = root.FindMember("value");
+    if (member != root.MemberEnd()) {
+      value = readString(member->value);
     }
 
     node = Node::leaf(
-      key,
-      value,
-      expiration,
+      move(key),
+      move(value),
+      move(expiration),
       ttl,
       modifiedIndex,
       createdIndex);
 
   } else {
     node = Node::dir(
-      key,
+      move(key),
       readChildNodes(root),
-      expiration,
+      move(expiration),
       ttl,
       modifiedIndex,
       createdIndex);
@@ -142,75 +643,99 @@ unique_ptr<Node> readNode(Value &root) {
   return unique_ptr<Node>(node);
 }
 
-unique_ptr<GetResponse> getHelper(string url) {
-  unique_ptr<Document> resp = with_curl([=](CURL *curl) {
-      curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    });
+unique_ptr<GetResponse> Session::getHelper(const string &key,
+                                           const char *query,
+                                           RequestKind kind) {
+  KeyRequest request = { key, query, NULL, NULL };
+  unique_ptr<ResponseError> error;
+  unique_ptr<ParsedResponse> resp =
+    send(*pool, *selector, *metrics, logger, prefixes, HostSelector::NONE,
+         request, true, kind == WAIT ? Metrics::WAIT : Metrics::GET, error);
+  if (error) {
+    return failure<GetResponse>(move(error));
+  }
 
-  ResponseError *error = checkForError(*resp);
+  return readGetResponse(resp->getDocument());
+}
+
+unique_ptr<GetResponse> readGetResponse(Document &resp) {
+  ResponseError *error = checkForError(resp);
   if (error != NULL) {
     GetResponse *r = GetResponse::failure(unique_ptr<ResponseError>(error));
     return unique_ptr<GetResponse>(r);
   }
 
-  Value &root = (*resp)["node"];
-  cout << jsonToString(root) << endl;
-  GetResponse *r = GetResponse::success(move(readNode(root)));
+  string action = "";
+  Value::MemberIterator member = resp.FindMember("action");
+  if (member != resp.MemberEnd()) {
+    action = readString(member->value);
+  }
+
+  GetResponse *r = GetResponse::success(move(readNode(resp["node"])), action);
   return unique_ptr<GetResponse>(r);
 }
 
-unique_ptr<GetResponse> Session::get(string key) {
-  Host& host = nextHost();
-  string url = base_url(host, key);
-  return getHelper(url);
+unique_ptr<TreeResponse> Session::treeHelper(const string &key,
+                                             const char *query) {
+  KeyRequest request = { key, query, NULL, NULL };
+  unique_ptr<ResponseError> error;
+  unique_ptr<ParsedResponse> resp =
+    send(*pool, *selector, *metrics, logger, prefixes, HostSelector::NONE,
+         request, true, Metrics::GET, error);
+  if (error) {
+    return failure<TreeResponse>(move(error));
+  }
+
+  Document &d = resp->getDocument();
+  error.reset(checkForError(d));
+  if (error) {
+    return failure<TreeResponse>(move(error));
+  }
+
+  unique_ptr<NodeTree> tree(NodeTree::read(d["node"]));
+  TreeResponse *r = TreeResponse::success(move(tree));
+  return unique_ptr<TreeResponse>(r);
+}
+
+unique_ptr<GetResponse> Session::get(const string &key) {
+  return getHelper(key, "", READ);
 }
 
-unique_ptr<GetResponse> Session::get(string key, bool recursive) {
-  Host& host = nextHost();
-  ostringstream url;
-  url << base_url(host, key) << (recursive ? "?recursive=true" : "");
-  return getHelper(url.str());
+unique_ptr<GetResponse> Session::get(const string &key, bool recursive) {
+  return getHelper(key, recursive ? "?recursive=true" : "", READ);
 }
 
-unique_ptr<GetResponse> Session::wait(string key) {
-  Host& host = nextHost();
-  ostringstream url;
-  url << base_url(host, key) << "?wait=true";
-  return getHelper(url.str());
+unique_ptr<GetResponse> Session::wait(const string &key) {
+  return getHelper(key, "?wait=true", WAIT);
 }
 
-unique_ptr<GetResponse> Session::wait(string key, bool recursive) {
-  Host& host = nextHost();
-  ostringstream url;
-  url << base_url(host, key) << "?wait=true";
-  if (recursive) {
-    url << "&recursive=true";
-  }
-  return getHelper(url.str());
+unique_ptr<GetResponse> Session::wait(const string &key, bool recursive) {
+  return getHelper(key, recursive ? "?wait=true&recursive=true" : "?wait=true",
+                   WAIT);
 }
 
-unique_ptr<GetResponse> Session::wait(string key, int waitIndex) {
-  Host& host = nextHost();
-  ostringstream url;
-  url << base_url(host, key) << "?wait=true&waitIndex=" << waitIndex;
-  return getHelper(url.str());
+unique_ptr<GetResponse> Session::wait(const string &key, int64_t waitIndex) {
+  return wait(key, false, waitIndex);
 }
 
-unique_ptr<GetResponse> Session::wait(string key, bool recursive, int waitIndex) {
-  Host& host = nextHost();
-  ostringstream url;
-  url << base_url(host, key) << "?wait=true&waitIndex=" << waitIndex;
-  if (recursive) {
-    url << "&recursive=true";
-  }
-  return getHelper(url.str());
+unique_ptr<GetResponse> Session::wait(const string &key, int waitIndex) {
+  return wait(key, false, (int64_t) waitIndex);
 }
 
-void Session::poll(string key, function<void (GetResponse*)> cb) {
+unique_ptr<GetResponse> Session::wait(const string &key,
+                                      bool recursive,
+                                      int64_t waitIndex) {
+  char query[64];
+  snprintf(query, sizeof(query), "?wait=true&waitIndex=%lld%s",
+           (long long) waitIndex, recursive ? "&recursive=true" : "");
+  return getHelper(key, query, WAIT);
+}
+
+void Session::poll(const string &key, function<void (GetResponse*)> cb) {
   poll(key, false, cb);
 }
 
-void Session::poll(string key,
+void Session::poll(const string &key,
                    bool recursive,
                    function<void (GetResponse*)> cb) {
 
@@ -223,151 +748,373 @@ void Session::poll(string key,
 
     cb(r.get());
 
-    int waitIndex = 1 + r->getNode()->getModifiedIndex();
+    int64_t waitIndex = 1 + r->getNode()->getModifiedIndex();
     r = wait(key, recursive, waitIndex);
   }
 }
 
-unique_ptr<PutResponse> readPutResponse(unique_ptr<Document> resp) {
-  ResponseError *error = checkForError(*resp);
+unique_ptr<PutResponse> readPutResponse(Document &resp) {
+  ResponseError *error = checkForError(resp);
   if (error != NULL) {
     PutResponse *r = PutResponse::failure(unique_ptr<ResponseError>(error));
     return unique_ptr<PutResponse>(r);
   }
 
-  unique_ptr<Node> node = move(readNode((*resp)["node"]));
+  unique_ptr<Node> node = move(readNode(resp["node"]));
   unique_ptr<Node> prevNode = NULL;
 
-  if (resp->HasMember("prevNode")) {
-    prevNode = move(readNode((*resp)["prevNode"]));
+  Value::MemberIterator member = resp.FindMember("prevNode");
+  if (member != resp.MemberEnd()) {
+    prevNode = move(readNode(member->value));
   }
 
   PutResponse *r = PutResponse::success(move(node), move(prevNode));
   return unique_ptr<PutResponse>(r);
 }
 
-unique_ptr<PutResponse> putAndPostHelper(string url,
-                                         string postData,
-                                         bool usePUT) {
+unique_ptr<PutResponse> Session::putAndPostHelper(const string &key,
+                                                  const string &postData,
+                                                  bool usePUT) {
+
+  int leader = selector->getPreferLeader() ? findLeader() : HostSelector::NONE;
+  KeyRequest request = { key, "", usePUT ? "PUT" : NULL, &postData };
+  unique_ptr<ResponseError> error;
+  unique_ptr<ParsedResponse> resp =
+    send(*pool, *selector, *metrics, logger, prefixes, leader,
+         request, false, Metrics::PUT, error);
+  if (error) {
+    return failure<PutResponse>(move(error));
+  }
 
-  unique_ptr<Document> resp = with_curl([=](CURL *curl) {
-      if (usePUT) {
-        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
-      }
-      curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-      curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postData.c_str());
-    });
+  return readPutResponse(resp->getDocument());
+}
+
+/**
+ * Starts the form body of a write in the buffer of the thread, with
+ * value as its first field, compressed if it is at least threshold
+ * bytes long.
+ */
+static string& form(const string &value, size_t threshold) {
+  RequestBuffers &b = buffers();
+  b.form.assign("value=");
+  return appendEncoded(b.form, storedValue(value, threshold, b.compressed), false);
+}
 
-  return readPutResponse(move(resp));
+unique_ptr<PutResponse> Session::put(const string &key, const string &value) {
+  return putAndPostHelper(key, form(value, compression), true);
 }
 
+unique_ptr<PutResponse> Session::put(const string &key,
+                                     const string &value,
+                                     int ttl) {
+  string &postData = form(value, compression).append("&ttl=");
+  return putAndPostHelper(key, appendNumber(postData, ttl), true);
+}
 
-unique_ptr<PutResponse> Session::put(string key, string value) {
-  Host &host = nextHost();
-  string url = base_url(host, key);
-  ostringstream postData;
-  postData << "value=" << value;
-  return putAndPostHelper(url, postData.str(), true);
+unique_ptr<PutResponse> Session::create(const string &key,
+                                        const string &value) {
+  string &postData = form(value, compression).append("&prevExist=false");
+  return putAndPostHelper(key, postData, true);
 }
 
-unique_ptr<PutResponse> Session::put(string key, string value, int ttl) {
-  Host &host = nextHost();
-  string url = base_url(host, key);
-  ostringstream postData;
-  postData << "value=" << value << "&ttl=" << ttl;
-  return putAndPostHelper(url, postData.str(), true);
+unique_ptr<PutResponse> Session::create(const string &key,
+                                        const string &value,
+                                        int ttl) {
+  string &postData = form(value, compression).append("&ttl=");
+  appendNumber(postData, ttl).append("&prevExist=false");
+  return putAndPostHelper(key, postData, true);
 }
 
-unique_ptr<PutResponse> Session::addToQueue(string key, string value) {
-  Host &host = nextHost();
-  string url = base_url(host, key);
-  ostringstream postData;
-  postData << "value=" << value;
-  return putAndPostHelper(url, postData.str(), false);
+unique_ptr<PutResponse> Session::compareAndSwap(const string &key,
+                                                const string &value,
+                                                const string &prevValue) {
+  string &postData = form(value, compression).append("&prevValue=");
+  return putAndPostHelper(key, appendEncoded(postData, prevValue, false), true);
 }
 
-unique_ptr<PutResponse> Session::addToQueue(string key, string value, int ttl) {
-  Host &host = nextHost();
-  string url = base_url(host, key);
-  ostringstream postData;
-  postData << "value=" << value << "&ttl=" << ttl;
-  return putAndPostHelper(url, postData.str(), false);
+unique_ptr<PutResponse> Session::compareAndSwap(const string &key,
+                                                const string &value,
+                                                int64_t prevIndex) {
+  string &postData = form(value, compression).append("&prevIndex=");
+  return putAndPostHelper(key, appendNumber(postData, prevIndex), true);
 }
 
-unique_ptr<GetResponse> Session::listQueue(string key) {
-  Host &host = nextHost();
-  ostringstream url;
-  url << base_url(host, key) << "?recursive=true&sorted=true";
-  return getHelper(url.str());
+unique_ptr<PutResponse> Session::refresh(const string &key, int ttl) {
+  string &postData = buffers().form.assign("ttl=");
+  appendNumber(postData, ttl).append("&refresh=true&prevExist=true");
+  return putAndPostHelper(key, postData, true);
 }
 
-unique_ptr<PutResponse> deleteHelper(string url) {
-  unique_ptr<Document> resp = with_curl([=](CURL *curl) {
-      curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
-      curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    });
+unique_ptr<PutResponse> Session::addToQueue(const string &key,
+                                            const string &value) {
+  return putAndPostHelper(key, form(value, compression), false);
+}
+
+unique_ptr<PutResponse> Session::addToQueue(const string &key,
+                                            const string &value,
+                                            int ttl) {
+  string &postData = form(value, compression).append("&ttl=");
+  return putAndPostHelper(key, appendNumber(postData, ttl), false);
+}
+
+unique_ptr<GetResponse> Session::listQueue(const string &key) {
+  return getHelper(key, "?recursive=true&sorted=true", READ);
+}
+
+unique_ptr<TreeResponse> Session::getTree(const string &key) {
+  return treeHelper(key, "?recursive=true");
+}
 
-  return readPutResponse(move(resp));
+unique_ptr<TreeResponse> Session::listQueueTree(const string &key) {
+  return treeHelper(key, "?recursive=true&sorted=true");
 }
 
-unique_ptr<PutResponse> Session::deleteKey(string key) {
-  Host& host = nextHost();
-  ostringstream url;
-  url << base_url(host, key);
-  return deleteHelper(url.str());
+unique_ptr<PutResponse> Session::deleteHelper(const string &key,
+                                              const char *query) {
+  int leader = selector->getPreferLeader() ? findLeader() : HostSelector::NONE;
+  KeyRequest request = { key, query, "DELETE", NULL };
+  unique_ptr<ResponseError> error;
+  unique_ptr<ParsedResponse> resp =
+    send(*pool, *selector, *metrics, logger, prefixes, leader,
+         request, false, Metrics::DELETE, error);
+  if (error) {
+    return failure<PutResponse>(move(error));
+  }
+
+  return readPutResponse(resp->getDocument());
+}
+
+unique_ptr<PutResponse> Session::deleteKey(const string &key) {
+  return deleteHelper(key, "");
 }
 
-unique_ptr<PutResponse> Session::deleteDirectory(string key) {
-  Host& host = nextHost();
-  ostringstream url;
-  url << base_url(host, key) << "?dir=true&recursive=true";
-  return deleteHelper(url.str());
+unique_ptr<PutResponse> Session::deleteDirectory(const string &key) {
+  return deleteHelper(key, "?dir=true&recursive=true");
 }
 
-unique_ptr<PutResponse> Session::deleteQueue(string key) {
+unique_ptr<PutResponse> Session::deleteQueue(const string &key) {
   return deleteDirectory(key);
 }
 
+unique_ptr<PutResponse> Session::compareAndDelete(const string &key,
+                                                  const string &prevValue) {
+  string &query = buffers().form.assign("?prevValue=");
+  return deleteHelper(key, appendEncoded(query, prevValue, false).c_str());
+}
+
+unique_ptr<PutResponse> Session::compareAndDelete(const string &key,
+                                                  int64_t prevIndex) {
+  char query[32];
+  snprintf(query, sizeof(query), "?prevIndex=%lld", (long long) prevIndex);
+  return deleteHelper(key, query);
+}
+
 Node* Node::leaf(string key,
                  string value,
                  string expiration,
                  int ttl,
-                 int modifiedIndex,
-                 int createdIndex) {
+                 int64_t modifiedIndex,
+                 int64_t createdIndex) {
 
-  return new Node(key,
-                  value,
+  return new Node(move(key),
+                  move(value),
                   vector<Node>(),
                   false,
-                  expiration,
+                  move(expiration),
                   ttl,
                   modifiedIndex,
                   createdIndex);
 }
 
+string Node::getValue() const {
+  string decoded;
+  if (isCompressed(value.data(), value.size())
+      && appendDecompressed(decoded, value.data(), value.size())) {
+    return decoded;
+  }
+  return value;
+}
+
 Node* Node::dir(string key,
                 vector<Node> nodes,
                 string expiration,
                 int ttl,
-                int modifiedIndex,
-                int createdIndex) {
+                int64_t modifiedIndex,
+                int64_t createdIndex) {
+
+  return new Node(move(key),
+                  "",
+                  move(nodes),
+                  true,
+                  move(expiration),
+                  ttl,
+                  modifiedIndex,
+                  createdIndex);
+}
 
-  return new Node(key,
-              "",
-              nodes,
-              true,
-              expiration,
-              ttl,
-              modifiedIndex,
-              createdIndex);
+NodeTree* NodeTree::read(Value &root) {
+  NodeTree *tree = new NodeTree;
+  tree->append(root, NONE, NULL, 0);
+  return tree;
+}
+
+/**
+ * Appends the node object value and its descendants in depth-first
+ * order, returning the position of the node.
+ */
+uint32_t NodeTree::append(Value &value,
+                          uint32_t parent,
+                          const char *parentKey,
+                          size_t parentKeyLength) {
+  uint32_t index = nodes.size();
+  TreeNode node;
+  node.parent = parent;
+  node.firstChild = NONE;
+  node.nextSibling = NONE;
+  node.modifiedIndex = value["modifiedIndex"].GetInt64();
+  node.createdIndex = value["createdIndex"].GetInt64();
+  node.isDir = isDirectory(value);
+  node.ttl = -1;
+
+  const char *key = "";
+  size_t keyLength = 0;
+  Value::MemberIterator member = value.FindMember("key");
+  if (member != value.MemberEnd()) {
+    key = member->value.GetString();
+    keyLength = member->value.GetStringLength();
+  }
+
+  node.absoluteName = parentKey == NULL
+    || keyLength < parentKeyLength
+    || memcmp(key, parentKey, parentKeyLength) != 0;
+
+  if (node.absoluteName) {
+    node.name = intern(key, keyLength);
+    node.nameLength = keyLength;
+  } else {
+    node.name = intern(key + parentKeyLength, keyLength - parentKeyLength);
+    node.nameLength = keyLength - parentKeyLength;
+  }
+
+  node.value = node.valueLength = 0;
+  member = value.FindMember("value");
+  if (member != value.MemberEnd()) {
+    node.value = intern(member->value.GetString(),
+                        member->value.GetStringLength());
+    node.valueLength = member->value.GetStringLength();
+  }
+
+  node.expiration = node.expirationLength = 0;
+  member = value.FindMember("expiration");
+  if (member != value.MemberEnd()) {
+    node.expiration = intern(member->value.GetString(),
+                             member->value.GetStringLength());
+    node.expirationLength = member->value.GetStringLength();
+  }
+
+  member = value.FindMember("ttl");
+  if (member != value.MemberEnd()) {
+    node.ttl = member->value.GetInt();
+  }
+
+  nodes.push_back(node);
+
+  member = value.FindMember("nodes");
+  if (member != value.MemberEnd()) {
+    Value &children = member->value;
+    uint32_t previous = NONE;
+    for (SizeType i = 0; i < children.Size(); i++) {
+      uint32_t child = append(children[i], index, key, keyLength);
+      if (previous == NONE) {
+        nodes[index].firstChild = child;
+      } else {
+        nodes[previous].nextSibling = child;
+      }
+      previous = child;
+    }
+  }
+
+  nodes[index].end = nodes.size();
+  return index;
+}
+
+uint32_t NodeTree::intern(const char *data, size_t length) {
+  uint32_t offset = strings.size();
+  strings.append(data, length);
+  return offset;
+}
+
+string NodeTree::getKey(uint32_t i) const {
+  vector<uint32_t> path;
+  for (uint32_t at = i; at != NONE; at = nodes[at].parent) {
+    path.push_back(at);
+    if (nodes[at].absoluteName) {
+      break;
+    }
+  }
+
+  string key;
+  for (auto it = path.rbegin(); it != path.rend(); ++it) {
+    key.append(strings, nodes[*it].name, nodes[*it].nameLength);
+  }
+  return key;
+}
+
+StringRef NodeTree::getName(uint32_t i) const {
+  return StringRef(strings.data() + nodes[i].name, nodes[i].nameLength);
+}
+
+StringRef NodeTree::getValue(uint32_t i) const {
+  return StringRef(strings.data() + nodes[i].value, nodes[i].valueLength);
+}
+
+string NodeTree::getDecodedValue(uint32_t i) const {
+  StringRef value = getValue(i);
+  string decoded;
+  if (isCompressed(value.getData(), value.getLength())
+      && appendDecompressed(decoded, value.getData(), value.getLength())) {
+    return decoded;
+  }
+  return value.str();
+}
+
+StringRef NodeTree::getExpiration(uint32_t i) const {
+  return StringRef(strings.data() + nodes[i].expiration,
+                   nodes[i].expirationLength);
+}
+
+TreeResponse* TreeResponse::success(unique_ptr<NodeTree> tree) {
+  return new TreeResponse(move(tree), NULL);
+}
+
+TreeResponse* TreeResponse::failure(unique_ptr<ResponseError> error) {
+  return new TreeResponse(NULL, move(error));
+}
+
+ResponseError* ResponseError::transport(int curlCode,
+                                       string message,
+                                       string url) {
+  ResponseError *error = new ResponseError(curlCode, message, url, 0);
+  error->kind = TRANSPORT;
+  return error;
+}
+
+ResponseError* ResponseError::http(int status, string message, string url) {
+  ResponseError *error = new ResponseError(status, message, url, 0);
+  error->kind = HTTP;
+  return error;
 }
 
 GetResponse* GetResponse::success(unique_ptr<Node> node) {
-  return new GetResponse(move(node), NULL);
+  return new GetResponse(move(node), "", NULL);
+}
+
+GetResponse* GetResponse::success(unique_ptr<Node> node, string action) {
+  return new GetResponse(move(node), action, NULL);
 }
 
 GetResponse* GetResponse::failure(unique_ptr<ResponseError> error) {
-  return new GetResponse(NULL, move(error));
+  return new GetResponse(NULL, "", move(error));
 }
 
 PutResponse* PutResponse::success(unique_ptr<Node> node,
@@ -390,9 +1137,10 @@ ostream& operator<<(ostream& os, const Node& node) {
   os << "Node(key=\"" << node.getKey() << "\"";
 
   if (node.isDirectory()) {
+    const vector<Node> &nodes = node.getNodes();
     os << ", nodes=[";
-    for (int i = 0, size = node.getNodes().size(); i < size; i++) {
-      os << node.getNodes()[i];
+    for (int i = 0, size = nodes.size(); i < size; i++) {
+      os << nodes[i];
       if (i != size - 1) {
         os << ", ";
       }
@@ -1,6 +1,7 @@
 #ifndef LIBETCDCLIENT_cxx_
 #define LIBETCDCLIENT_cxx_
 
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <memory>
@@ -12,115 +13,501 @@ using namespace std;
 namespace etcd {
   class Host;
   class Session;
+  class PoolOptions;
+  class ConnectionStats;
+  class ConnectionPool;
+  class HostHealth;
+  class HostSelector;
+  class Histogram;
+  class HostMetrics;
+  class Metrics;
+  class MetricsRecorder;
   class Node;
+  class NodeTree;
   class GetResponse;
+  class TreeResponse;
+  class StreamResponse;
   class PutResponse;
   class ResponseError;
+  class KeyValue;
+  class RangeOptions;
+  class RangeResponse;
+  class Txn;
+  class TxnResponse;
+  class WatchResponse;
+
+  /**
+   * Severity of a message logged by a session, from failed requests
+   * (LEVEL_ERROR) to every request made (LEVEL_INFO) to the bodies of
+   * the responses (LEVEL_DEBUG).
+   */
+  enum LogLevel {
+    LEVEL_OFF,
+    LEVEL_ERROR,
+    LEVEL_INFO,
+    LEVEL_DEBUG
+  };
+
+  /**
+   * Log hook of a session, called with every message at or above
+   * the configured level. Messages below it are never formatted, so
+   * a disabled logger costs a comparison per request.
+   */
+  class Logger {
+  public:
+    typedef function<void (LogLevel, const string&)> Hook;
+
+    Logger() : level(LEVEL_OFF) {}
+    Logger(LogLevel level, Hook hook) : level(level), hook(hook) {}
+
+    bool isEnabled(LogLevel at) const {
+      return at != LEVEL_OFF && at <= level;
+    }
+
+    void log(LogLevel at, const string &message) const {
+      if (isEnabled(at)) {
+        hook(at, message);
+      }
+    }
+
+  private:
+    LogLevel level;
+    Hook hook;
+  };
 
   /**
    * etcd client session, supports most of the etcd API
    * making round-robin requests to the known hosts.
+   *
+   * Hosts which can't be reached are left out for a backoff, and
+   * reads (get, wait, listQueue) failing to reach a host are retried
+   * on the next healthy one. Writes are only sent once.
+   *
+   * Connections are kept alive and reused between requests to
+   * the same host, see PoolOptions.
+   *
+   * A session is safe to use from any number of threads at once,
+   * they share its connection pool and host health. Copies of a
+   * session share them as well.
    */
   class Session {
   public:
-    Session(vector<Host> hosts) : hosts(hosts) {}
+    /**
+     * Called with each node of a streamed listing, returning false
+     * ends the stream.
+     */
+    typedef function<bool (const Node&)> NodeVisitor;
+
+    /**
+     * Called with each pair of a v3 scan, returning false ends it.
+     */
+    typedef function<bool (const KeyValue&)> KeyValueVisitor;
+
+    Session(vector<Host> hosts);
+    Session(vector<Host> hosts, PoolOptions poolOptions);
 
     /**
      * Send GET request to etcd server (non-recursive).
      */
-    unique_ptr<GetResponse> get(string key);
+    unique_ptr<GetResponse> get(const string &key);
 
     /**
      * Send GET request to etcd server.
      */
-    unique_ptr<GetResponse> get(string key, bool recursive);
+    unique_ptr<GetResponse> get(const string &key, bool recursive);
 
     /**
      * Send PUT request to etcd server to set or update the
      * value of the node specified at key.
      */
-    unique_ptr<PutResponse> put(string key, string value);
+    unique_ptr<PutResponse> put(const string &key, const string &value);
 
     /**
      * Send PUT request to etcd server to set or update the
      * value of the node specified at key. Also sets the ttl value
      * of the node.
      */
-    unique_ptr<PutResponse> put(string key, string value, int ttl);
+    unique_ptr<PutResponse> put(const string &key,
+                                const string &value,
+                                int ttl);
 
     /**
      * Send PUT request to etcd server to set or update the
      * node, specifying it as a directory.
      */
-    unique_ptr<PutResponse> putDirectory(string key);
+    unique_ptr<PutResponse> putDirectory(const string &key);
 
     /**
      * Send PUT request to etcd server to set or update the
      * node, specifying it as a directory and a ttl.
      */
-    unique_ptr<PutResponse> putDirectory(string key, int ttl);
+    unique_ptr<PutResponse> putDirectory(const string &key, int ttl);
+
+    /**
+     * Creates key only if it doesn't exist yet (prevExist=false),
+     * failing with NODE_EXIST otherwise.
+     */
+    unique_ptr<PutResponse> create(const string &key, const string &value);
+    unique_ptr<PutResponse> create(const string &key,
+                                   const string &value,
+                                   int ttl);
+
+    /**
+     * Sets key to value only if its current value is prevValue, or
+     * its modifiedIndex is prevIndex. Fails with TEST_FAILED if it
+     * changed, or KEY_NOT_FOUND if it doesn't exist.
+     */
+    unique_ptr<PutResponse> compareAndSwap(const string &key,
+                                           const string &value,
+                                           const string &prevValue);
+    unique_ptr<PutResponse> compareAndSwap(const string &key,
+                                           const string &value,
+                                           int64_t prevIndex);
+
+    /**
+     * Resets the ttl of an existing key without changing its value or
+     * notifying the watchers of key.
+     */
+    unique_ptr<PutResponse> refresh(const string &key, int ttl);
 
     /**
      * Waits for the next change in key and returns its new value.
      */
-    unique_ptr<GetResponse> wait(string key);
+    unique_ptr<GetResponse> wait(const string &key);
 
     /*
      * Waits for the next change in key or anything inside the
      * directory at key if recursive is true.
      */
-    unique_ptr<GetResponse> wait(string key, bool recursive);
+    unique_ptr<GetResponse> wait(const string &key, bool recursive);
 
     /**
      * Waits for the next change in key, specifying the exact
      * modifiedIndex to retrieve.
      */
-    unique_ptr<GetResponse> wait(string key, int waitIndex);
+    unique_ptr<GetResponse> wait(const string &key, int64_t waitIndex);
+    unique_ptr<GetResponse> wait(const string &key, int waitIndex);
 
     /**
      * Waits for the next change in key or the directory at key
      * while specifying the exact modifiedIndex to retrieve.
      */
-    unique_ptr<GetResponse> wait(string key, bool recursive, int waitIndex);
+    unique_ptr<GetResponse> wait(const string &key,
+                                 bool recursive,
+                                 int64_t waitIndex);
 
     /**
      * Polls for changes in key, calling the callback each time it
-     * is updated. Note that this function blocks forever.
+     * is updated. Note that this function blocks forever, use a
+     * Watcher to watch many keys without a thread for each.
      */
-    void poll(string key, function<void (GetResponse*)> cb);
+    void poll(const string &key, function<void (GetResponse*)> cb);
 
     /**
      * Polls for changes in key or anything in the directory at key,
      * calling the callback each time there is an update. Note that
      * this method blocks forever.
      */
-    void poll(string key, bool recursive, function<void (GetResponse*)> cb);
+    void poll(const string &key,
+              bool recursive,
+              function<void (GetResponse*)> cb);
 
     /**
      * Send POST request to etcd server to atomically add an in-order
      * key to a directory specified by key.
      */
-    unique_ptr<PutResponse> addToQueue(string key, string value);
+    unique_ptr<PutResponse> addToQueue(const string &key, const string &value);
 
     /**
      * Send POST request to etcd server to atomically add an in-order
      * key to a directory specified by key, specifying a ttl.
      */
-    unique_ptr<PutResponse> addToQueue(string key, string value, int ttl);
+    unique_ptr<PutResponse> addToQueue(const string &key,
+                                       const string &value,
+                                       int ttl);
 
     /**
      * Lists an in-order queue in sorted order.
      */
-    unique_ptr<GetResponse> listQueue(string key);
+    unique_ptr<GetResponse> listQueue(const string &key);
+
+    /**
+     * Send recursive GET request to etcd server, returning the
+     * directory at key as a flat NodeTree.
+     */
+    unique_ptr<TreeResponse> getTree(const string &key);
+
+    /**
+     * Lists an in-order queue in sorted order as a flat NodeTree.
+     */
+    unique_ptr<TreeResponse> listQueueTree(const string &key);
+
+    /**
+     * Send recursive GET request to etcd server, handing every node
+     * to visitor as soon as it is parsed off the wire, so listings of
+     * any size are read in constant memory.
+     *
+     * Nodes are visited in post-order: the children of a directory
+     * first, then the directory itself (with no nodes), key last. A
+     * stream is read from a single host and not retried, as the
+     * visitor may already have seen part of it.
+     */
+    unique_ptr<StreamResponse> getStream(const string &key,
+                                         const NodeVisitor &visitor);
+
+    /**
+     * Streams an in-order queue in sorted order, see getStream.
+     */
+    unique_ptr<StreamResponse> listQueueStream(const string &key,
+                                               const NodeVisitor &visitor);
+
+    /**
+     * Sends GET requests for all keys at once over parallel
+     * connections, returning the responses in the order of keys.
+     * Keys which fail are reported by their own response's error
+     * (a TRANSPORT error if etcd could not be reached) without
+     * failing the others.
+     */
+    vector<unique_ptr<GetResponse> > getMany(const vector<string> &keys);
+
+    /**
+     * Sends PUT requests setting each key to its value at once over
+     * parallel connections, returning the responses in the order of
+     * entries. Failures are reported per key as with getMany.
+     */
+    vector<unique_ptr<PutResponse> > putMany(
+      const vector<pair<string, string> > &entries);
+
+    /**
+     * Refreshes the ttl of each key to its value at once over parallel
+     * connections (see refresh), reporting failures per key as with
+     * getMany.
+     */
+    vector<unique_ptr<PutResponse> > refreshMany(
+      const vector<pair<string, int> > &keys);
+
+    unique_ptr<PutResponse> deleteKey(const string &key);
+    unique_ptr<PutResponse> deleteDirectory(const string &key);
+    unique_ptr<PutResponse> deleteQueue(const string &key);
+
+    /**
+     * Deletes key only if its current value is prevValue, or its
+     * modifiedIndex is prevIndex, failing with TEST_FAILED otherwise.
+     */
+    unique_ptr<PutResponse> compareAndDelete(const string &key,
+                                             const string &prevValue);
+    unique_ptr<PutResponse> compareAndDelete(const string &key,
+                                             int64_t prevIndex);
+
+    /*
+     * The v3 API, through the JSON gateway of etcd 3.4 and later on
+     * the same hosts, sharing the connections, host health and
+     * metrics of the session. v3 keys are flat byte strings without
+     * directories or ttls, kept apart from the keys of the v2 API.
+     * Failures the gateway reports are ETCD errors carrying the gRPC
+     * status code (below 100) and message.
+     */
 
-    unique_ptr<PutResponse> deleteKey(string key);
-    unique_ptr<PutResponse> deleteDirectory(string key);
-    unique_ptr<PutResponse> deleteQueue(string key);
+    /**
+     * Reads key, the pair is the only one of the response if key
+     * exists.
+     */
+    unique_ptr<RangeResponse> kvGet(const string &key);
+
+    /**
+     * Reads the keys from key up to rangeEnd (exclusive) in key order,
+     * or key alone if rangeEnd is empty. options can limit the reply
+     * to a page, to the keys or to their count.
+     */
+    unique_ptr<RangeResponse> kvRange(const string &key,
+                                      const string &rangeEnd,
+                                      const RangeOptions &options);
+
+    /**
+     * Reads the keys starting with prefix, see kvRange.
+     */
+    unique_ptr<RangeResponse> kvPrefix(const string &prefix,
+                                       const RangeOptions &options);
+
+    /**
+     * Visits every pair with a key starting with prefix in key order,
+     * reading pageSize of them per request. Every page is read as of
+     * the revision of the first, so the visitor sees the keys as they
+     * were at one point however long it takes. Returning false from
+     * the visitor stops.
+     *
+     * The response carries no pairs: its count is the number visited,
+     * hasMore whether the visitor stopped before the end.
+     */
+    unique_ptr<RangeResponse> kvScan(const string &prefix,
+                                     size_t pageSize,
+                                     const KeyValueVisitor &visitor);
+
+    /**
+     * Sets key to value, attached to lease unless it is 0. The
+     * response holds the previous pair of key, if there was one.
+     */
+    unique_ptr<RangeResponse> kvPut(const string &key, const string &value);
+    unique_ptr<RangeResponse> kvPut(const string &key,
+                                    const string &value,
+                                    int64_t lease);
+
+    /**
+     * Deletes key, or every key starting with prefix. The count of the
+     * response is the number of keys deleted.
+     */
+    unique_ptr<RangeResponse> kvDelete(const string &key);
+    unique_ptr<RangeResponse> kvDeletePrefix(const string &prefix);
+
+    /**
+     * Applies txn atomically in one round trip: its success operations
+     * if all its comparisons hold, its failure operations otherwise.
+     */
+    unique_ptr<TxnResponse> kvTxn(const Txn &txn);
+
+    /**
+     * Waits for the next changes to key, or to the keys starting with
+     * prefix, at or after startRevision (0 for changes from now on).
+     * Returns the events of the first revision etcd reports. Fails
+     * with gRPC code 11 (OUT_OF_RANGE) and the compacted revision as
+     * index once startRevision was compacted away.
+     */
+    unique_ptr<WatchResponse> kvWatch(const string &key, int64_t startRevision);
+    unique_ptr<WatchResponse> kvWatchPrefix(const string &prefix,
+                                            int64_t startRevision);
+
+    /**
+     * Counters of new versus reused connections made by this session.
+     */
+    ConnectionStats getConnectionStats() const;
+
+    /**
+     * Sends writes to the etcd leader, which saves followers the
+     * round trip of forwarding them. The leader is looked up on the
+     * stats endpoint of the hosts and again once it fails.
+     */
+    void setPreferLeader(bool prefer);
+
+    /**
+     * Latency, error rate and ejection state of each host.
+     */
+    vector<HostHealth> getHostHealth() const;
+
+    /**
+     * Sets where the session logs to, nothing is logged by default.
+     * Set it before sharing the session between threads.
+     */
+    void setLogger(Logger logger);
+
+    /**
+     * Compresses the values of threshold bytes or more which put,
+     * create, compareAndSwap, addToQueue and putMany write, as zlib in
+     * base64 behind a marker, unless that makes them no smaller. 0 (the
+     * default) turns compression off.
+     *
+     * Compressed values are decompressed by Node::getValue whatever
+     * the setting, and values without the marker, as written before,
+     * read as they are. prevValue of conditional writes is compared
+     * with the value as stored, compare compressed values by index.
+     * Set it before sharing the session between threads.
+     */
+    void setCompression(size_t threshold);
+
+    /**
+     * Request latencies, curl timings and per host counters since the
+     * session was created, see Metrics::toPrometheus.
+     */
+    Metrics getMetrics() const;
 
   private:
-    uint hostNo = 0;
+    enum RequestKind { READ, WAIT, WRITE };
+
     vector<Host> hosts;
-    Host &nextHost();
+    shared_ptr<ConnectionPool> pool;
+    shared_ptr<HostSelector> selector;
+    shared_ptr<MetricsRecorder> metrics;
+    Logger logger;
+    size_t compression;
+
+    // url of the keys endpoint of each host
+    vector<string> prefixes;
+
+    // url of the v3 gateway of each host
+    vector<string> v3Prefixes;
+
+    unique_ptr<GetResponse> getHelper(const string &key,
+                                      const char *query,
+                                      RequestKind kind);
+    unique_ptr<TreeResponse> treeHelper(const string &key, const char *query);
+    unique_ptr<StreamResponse> streamHelper(const string &key,
+                                            const char *query,
+                                            const NodeVisitor &visitor);
+    unique_ptr<PutResponse> putAndPostHelper(const string &key,
+                                             const string &postData,
+                                             bool usePUT);
+    unique_ptr<PutResponse> deleteHelper(const string &key, const char *query);
+    unique_ptr<RangeResponse> kvRangeHelper(const string &key,
+                                            const string &rangeEnd,
+                                            const RangeOptions &options);
+    unique_ptr<RangeResponse> kvDeleteHelper(const string &key,
+                                             const string &rangeEnd);
+    unique_ptr<WatchResponse> kvWatchHelper(const string &key,
+                                            const string &rangeEnd,
+                                            int64_t startRevision);
+    int findLeader();
+  };
+
+  /**
+   * Settings of the keep-alive connection pool kept by a session.
+   * At most maxIdle connections per host are kept open between
+   * requests, and connections left idle for longer than idleTimeout
+   * seconds are closed instead of being reused.
+   *
+   * With maxStreams above 0, requests are sent as HTTP/2 streams
+   * instead, speaking HTTP/2 right away on plain TCP (h2c with prior
+   * knowledge, which the hosts must support). Concurrent requests to a
+   * host, long-polling waits included, share one connection of up to
+   * maxStreams streams; only when all of them are taken is another
+   * connection opened.
+   */
+  class PoolOptions {
+  public:
+    PoolOptions() : maxIdle(4), idleTimeout(60), maxStreams(0) {}
+    PoolOptions(uint maxIdle, long idleTimeout) :
+      maxIdle(maxIdle),
+      idleTimeout(idleTimeout),
+      maxStreams(0) {}
+    PoolOptions(uint maxIdle, long idleTimeout, uint maxStreams) :
+      maxIdle(maxIdle),
+      idleTimeout(idleTimeout),
+      maxStreams(maxStreams) {}
+
+    uint getMaxIdle() const { return maxIdle; }
+    long getIdleTimeout() const { return idleTimeout; }
+    uint getMaxStreams() const { return maxStreams; }
+
+  private:
+    uint maxIdle;
+    long idleTimeout;
+    uint maxStreams;
+  };
+
+  /**
+   * Snapshot of the connection pool counters. Every request either
+   * reuses an open connection or has to create a new one.
+   */
+  class ConnectionStats {
+  public:
+    ConnectionStats(unsigned long reused, unsigned long created) :
+      reused(reused),
+      created(created) {}
+
+    unsigned long getReused() const { return reused; }
+    unsigned long getCreated() const { return created; }
+
+  private:
+    unsigned long reused;
+    unsigned long created;
   };
 
   /**
@@ -138,6 +525,129 @@ namespace etcd {
     int port;
   };
 
+  /**
+   * Health of a host as seen by a session. Latency is a moving average
+   * in seconds, error rate the moving average share of failed requests.
+   */
+  class HostHealth {
+  public:
+    HostHealth(Host host,
+               double latency,
+               double errorRate,
+               bool ejected,
+               bool leader) :
+      host(host),
+      latency(latency),
+      errorRate(errorRate),
+      ejected(ejected),
+      leader(leader) {}
+
+    const Host& getHost() const { return host; }
+    double getLatency() const { return latency; }
+    double getErrorRate() const { return errorRate; }
+    bool isEjected() const { return ejected; }
+    bool isLeader() const { return leader; }
+
+  private:
+    Host host;
+    double latency;
+    double errorRate;
+    bool ejected;
+    bool leader;
+  };
+
+  /**
+   * Distribution of durations in seconds. Bucket i counts the samples
+   * of at most getBounds()[i] seconds and more than the bound before
+   * it, the last bucket the ones above every bound.
+   */
+  class Histogram {
+  public:
+    Histogram(vector<double> bounds,
+              vector<uint64_t> counts,
+              double sum) :
+      bounds(move(bounds)),
+      counts(move(counts)),
+      sum(sum) {}
+
+    const vector<double>& getBounds() const { return bounds; }
+    const vector<uint64_t>& getCounts() const { return counts; }
+    uint64_t getCount() const;
+    double getSum() const { return sum; }
+
+  private:
+    vector<double> bounds;
+    vector<uint64_t> counts;
+    double sum;
+  };
+
+  /**
+   * Requests a session sent to one host: retries are the ones sent
+   * after another host failed, errors the ones which didn't reach the
+   * host, bytes the size of the response bodies received.
+   */
+  class HostMetrics {
+  public:
+    HostMetrics(Host host,
+                uint64_t requests,
+                uint64_t retries,
+                uint64_t errors,
+                uint64_t bytes) :
+      host(host),
+      requests(requests),
+      retries(retries),
+      errors(errors),
+      bytes(bytes) {}
+
+    const Host& getHost() const { return host; }
+    uint64_t getRequests() const { return requests; }
+    uint64_t getRetries() const { return retries; }
+    uint64_t getErrors() const { return errors; }
+    uint64_t getBytes() const { return bytes; }
+
+  private:
+    Host host;
+    uint64_t requests;
+    uint64_t retries;
+    uint64_t errors;
+    uint64_t bytes;
+  };
+
+  /**
+   * Snapshot of the metrics of a session.
+   *
+   * Latency is the time of a whole request as seen by the caller, per
+   * operation. The phases split the requests which reached a host using
+   * curl's timings: name lookup and connecting (only for requests which
+   * opened a connection) and transfer, from connected to done.
+   */
+  class Metrics {
+  public:
+    enum Operation { GET, PUT, WAIT, DELETE, OPERATIONS };
+    enum Phase { DNS, CONNECT, TRANSFER, PHASES };
+
+    Metrics(vector<Histogram> latencies,
+            vector<Histogram> phases,
+            vector<HostMetrics> hosts) :
+      latencies(move(latencies)),
+      phases(move(phases)),
+      hosts(move(hosts)) {}
+
+    const Histogram& getLatency(Operation op) const { return latencies[op]; }
+    const Histogram& getPhase(Phase phase) const { return phases[phase]; }
+    const vector<HostMetrics>& getHosts() const { return hosts; }
+
+    /**
+     * The metrics in the Prometheus text exposition format.
+     */
+    string toPrometheus() const;
+
+  private:
+    vector<Histogram> latencies;
+    vector<Histogram> phases;
+    vector<HostMetrics> hosts;
+  };
+
   /**
    * etcd node representation, either a leaf or directory.
    */
@@ -147,23 +657,34 @@ namespace etcd {
                       string value,
                       string expiration,
                       int ttl,
-                      int modifiedIndex,
-                      int createdIndex);
+                      int64_t modifiedIndex,
+                      int64_t createdIndex);
 
     static Node* dir(string key,
                      vector<Node> nodes,
                      string expiration,
                      int ttl,
-                     int modifiedIndex,
-                     int createdIndex);
+                     int64_t modifiedIndex,
+                     int64_t createdIndex);
 
     string getKey() const { return key; }
-    string getValue() const { return value; }
-    vector<Node> getNodes() const { return nodes; }
+    /**
+     * The value, decompressed if a session compressed it, see
+     * Session::setCompression. Decompression happens on every call,
+     * callers reading a large value repeatedly should keep it.
+     */
+    string getValue() const;
+
+    /**
+     * The value as etcd stores it, compressed or not.
+     */
+    const string& getRawValue() const { return value; }
+
+    const vector<Node>& getNodes() const { return nodes; }
     string getExpiration() const { return expiration; }
     int getTtl() const { return ttl; }
-    int getModifiedIndex() const { return modifiedIndex; }
-    int getCreatedIndex() const { return createdIndex; }
+    int64_t getModifiedIndex() const { return modifiedIndex; }
+    int64_t getCreatedIndex() const { return createdIndex; }
     bool isDirectory() const { return isDir; }
 
   private:
@@ -173,13 +694,13 @@ namespace etcd {
          bool isDir,
          string expiration,
          int ttl,
-         int modifiedIndex,
-         int createdIndex) :
-      key(key),
-      value(value),
-      nodes(nodes),
+         int64_t modifiedIndex,
+         int64_t createdIndex) :
+      key(move(key)),
+      value(move(value)),
+      nodes(move(nodes)),
       isDir(isDir),
-      expiration(expiration),
+      expiration(move(expiration)),
       ttl(ttl),
       modifiedIndex(modifiedIndex),
       createdIndex(createdIndex) {}
@@ -190,52 +711,346 @@ namespace etcd {
     bool isDir;
     string expiration;
     int ttl;
-    int modifiedIndex;
-    int createdIndex;
+    int64_t modifiedIndex;
+    int64_t createdIndex;
+  };
+
+  /**
+   * Reference to characters owned by something else, such as
+   * the string arena of a NodeTree.
+   */
+  class StringRef {
+  public:
+    StringRef(const char *data, size_t length) :
+      data(data),
+      length(length) {}
+
+    const char* getData() const { return data; }
+    size_t getLength() const { return length; }
+    string str() const { return string(data, length); }
+
+  private:
+    const char *data;
+    size_t length;
+  };
+
+  /**
+   * Entry of a NodeTree. Parent, children and siblings are referred
+   * to by their position in the tree, NodeTree::NONE if absent.
+   */
+  class TreeNode {
+  public:
+    uint32_t getParent() const { return parent; }
+    uint32_t getFirstChild() const { return firstChild; }
+    uint32_t getNextSibling() const { return nextSibling; }
+
+    /**
+     * Position one past the last descendant of this node, the
+     * subtree of the node at i spans [i, getEnd()).
+     */
+    uint32_t getEnd() const { return end; }
+
+    int getTtl() const { return ttl; }
+    int64_t getModifiedIndex() const { return modifiedIndex; }
+    int64_t getCreatedIndex() const { return createdIndex; }
+    bool isDirectory() const { return isDir; }
+
+  private:
+    friend class NodeTree;
+
+    uint32_t parent;
+    uint32_t firstChild;
+    uint32_t nextSibling;
+    uint32_t end;
+    uint32_t name;
+    uint32_t nameLength;
+    uint32_t value;
+    uint32_t valueLength;
+    uint32_t expiration;
+    uint32_t expirationLength;
+    int ttl;
+    int64_t modifiedIndex;
+    int64_t createdIndex;
+    bool isDir;
+    bool absoluteName;
+  };
+
+  /**
+   * Flat representation of a node and all its descendants, an
+   * alternative to the nested Node for large recursive reads.
+   *
+   * Nodes are kept in one array in depth-first order, so every
+   * subtree is a contiguous range of it, and all strings are kept
+   * in one arena. Each node only stores the part of its key past
+   * the key of its parent, the full key is rebuilt on request.
+   */
+  class NodeTree {
+  public:
+    static const uint32_t NONE = 0xffffffff;
+
+    /**
+     * Iterates over the children of a node by following the
+     * sibling links.
+     */
+    class ChildIterator {
+    public:
+      ChildIterator(const NodeTree *tree, uint32_t index) :
+        tree(tree),
+        index(index) {}
+
+      uint32_t getIndex() const { return index; }
+      const TreeNode& operator*() const { return (*tree)[index]; }
+      const TreeNode* operator->() const { return &(*tree)[index]; }
+
+      ChildIterator& operator++() {
+        index = (*tree)[index].getNextSibling();
+        return *this;
+      }
+
+      bool operator==(const ChildIterator &other) const {
+        return index == other.index;
+      }
+
+      bool operator!=(const ChildIterator &other) const {
+        return index != other.index;
+      }
+
+    private:
+      const NodeTree *tree;
+      uint32_t index;
+    };
+
+    /**
+     * Children of a node, for use in range-based for loops.
+     */
+    class Children {
+    public:
+      Children(const NodeTree *tree, uint32_t first) :
+        tree(tree),
+        first(first) {}
+
+      ChildIterator begin() const { return ChildIterator(tree, first); }
+      ChildIterator end() const { return ChildIterator(tree, NONE); }
+
+    private:
+      const NodeTree *tree;
+      uint32_t first;
+    };
+
+    /**
+     * Reads the tree below the node object of an etcd response.
+     */
+    static NodeTree* read(rapidjson::Value &root);
+
+    size_t size() const { return nodes.size(); }
+    const TreeNode& operator[](uint32_t i) const { return nodes[i]; }
+    const TreeNode& getRoot() const { return nodes[0]; }
+
+    /**
+     * All nodes in depth-first order. The descendants of the node at i
+     * are the range [begin() + i + 1, begin() + (*this)[i].getEnd()).
+     */
+    const TreeNode* begin() const { return nodes.data(); }
+    const TreeNode* end() const { return nodes.data() + nodes.size(); }
+
+    Children getChildren(uint32_t i) const {
+      return Children(this, nodes[i].getFirstChild());
+    }
+
+    /**
+     * Full key of the node at i.
+     */
+    string getKey(uint32_t i) const;
+
+    /**
+     * Part of the key of the node at i past the key of its parent.
+     */
+    StringRef getName(uint32_t i) const;
+
+    /**
+     * Value of the node at i as stored, compressed values included.
+     * getDecodedValue decompresses those, see Node::getValue.
+     */
+    StringRef getValue(uint32_t i) const;
+    string getDecodedValue(uint32_t i) const;
+
+    StringRef getExpiration(uint32_t i) const;
+
+    /**
+     * Position of a node of this tree, so the accessors above can be
+     * used while iterating over nodes.
+     */
+    uint32_t indexOf(const TreeNode &node) const {
+      return &node - nodes.data();
+    }
+
+  private:
+    NodeTree() {}
+
+    uint32_t append(rapidjson::Value &value,
+                    uint32_t parent,
+                    const char *parentKey,
+                    size_t parentKeyLength);
+    uint32_t intern(const char *data, size_t length);
+
+    vector<TreeNode> nodes;
+    string strings;
   };
 
+  /**
+   * Error returned in place of a response, requests never throw.
+   * Errors reported by etcd carry its errorCode, message, cause and
+   * index; transport errors (etcd could not be reached, or replied
+   * with something other than JSON) carry the curl error code and
+   * message; HTTP errors (a failure status without an etcd error, as
+   * from a proxy) carry the status. Both have the url as cause.
+   */
   class ResponseError {
   public:
+    enum Kind { ETCD, TRANSPORT, HTTP };
+
+    /**
+     * errorCode values reported by etcd.
+     */
+    enum Code {
+      KEY_NOT_FOUND = 100,
+      TEST_FAILED = 101,
+      NOT_FILE = 102,
+      NOT_DIR = 104,
+      NODE_EXIST = 105,
+      ROOT_READ_ONLY = 107,
+      DIR_NOT_EMPTY = 108,
+      UNAUTHORIZED = 110,
+      PREV_VALUE_REQUIRED = 201,
+      TTL_NAN = 202,
+      INDEX_NAN = 203,
+      INVALID_FIELD = 209,
+      INVALID_FORM = 210,
+      RAFT_INTERNAL = 300,
+      LEADER_ELECT = 301,
+      WATCHER_CLEARED = 400,
+      EVENT_INDEX_CLEARED = 401
+    };
+
     ResponseError(int errorCode,
                   string message,
                   string cause,
-                  int index) :
+                  int64_t index) :
+    kind(ETCD),
     errorCode(errorCode),
     message(message),
     cause(cause),
     index(index) {}
 
+    static ResponseError* transport(int curlCode,
+                                    string message,
+                                    string url);
+    static ResponseError* http(int status, string message, string url);
+
+    Kind getKind() { return kind; }
     int getErrorCode() { return errorCode; }
     string getMessage() { return message; }
     string getCause() { return cause; }
-    int getIndex() { return index; }
+    int64_t getIndex() { return index; }
+
+    /**
+     * Outcomes of conditional operations: the key is missing, the
+     * compared value or index didn't match, or create found the key.
+     */
+    bool isKeyNotFound() const { return is(KEY_NOT_FOUND); }
+    bool isTestFailed() const { return is(TEST_FAILED); }
+    bool isNodeExist() const { return is(NODE_EXIST); }
 
   private:
+    bool is(Code code) const {
+      return kind == ETCD && errorCode == code;
+    }
+
+    Kind kind;
     int errorCode;
     string message;
     string cause;
-    int index;
+    int64_t index;
   };
 
   /**
    * Response of a GET operation, contains the root node
-   * which was retrieved.
+   * which was retrieved. For responses to a wait, the action
+   * names the change which happened to the node ("set", "delete",
+   * "expire", ...).
    */
   class GetResponse {
   public:
     static GetResponse* success(unique_ptr<Node> node);
+    static GetResponse* success(unique_ptr<Node> node, string action);
     static GetResponse* failure(unique_ptr<ResponseError> error);
 
     Node* getNode() const { return node.get(); }
+    string getAction() const { return action; }
     ResponseError* getError() const { return error.get(); }
 
   private:
     GetResponse(unique_ptr<Node> node,
+                string action,
                 unique_ptr<ResponseError> error) :
       node(move(node)),
+      action(action),
       error(move(error)) {}
 
     unique_ptr<Node> node;
+    string action;
+    unique_ptr<ResponseError> error;
+  };
+
+  /**
+   * Response of a GET operation read into a NodeTree.
+   */
+  class TreeResponse {
+  public:
+    static TreeResponse* success(unique_ptr<NodeTree> tree);
+    static TreeResponse* failure(unique_ptr<ResponseError> error);
+
+    NodeTree* getTree() const { return tree.get(); }
+    ResponseError* getError() const { return error.get(); }
+
+  private:
+    TreeResponse(unique_ptr<NodeTree> tree,
+                 unique_ptr<ResponseError> error) :
+      tree(move(tree)),
+      error(move(error)) {}
+
+    unique_ptr<NodeTree> tree;
+    unique_ptr<ResponseError> error;
+  };
+
+  /**
+   * Response of a streamed GET operation. The nodes went to the
+   * visitor, the response counts them and tells whether the visitor
+   * ended the stream before its end.
+   */
+  class StreamResponse {
+  public:
+    static StreamResponse* success(string action, size_t count, bool stopped);
+    static StreamResponse* failure(unique_ptr<ResponseError> error);
+
+    string getAction() const { return action; }
+    size_t getCount() const { return count; }
+    bool isStopped() const { return stopped; }
+    ResponseError* getError() const { return error.get(); }
+
+  private:
+    StreamResponse(string action,
+                   size_t count,
+                   bool stopped,
+                   unique_ptr<ResponseError> error) :
+      action(move(action)),
+      count(count),
+      stopped(stopped),
+      error(move(error)) {}
+
+    string action;
+    size_t count;
+    bool stopped;
     unique_ptr<ResponseError> error;
   };
 
@@ -266,6 +1081,327 @@ namespace etcd {
     unique_ptr<Node> prevNode;
     unique_ptr<ResponseError> error;
   };
+
+  /**
+   * Key-value pair of the v3 API. createRevision and modRevision are
+   * the revisions of the changes which created the key and last
+   * changed it, version the number of changes since it was created.
+   */
+  class KeyValue {
+  public:
+    KeyValue(string key,
+             string value,
+             int64_t createRevision,
+             int64_t modRevision,
+             int64_t version,
+             int64_t lease) :
+      key(move(key)),
+      value(move(value)),
+      createRevision(createRevision),
+      modRevision(modRevision),
+      version(version),
+      lease(lease) {}
+
+    const string& getKey() const { return key; }
+    const string& getValue() const { return value; }
+    int64_t getCreateRevision() const { return createRevision; }
+    int64_t getModRevision() const { return modRevision; }
+    int64_t getVersion() const { return version; }
+    int64_t getLease() const { return lease; }
+
+  private:
+    string key;
+    string value;
+    int64_t createRevision;
+    int64_t modRevision;
+    int64_t version;
+    int64_t lease;
+  };
+
+  /**
+   * What a v3 range read returns: by default every pair in the range
+   * as of the latest revision. A limit of 0 means no limit, a
+   * revision of 0 the latest one.
+   */
+  class RangeOptions {
+  public:
+    RangeOptions() :
+      limit(0),
+      revision(0),
+      keysOnly(false),
+      countOnly(false) {}
+
+    RangeOptions& setLimit(int64_t limit) {
+      this->limit = limit;
+      return *this;
+    }
+    RangeOptions& setRevision(int64_t revision) {
+      this->revision = revision;
+      return *this;
+    }
+    RangeOptions& setKeysOnly(bool keysOnly) {
+      this->keysOnly = keysOnly;
+      return *this;
+    }
+    RangeOptions& setCountOnly(bool countOnly) {
+      this->countOnly = countOnly;
+      return *this;
+    }
+
+    int64_t getLimit() const { return limit; }
+    int64_t getRevision() const { return revision; }
+    bool isKeysOnly() const { return keysOnly; }
+    bool isCountOnly() const { return countOnly; }
+
+  private:
+    int64_t limit;
+    int64_t revision;
+    bool keysOnly;
+    bool countOnly;
+  };
+
+  /**
+   * Response of a v3 read or write. count is the number of keys in
+   * the range whatever the limit, hasMore whether the limit left some
+   * of them out, revision the revision of the store when etcd
+   * answered.
+   */
+  class RangeResponse {
+  public:
+    static RangeResponse* success(vector<KeyValue> kvs,
+                                  bool more,
+                                  int64_t count,
+                                  int64_t revision);
+    static RangeResponse* failure(unique_ptr<ResponseError> error);
+
+    const vector<KeyValue>& getKvs() const { return kvs; }
+    bool hasMore() const { return more; }
+    int64_t getCount() const { return count; }
+    int64_t getRevision() const { return revision; }
+    ResponseError* getError() const { return error.get(); }
+
+  private:
+    RangeResponse(vector<KeyValue> kvs,
+                  bool more,
+                  int64_t count,
+                  int64_t revision,
+                  unique_ptr<ResponseError> error) :
+      kvs(move(kvs)),
+      more(more),
+      count(count),
+      revision(revision),
+      error(move(error)) {}
+
+    vector<KeyValue> kvs;
+    bool more;
+    int64_t count;
+    int64_t revision;
+    unique_ptr<ResponseError> error;
+  };
+
+  /**
+   * Condition of a v3 transaction on the current state of a key. A
+   * missing key has an empty value and version and revisions of 0.
+   */
+  class Compare {
+  public:
+    enum Target { VALUE, VERSION, CREATE, MOD };
+    enum Result { EQUAL, NOT_EQUAL, GREATER, LESS };
+
+    static Compare value(string key, Result result, string value) {
+      return Compare(move(key), VALUE, result, move(value), 0);
+    }
+    static Compare version(string key, Result result, int64_t version) {
+      return Compare(move(key), VERSION, result, "", version);
+    }
+    static Compare createRevision(string key, Result result, int64_t revision) {
+      return Compare(move(key), CREATE, result, "", revision);
+    }
+    static Compare modRevision(string key, Result result, int64_t revision) {
+      return Compare(move(key), MOD, result, "", revision);
+    }
+
+    const string& getKey() const { return key; }
+    Target getTarget() const { return target; }
+    Result getResult() const { return result; }
+    const string& getValue() const { return expected; }
+    int64_t getNumber() const { return number; }
+
+  private:
+    Compare(string key, Target target, Result result, string value, int64_t number) :
+      key(move(key)),
+      target(target),
+      result(result),
+      expected(move(value)),
+      number(number) {}
+
+    string key;
+    Target target;
+    Result result;
+    string expected;
+    int64_t number;
+  };
+
+  /**
+   * Read or write of a v3 transaction, on a key or on every key
+   * starting with a prefix.
+   */
+  class TxnOp {
+  public:
+    enum Type { GET, PUT, DELETE };
+
+    static TxnOp get(string key) {
+      return TxnOp(GET, move(key), false, "", 0);
+    }
+    static TxnOp getPrefix(string prefix) {
+      return TxnOp(GET, move(prefix), true, "", 0);
+    }
+    static TxnOp put(string key, string value) {
+      return TxnOp(PUT, move(key), false, move(value), 0);
+    }
+    static TxnOp put(string key, string value, int64_t lease) {
+      return TxnOp(PUT, move(key), false, move(value), lease);
+    }
+    static TxnOp remove(string key) {
+      return TxnOp(DELETE, move(key), false, "", 0);
+    }
+    static TxnOp removePrefix(string prefix) {
+      return TxnOp(DELETE, move(prefix), true, "", 0);
+    }
+
+    Type getType() const { return type; }
+    const string& getKey() const { return key; }
+    bool isPrefix() const { return prefix; }
+    const string& getValue() const { return value; }
+    int64_t getLease() const { return lease; }
+
+  private:
+    TxnOp(Type type, string key, bool prefix, string value, int64_t lease) :
+      type(type),
+      key(move(key)),
+      prefix(prefix),
+      value(move(value)),
+      lease(lease) {}
+
+    Type type;
+    string key;
+    bool prefix;
+    string value;
+    int64_t lease;
+  };
+
+  /**
+   * v3 transaction, built up as in
+   *
+   *   Txn().when(Compare::version("/lock", Compare::EQUAL, 0))
+   *        .then(TxnOp::put("/lock", "me"))
+   *        .otherwise(TxnOp::get("/lock"))
+   */
+  class Txn {
+  public:
+    Txn& when(Compare compare) {
+      compares.push_back(move(compare));
+      return *this;
+    }
+    Txn& then(TxnOp op) {
+      success.push_back(move(op));
+      return *this;
+    }
+    Txn& otherwise(TxnOp op) {
+      failure.push_back(move(op));
+      return *this;
+    }
+
+    const vector<Compare>& getCompares() const { return compares; }
+    const vector<TxnOp>& getSuccess() const { return success; }
+    const vector<TxnOp>& getFailure() const { return failure; }
+
+  private:
+    vector<Compare> compares;
+    vector<TxnOp> success;
+    vector<TxnOp> failure;
+  };
+
+  /**
+   * Response of a v3 transaction: whether its comparisons held, and
+   * a response for each operation of the branch applied, in order.
+   * Those of gets hold the pairs read, those of puts the previous
+   * pair, those of deletes the number of keys deleted as count.
+   */
+  class TxnResponse {
+  public:
+    static TxnResponse* success(bool succeeded,
+                                int64_t revision,
+                                vector<unique_ptr<RangeResponse> > responses);
+    static TxnResponse* failure(unique_ptr<ResponseError> error);
+
+    bool isSucceeded() const { return succeeded; }
+    int64_t getRevision() const { return revision; }
+    const vector<unique_ptr<RangeResponse> >& getResponses() const {
+      return responses;
+    }
+    ResponseError* getError() const { return error.get(); }
+
+  private:
+    TxnResponse(bool succeeded,
+                int64_t revision,
+                vector<unique_ptr<RangeResponse> > responses,
+                unique_ptr<ResponseError> error) :
+      succeeded(succeeded),
+      revision(revision),
+      responses(move(responses)),
+      error(move(error)) {}
+
+    bool succeeded;
+    int64_t revision;
+    vector<unique_ptr<RangeResponse> > responses;
+    unique_ptr<ResponseError> error;
+  };
+
+  /**
+   * Change to a key reported by a v3 watch: the pair it was set to,
+   * or for a delete the key with the revision of the delete.
+   */
+  class WatchEvent {
+  public:
+    enum Type { PUT, DELETE };
+
+    WatchEvent(Type type, KeyValue kv) : type(type), kv(move(kv)) {}
+
+    Type getType() const { return type; }
+    const KeyValue& getKeyValue() const { return kv; }
+
+  private:
+    Type type;
+    KeyValue kv;
+  };
+
+  /**
+   * Response of a v3 watch, the events of a revision in the order
+   * they happened. revision is the revision of the store when etcd
+   * reported them.
+   */
+  class WatchResponse {
+  public:
+    static WatchResponse* success(vector<WatchEvent> events, int64_t revision);
+    static WatchResponse* failure(unique_ptr<ResponseError> error);
+
+    const vector<WatchEvent>& getEvents() const { return events; }
+    int64_t getRevision() const { return revision; }
+    ResponseError* getError() const { return error.get(); }
+
+  private:
+    WatchResponse(vector<WatchEvent> events,
+                  int64_t revision,
+                  unique_ptr<ResponseError> error) :
+      events(move(events)),
+      revision(revision),
+      error(move(error)) {}
+
+    vector<WatchEvent> events;
+    int64_t revision;
+    unique_ptr<ResponseError> error;
+  };
 }
 
 ostream& operator<<(ostream& os, const etcd::Node& node);
@@ -0,0 +1,271 @@
+#include <curl/curl.h>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "eventloop.h"
+#include "internal.h"
+
+using namespace std;
+using namespace etcd;
+
+/* easy handles kept around for reuse between transfers */
+static const size_t MAX_IDLE_HANDLES = 64;
+
+EventLoop::EventLoop() :
+  stopping(false),
+  detached(false),
+  nextId(1) {
+
+  init_curl();
+  multi = curl_multi_init();
+  worker = thread(&EventLoop::run, this);
+}
+
+EventLoop::EventLoop(long maxStreams) :
+  stopping(false),
+  detached(false),
+  nextId(1) {
+
+  init_curl();
+  multi = curl_multi_init();
+  curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, maxStreams);
+  worker = thread(&EventLoop::run, this);
+}
+
+EventLoop::~EventLoop() {
+  stop();
+  for (CURL *curl : idle) {
+    curl_easy_cleanup(curl);
+  }
+  curl_multi_cleanup(multi);
+}
+
+uint64_t EventLoop::submit(Setup setup, Completion done) {
+  Transfer *transfer = new Transfer;
+  transfer->curl = NULL;
+  transfer->setup = setup;
+  transfer->done = done;
+
+  uint64_t id;
+  bool accepted;
+  {
+    lock_guard<mutex> guard(lock);
+    id = transfer->id = nextId++;
+    accepted = !stopping;
+    if (accepted) {
+      queued.push_back(transfer);
+    }
+  }
+
+  if (!accepted) {
+    finish(transfer, CURLE_ABORTED_BY_CALLBACK);
+    return id;
+  }
+
+  curl_multi_wakeup(multi);
+  return id;
+}
+
+void EventLoop::cancel(uint64_t id) {
+  {
+    lock_guard<mutex> guard(lock);
+    cancelled.push_back(id);
+  }
+  curl_multi_wakeup(multi);
+}
+
+void EventLoop::after(long millis, function<void ()> fn) {
+  {
+    lock_guard<mutex> guard(lock);
+    if (stopping) {
+      return;
+    }
+    scheduled.push_back(Timer(clock::now() + chrono::milliseconds(millis), fn));
+  }
+  curl_multi_wakeup(multi);
+}
+
+void EventLoop::stop() {
+  {
+    lock_guard<mutex> guard(lock);
+    if (stopping) {
+      return;
+    }
+    stopping = true;
+  }
+
+  curl_multi_wakeup(multi);
+  worker.join();
+}
+
+void EventLoop::stopDetached() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+    detached = true;
+  }
+  worker.detach();
+}
+
+void EventLoop::run() {
+  while (true) {
+    vector<Transfer*> starting;
+    vector<uint64_t> cancelling;
+    vector<Timer> timing;
+    bool done;
+
+    {
+      lock_guard<mutex> guard(lock);
+      starting.swap(queued);
+      cancelling.swap(cancelled);
+      timing.swap(scheduled);
+      done = stopping;
+    }
+
+    timers.insert(timing.begin(), timing.end());
+
+    for (Transfer *transfer : starting) {
+      if (find(cancelling.begin(), cancelling.end(), transfer->id)
+          != cancelling.end()) {
+        delete transfer;
+      } else {
+        start(transfer);
+      }
+    }
+
+    for (uint64_t id : cancelling) {
+      auto it = running.find(id);
+      if (it != running.end()) {
+        Transfer *transfer = it->second;
+        curl_multi_remove_handle(multi, transfer->curl);
+        running.erase(it);
+        recycle(transfer->curl);
+        delete transfer;
+      }
+    }
+
+    if (done) {
+      break;
+    }
+
+    int active = 0;
+    curl_multi_perform(multi, &active);
+
+    CURLMsg *msg;
+    int left = 0;
+    while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+
+      Transfer *transfer = NULL;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &transfer);
+      CURLcode res = msg->data.result;
+      curl_multi_remove_handle(multi, transfer->curl);
+      running.erase(transfer->id);
+      finish(transfer, res);
+    }
+
+    long timeout = runTimers();
+    curl_multi_poll(multi, NULL, 0, timeout, NULL);
+  }
+
+  for (auto &entry : running) {
+    curl_multi_remove_handle(multi, entry.second->curl);
+    finish(entry.second, CURLE_ABORTED_BY_CALLBACK);
+  }
+  running.clear();
+
+  // anything submitted after the last drain of the queue
+  vector<Transfer*> starting;
+  {
+    lock_guard<mutex> guard(lock);
+    starting.swap(queued);
+  }
+  for (Transfer *transfer : starting) {
+    finish(transfer, CURLE_ABORTED_BY_CALLBACK);
+  }
+
+  bool orphaned;
+  {
+    lock_guard<mutex> guard(lock);
+    orphaned = detached;
+  }
+  if (orphaned) {
+    // nothing touches the loop after this, stop returns right away
+    delete this;
+  }
+}
+
+/**
+ * Runs the timers which are due, returning the number of milliseconds
+ * until the next one (at most a second).
+ */
+long EventLoop::runTimers() {
+  clock::time_point now = clock::now();
+  while (!timers.empty() && timers.begin()->first <= now) {
+    function<void ()> fn = timers.begin()->second;
+    timers.erase(timers.begin());
+    fn();
+  }
+
+  if (timers.empty()) {
+    return 1000;
+  }
+
+  long wait = chrono::duration_cast<chrono::milliseconds>(
+    timers.begin()->first - now).count();
+  return wait < 1000 ? wait + 1 : 1000;
+}
+
+void EventLoop::start(Transfer *transfer) {
+  CURL *curl;
+  if (!idle.empty()) {
+    curl = idle.back();
+    idle.pop_back();
+  } else {
+    curl = curl_easy_init();
+  }
+
+  if (curl == NULL) {
+    finish(transfer, CURLE_FAILED_INIT);
+    return;
+  }
+
+  transfer->curl = curl;
+  transfer->setup(curl);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &writer);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &transfer->body);
+  curl_easy_setopt(curl, CURLOPT_PRIVATE, transfer);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+
+  running[transfer->id] = transfer;
+  curl_multi_add_handle(multi, curl);
+}
+
+void EventLoop::finish(Transfer *transfer, CURLcode res) {
+  long status = 0;
+  if (transfer->curl != NULL) {
+    curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &status);
+  }
+
+  transfer->done(res, status, transfer->body);
+  if (transfer->curl != NULL) {
+    recycle(transfer->curl);
+  }
+  delete transfer;
+}
+
+void EventLoop::recycle(CURL *curl) {
+  if (idle.size() < MAX_IDLE_HANDLES) {
+    curl_easy_reset(curl);
+    idle.push_back(curl);
+  } else {
+    curl_easy_cleanup(curl);
+  }
+}
@@ -0,0 +1,117 @@
+#ifndef LIBETCDCLIENT_EVENTLOOP_cxx_
+#define LIBETCDCLIENT_EVENTLOOP_cxx_
+
+#include <curl/curl.h>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace etcd {
+  /**
+   * Single thread driving any number of concurrent transfers through
+   * one curl_multi handle. Transfers share the connection cache of the
+   * multi handle, so connections to a host are kept alive and reused.
+   */
+  class EventLoop {
+  public:
+    /**
+     * Configures the easy handle of a transfer (url, method, body).
+     * Called on the loop thread.
+     */
+    typedef function<void (CURL*)> Setup;
+
+    /**
+     * Called on the loop thread once a transfer is done, with the curl
+     * result, the HTTP status (0 if there was no response) and the
+     * response body. The easy handle given to Setup is still valid
+     * for reading its info. Must not block or throw.
+     */
+    typedef function<void (CURLcode, long, string&)> Completion;
+
+    EventLoop();
+
+    /**
+     * Loop multiplexing the transfers to a host as HTTP/2 streams over
+     * its connections, at most maxStreams on each.
+     */
+    explicit EventLoop(long maxStreams);
+    ~EventLoop();
+
+    /**
+     * Queues a transfer, returning an id which can be used to cancel it.
+     */
+    uint64_t submit(Setup setup, Completion done);
+
+    /**
+     * Cancels a queued or running transfer, its completion is never
+     * called. Does nothing if the transfer already completed.
+     */
+    void cancel(uint64_t id);
+
+    /**
+     * Runs fn on the loop thread once millis milliseconds have passed.
+     * Timers still pending when the loop stops are dropped.
+     */
+    void after(long millis, function<void ()> fn);
+
+    /**
+     * Stops the loop thread, completing all outstanding transfers with
+     * CURLE_ABORTED_BY_CALLBACK. Called by the destructor.
+     */
+    void stop();
+
+    /**
+     * Whether the caller runs on the loop thread, i.e. in a callback.
+     */
+    bool isLoopThread() const { return this_thread::get_id() == worker.get_id(); }
+
+    /**
+     * Stops the loop from one of its callbacks, which can't wait for the
+     * loop thread. Outstanding transfers complete as with stop once the
+     * callback returns, then the loop deletes itself.
+     */
+    void stopDetached();
+
+  private:
+    struct Transfer {
+      uint64_t id;
+      CURL *curl;
+      Setup setup;
+      Completion done;
+      string body;
+    };
+
+    typedef chrono::steady_clock clock;
+    typedef pair<clock::time_point, function<void ()> > Timer;
+
+    void run();
+    long runTimers();
+    void start(Transfer *transfer);
+    void finish(Transfer *transfer, CURLcode res);
+    void recycle(CURL *curl);
+
+    CURLM *multi;
+    thread worker;
+    mutex lock;
+    bool stopping;
+    bool detached;
+    uint64_t nextId;
+    vector<Transfer*> queued;
+    vector<uint64_t> cancelled;
+    vector<Timer> scheduled;
+
+    // only touched by the loop thread
+    map<uint64_t, Transfer*> running;
+    multimap<clock::time_point, function<void ()> > timers;
+    vector<CURL*> idle;
+  };
+}
+
+#endif
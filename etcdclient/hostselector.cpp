@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include "hostselector.h"
+
+using namespace std;
+using namespace etcd;
+
+/* ejection backoff after the first failure, doubled with each one after */
+static const long BASE_BACKOFF_MS = 1000;
+static const long MAX_BACKOFF_MS = 30000;
+
+/* how long a leader lookup is trusted, and one which found none */
+static const long LEADER_TTL_MS = 30000;
+static const long NO_LEADER_TTL_MS = 1000;
+
+/* weight of the newest sample in the moving averages */
+static const double LATENCY_WEIGHT = 0.2;
+static const double ERROR_WEIGHT = 0.1;
+
+HostSelector::HostSelector(vector<Host> hosts) :
+  hosts(hosts),
+  states(new State[hosts.size()]),
+  next(0),
+  preferLeader(false),
+  leader(NONE),
+  leaderSince(0) {
+
+  for (uint host = 0; host < hosts.size(); host++) {
+    states[host].latency = 0;
+    states[host].errorRate = 0;
+    states[host].failures = 0;
+    states[host].ejectedUntil = 0;
+  }
+}
+
+HostSelector::clock::rep HostSelector::now() {
+  return clock::now().time_since_epoch().count();
+}
+
+/**
+ * Lower is better, hosts without a latency sample yet come first so
+ * they get one.
+ */
+double HostSelector::score(const State &state) const {
+  return state.latency * (1 + 4 * state.errorRate);
+}
+
+uint HostSelector::select(uint64_t tried) {
+  clock::rep time = now();
+  uint size = hosts.size();
+  uint start = next.fetch_add(1, memory_order_relaxed);
+  int first = NONE;
+  int second = NONE;
+
+  for (uint i = 0; i < size && second == NONE; i++) {
+    uint host = (start + i) % size;
+    bool skip = (host < 64 && (tried >> host) & 1)
+      || states[host].ejectedUntil.load(memory_order_relaxed) > time;
+    if (skip) {
+      continue;
+    }
+    if (first == NONE) {
+      first = host;
+    } else {
+      second = host;
+    }
+  }
+
+  if (first == NONE) {
+    // an untried host, even an ejected one, before one already tried
+    int soonest = NONE;
+    for (int pass = 0; pass < 2 && soonest == NONE; pass++) {
+      for (uint host = 0; host < size; host++) {
+        bool wasTried = host < 64 && (tried >> host) & 1;
+        if (pass == 0 && wasTried) {
+          continue;
+        }
+        if (soonest == NONE
+            || states[host].ejectedUntil < states[soonest].ejectedUntil) {
+          soonest = host;
+        }
+      }
+    }
+    return soonest;
+  }
+
+  if (second != NONE && score(states[second]) < score(states[first])) {
+    return second;
+  }
+  return first;
+}
+
+void HostSelector::succeeded(uint host, double seconds) {
+  State &state = states[host];
+  if (seconds >= 0) {
+    double latency = state.latency.load(memory_order_relaxed);
+    state.latency.store(latency == 0
+                        ? seconds
+                        : (1 - LATENCY_WEIGHT) * latency
+                          + LATENCY_WEIGHT * seconds,
+                        memory_order_relaxed);
+  }
+
+  double errorRate = state.errorRate.load(memory_order_relaxed);
+  if (errorRate != 0) {
+    state.errorRate.store((1 - ERROR_WEIGHT) * errorRate,
+                          memory_order_relaxed);
+  }
+
+  // only written when set, so the common case stays read-only
+  if (state.failures.load(memory_order_relaxed) != 0) {
+    state.failures = 0;
+    state.ejectedUntil = 0;
+  }
+}
+
+void HostSelector::failed(uint host) {
+  State &state = states[host];
+  double errorRate = state.errorRate.load(memory_order_relaxed);
+  state.errorRate.store((1 - ERROR_WEIGHT) * errorRate + ERROR_WEIGHT,
+                        memory_order_relaxed);
+
+  uint failures = state.failures++;
+  long backoff = min(MAX_BACKOFF_MS, BASE_BACKOFF_MS << min(failures, 5u));
+  state.ejectedUntil = now() + chrono::duration_cast<clock::duration>(
+    chrono::milliseconds(backoff)).count();
+
+  // not a lookup which found none, the next lookup is due right away
+  int current = host;
+  if (leader.compare_exchange_strong(current, NONE)) {
+    leaderSince = 0;
+  }
+}
+
+int HostSelector::getLeader() {
+  int current = leader;
+  clock::rep expired = now() - chrono::duration_cast<clock::duration>(
+    chrono::milliseconds(LEADER_TTL_MS)).count();
+
+  if (current != NONE && leaderSince < expired) {
+    return NONE;
+  }
+  return current;
+}
+
+void HostSelector::setLeader(int host) {
+  leaderSince = now();
+  leader = host;
+}
+
+bool HostSelector::isLeaderLookupDue() {
+  long ttl = leader == NONE ? NO_LEADER_TTL_MS : LEADER_TTL_MS;
+  return leaderSince < now() - chrono::duration_cast<clock::duration>(
+    chrono::milliseconds(ttl)).count();
+}
+
+vector<HostHealth> HostSelector::getHealth() {
+  clock::rep time = now();
+  int current = getLeader();
+  vector<HostHealth> health;
+  for (uint host = 0; host < hosts.size(); host++) {
+    health.push_back(HostHealth(hosts[host],
+                                states[host].latency,
+                                states[host].errorRate,
+                                states[host].ejectedUntil > time,
+                                current == (int) host));
+  }
+  return health;
+}
@@ -0,0 +1,96 @@
+#ifndef LIBETCDCLIENT_HOSTSELECTOR_cxx_
+#define LIBETCDCLIENT_HOSTSELECTOR_cxx_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "etcdclient.h"
+
+using namespace std;
+
+namespace etcd {
+  /**
+   * Picks the host for each request of a session, keeping track of the
+   * latency and error rate of every host.
+   *
+   * Hosts are tried in round-robin order, of two consecutive candidates
+   * the one with the better latency and error rate is picked. A host
+   * which fails is ejected for a backoff doubling with each consecutive
+   * failure, and taken back once the backoff passes.
+   *
+   * All state is kept in atomics so concurrent requests never wait on
+   * each other here. Concurrent updates of the moving averages may drop
+   * a sample, which only makes them slightly less smooth.
+   */
+  class HostSelector {
+  public:
+    static const int NONE = -1;
+
+    HostSelector(vector<Host> hosts);
+
+    /**
+     * Picks a host, avoiding the ones in tried (a bit per host). Only
+     * if every host is ejected or tried, the untried host whose backoff
+     * ends first is picked, and a tried one once all were tried.
+     */
+    uint select(uint64_t tried);
+
+    /**
+     * Records a successful request, seconds is its duration or negative
+     * if it shouldn't count towards the latency (long-polls).
+     */
+    void succeeded(uint host, double seconds);
+
+    /**
+     * Records a failure to reach host, ejecting it.
+     */
+    void failed(uint host);
+
+    /**
+     * Host known to be the leader, NONE if it isn't known or the last
+     * lookup is too old.
+     */
+    int getLeader();
+
+    /**
+     * Records the result of a lookup, NONE if no host reported being
+     * the leader. That result is trusted for a shorter time, so writes
+     * during an election or through proxies don't each look it up.
+     */
+    void setLeader(int host);
+
+    /**
+     * Whether the last lookup is too old to be trusted.
+     */
+    bool isLeaderLookupDue();
+
+    bool getPreferLeader() const { return preferLeader; }
+    void setPreferLeader(bool prefer) { preferLeader = prefer; }
+
+    vector<HostHealth> getHealth();
+
+  private:
+    typedef chrono::steady_clock clock;
+
+    struct State {
+      atomic<double> latency;
+      atomic<double> errorRate;
+      atomic<uint> failures;
+      atomic<clock::rep> ejectedUntil;
+    };
+
+    static clock::rep now();
+    double score(const State &state) const;
+
+    vector<Host> hosts;
+    unique_ptr<State[]> states;
+    atomic<uint> next;
+    atomic<bool> preferLeader;
+    atomic<int> leader;
+    atomic<clock::rep> leaderSince;
+  };
+}
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef LIBETCDCLIENT_INTERNAL_cxx_
+#define LIBETCDCLIENT_INTERNAL_cxx_
+
+#include <curl/curl.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "rapidjson/document.h"
+#include "etcdclient.h"
+#include "eventloop.h"
+
+/*
+ * Helpers shared between the translation units of the library,
+ * not installed with the public headers.
+ */
+
+int writer(char *data, size_t size, size_t nmemb, string *buffer);
+
+void init_curl();
+
+namespace etcd {
+  /**
+   * Pool of curl easy handles kept per host. An easy handle holds on
+   * to its connection after a transfer, so handing the same handle
+   * out again reuses the open socket instead of reconnecting.
+   *
+   * Each host has its own lock, only held to push or pop a handle.
+   *
+   * When the options ask for HTTP/2, handed out handles speak it and
+   * the pool has an event loop for multiplexing requests as streams.
+   */
+  class ConnectionPool {
+  public:
+    ConnectionPool(size_t size, PoolOptions options) :
+      options(options),
+      size(size),
+      hosts(new HostPool[size]),
+      multiplexer(options.getMaxStreams() > 0
+                  ? new EventLoop(options.getMaxStreams())
+                  : NULL) {}
+    ~ConnectionPool();
+
+    CURL *acquire(uint host);
+    void release(uint host, CURL *curl);
+    void discard(CURL *curl);
+    ConnectionStats getStats() const;
+
+    /**
+     * Counts the connection a finished transfer on curl used as either
+     * reused or created, see getStats.
+     */
+    void count(CURL *curl);
+
+    /**
+     * Loop running the requests of the pool as HTTP/2 streams, NULL
+     * when the pool speaks HTTP/1.1.
+     */
+    EventLoop *getMultiplexer() const { return multiplexer.get(); }
+
+    /**
+     * Multi handles for sending many requests at once. A multi handle
+     * keeps its own connection cache, pooling them keeps those open
+     * between batches.
+     */
+    CURLM *acquireMulti();
+    void releaseMulti(CURLM *multi);
+
+  private:
+    typedef chrono::steady_clock clock;
+
+    struct IdleHandle {
+      CURL *curl;
+      clock::time_point since;
+    };
+
+    struct HostPool {
+      mutex lock;
+      vector<IdleHandle> idle;
+    };
+
+    PoolOptions options;
+    size_t size;
+    unique_ptr<HostPool[]> hosts;
+    mutex multiLock;
+    vector<CURLM*> idleMultis;
+    atomic<unsigned long> reused { 0 };
+    atomic<unsigned long> created { 0 };
+    unique_ptr<EventLoop> multiplexer;
+  };
+}
+
+/**
+ * Response body parsed in situ: the strings of the document point into
+ * the body, which is kept alive along with it. Values are allocated from
+ * a memory pool which starts out in an inline buffer, so the document of
+ * a small response needs no allocation of its own.
+ */
+class ParsedResponse {
+public:
+  /**
+   * Parses the contents of result, leaving it empty. status is the
+   * HTTP status of the response, 0 if unknown.
+   */
+  ParsedResponse(string &result, long status = 0);
+
+  rapidjson::Document &getDocument() { return document; }
+  bool failed() const { return document.HasParseError(); }
+  long getStatus() const { return status; }
+
+private:
+  ParsedResponse(const ParsedResponse&);
+  ParsedResponse& operator=(const ParsedResponse&);
+
+  char buffer[4096];
+  string body;
+  long status;
+  rapidjson::MemoryPoolAllocator<> allocator;
+  rapidjson::Document document;
+};
+
+string host_url(const etcd::Host &host);
+
+string base_url(const etcd::Host &host, const string &key);
+
+unique_ptr<etcd::Node> readNode(rapidjson::Value &root);
+
+unique_ptr<etcd::GetResponse> readGetResponse(rapidjson::Document &resp);
+
+unique_ptr<etcd::PutResponse> readPutResponse(rapidjson::Document &resp);
+
+/**
+ * Key of the directory without a trailing slash, "/" for the root.
+ */
+string directory_key(string key);
+
+/**
+ * Newest modifiedIndex in the tree below node, the index a watch of
+ * the tree resumes after.
+ */
+int64_t newest_index(const etcd::Node &node);
+
+/**
+ * Current etcd index, as reported with the error for a hidden key below
+ * dir which doesn't exist, without reading dir itself. 0 if it couldn't
+ * be read.
+ */
+int64_t current_index(etcd::Session &session, const string &dir);
+
+/**
+ * The error of a response which isn't a valid etcd response for url: a
+ * failure status without an etcd error in the body is an HTTP error, a
+ * body which is no JSON object a transport error. NULL otherwise, etcd
+ * errors are left to readGetResponse and readPutResponse.
+ */
+etcd::ResponseError* checkResponse(ParsedResponse &resp, const string &url);
+
+/**
+ * Response of type R failed with error.
+ */
+template <typename R>
+unique_ptr<R> failure(unique_ptr<etcd::ResponseError> error) {
+  return unique_ptr<R>(R::failure(move(error)));
+}
+
+namespace etcd {
+  class MetricsRecorder;
+}
+
+/**
+ * Request performed by with_curl. Nothing is copied: the url and body
+ * are handed to curl as they are and must outlive the request. method
+ * is NULL for a GET (or a POST, when there is a body), postData NULL
+ * when there is no body.
+ */
+struct HttpRequest {
+  const char *url;
+  const char *method;
+  const string *postData;
+};
+
+/**
+ * Request for key on an api endpoint, query (if not empty) starting
+ * with '?'. method is NULL for a GET, postData NULL without a body.
+ */
+struct KeyRequest {
+  const string &key;
+  const char *query;
+  const char *method;
+  const string *postData;
+};
+
+namespace etcd {
+  class HostSelector;
+}
+
+/**
+ * Sends request to the host picked by the selector, or to the leader if
+ * asked for and known, appending its key to the prefix of the host.
+ * Transport failures of reads are retried once on every other host
+ * before giving up, after which NULL is returned with the error of the
+ * last attempt. error is also set when the response is no valid etcd
+ * response, see checkResponse.
+ *
+ * Failed attempts are logged as errors, completed requests as info
+ * along with their duration and, at debug level, their response.
+ * Every attempt and the request as a whole are recorded in metrics
+ * under op, waits don't count towards the latency of the host.
+ */
+unique_ptr<ParsedResponse> send(etcd::ConnectionPool &pool,
+                                etcd::HostSelector &selector,
+                                etcd::MetricsRecorder &metrics,
+                                const etcd::Logger &logger,
+                                const vector<string> &prefixes,
+                                int leader,
+                                const KeyRequest &request,
+                                bool retry,
+                                etcd::Metrics::Operation op,
+                                unique_ptr<etcd::ResponseError> &error);
+
+/**
+ * Performs request on a pooled handle for host, or as a stream on the
+ * multiplexer of the pool if it has one. Once it succeeded, its curl
+ * timings are recorded in metrics (if given). Returns NULL with the
+ * curl error in res if it failed, a pooled handle is then closed.
+ */
+unique_ptr<ParsedResponse> with_curl(etcd::ConnectionPool &pool,
+                                     uint host,
+                                     const HttpRequest &request,
+                                     CURLcode &res,
+                                     etcd::MetricsRecorder *metrics = NULL,
+                                     bool retried = false);
+
+#endif
@@ -0,0 +1,173 @@
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include "leasekeeper.h"
+
+using namespace std;
+using namespace etcd;
+
+const long LeaseKeeper::TICK_MS;
+const size_t LeaseKeeper::WHEEL_SIZE;
+const long LeaseKeeper::RETRY_MS;
+
+LeaseKeeper::LeaseKeeper(Session session) :
+  LeaseKeeper(session, nullptr) {}
+
+LeaseKeeper::LeaseKeeper(Session session, FailureCallback onFailure) :
+  session(session),
+  onFailure(onFailure),
+  wheel(WHEEL_SIZE),
+  cursor(0),
+  nextGeneration(1),
+  random(random_device()()),
+  stopped(false),
+  refreshed(0),
+  failures(0) {
+
+  worker = thread(&LeaseKeeper::run, this);
+}
+
+LeaseKeeper::~LeaseKeeper() {
+  stop();
+}
+
+void LeaseKeeper::keep(string key, int ttl) {
+  lock_guard<mutex> guard(lock);
+  Lease &lease = leases[key];
+  lease.ttl = ttl;
+  lease.generation = nextGeneration++;
+  schedule(key, lease.generation, refreshDelay(ttl));
+}
+
+void LeaseKeeper::release(string key) {
+  lock_guard<mutex> guard(lock);
+  leases.erase(key);
+}
+
+size_t LeaseKeeper::size() const {
+  lock_guard<mutex> guard(lock);
+  return leases.size();
+}
+
+void LeaseKeeper::stop() {
+  {
+    lock_guard<mutex> guard(lock);
+    if (stopped) {
+      return;
+    }
+    stopped = true;
+  }
+  wakeup.notify_all();
+  if (worker.joinable()) {
+    worker.join();
+  }
+}
+
+/**
+ * Puts key on the wheel delayMs from now, rounded down to whole ticks.
+ * Slots left in the wheel by a key which was released or kept again
+ * are told apart by their generation and skipped once due.
+ */
+void LeaseKeeper::schedule(const string &key, uint64_t generation,
+                           long delayMs) {
+  size_t ticks = delayMs > TICK_MS ? delayMs / TICK_MS : 1;
+  Slot slot = { key, generation, (ticks - 1) / WHEEL_SIZE };
+  wheel[(cursor + ticks) % WHEEL_SIZE].push_back(slot);
+}
+
+long LeaseKeeper::refreshDelay(int ttl) {
+  uniform_real_distribution<double> share(1.0 / 3, 1.0 / 2);
+  return share(random) * ttl * 1000;
+}
+
+void LeaseKeeper::run() {
+  clock::time_point next = clock::now() + chrono::milliseconds(TICK_MS);
+  unique_lock<mutex> guard(lock);
+
+  while (!stopped) {
+    wakeup.wait_until(guard, next);
+    if (stopped || clock::now() < next) {
+      continue;
+    }
+
+    // catch up on every tick which passed, a slow batch delays the
+    // keys after it but never skips them
+    vector<pair<string, int> > due;
+    vector<uint64_t> generations;
+    while (next <= clock::now()) {
+      cursor = (cursor + 1) % WHEEL_SIZE;
+      vector<Slot> waiting;
+      for (Slot &slot : wheel[cursor]) {
+        if (slot.rounds > 0) {
+          slot.rounds--;
+          waiting.push_back(move(slot));
+          continue;
+        }
+
+        unordered_map<string, Lease>::iterator lease = leases.find(slot.key);
+        if (lease != leases.end() && lease->second.generation == slot.generation) {
+          due.push_back(make_pair(slot.key, lease->second.ttl));
+          generations.push_back(slot.generation);
+        }
+      }
+      wheel[cursor].swap(waiting);
+      next += chrono::milliseconds(TICK_MS);
+    }
+
+    if (!due.empty()) {
+      guard.unlock();
+      refresh(due, generations);
+      guard.lock();
+    }
+  }
+}
+
+/**
+ * Refreshes the due keys in one batch and schedules the next refresh
+ * of each, or its retry.
+ */
+void LeaseKeeper::refresh(vector<pair<string, int> > &due,
+                          vector<uint64_t> &generations) {
+  vector<unique_ptr<PutResponse> > responses = session.refreshMany(due);
+
+  vector<size_t> failed;
+  {
+    lock_guard<mutex> guard(lock);
+    for (size_t i = 0; i < due.size(); i++) {
+      const string &key = due[i].first;
+      ResponseError *error = responses[i]->getError();
+      unordered_map<string, Lease>::iterator lease = leases.find(key);
+      bool current = lease != leases.end()
+        && lease->second.generation == generations[i];
+
+      if (error == NULL) {
+        refreshed++;
+        if (current) {
+          schedule(key, generations[i], refreshDelay(lease->second.ttl));
+        }
+        continue;
+      }
+
+      failures++;
+      failed.push_back(i);
+      if (!current) {
+        continue;
+      }
+      if (error->isKeyNotFound() || error->isTestFailed()) {
+        // the key expired or was deleted, refreshing can't bring it back
+        leases.erase(lease);
+      } else {
+        schedule(key, generations[i], RETRY_MS);
+      }
+    }
+  }
+
+  if (onFailure) {
+    for (size_t i : failed) {
+      onFailure(due[i].first, responses[i]->getError());
+    }
+  }
+}
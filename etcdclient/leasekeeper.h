@@ -0,0 +1,115 @@
+#ifndef LIBETCDCLIENT_LEASEKEEPER_cxx_
+#define LIBETCDCLIENT_LEASEKEEPER_cxx_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "etcdclient.h"
+
+using namespace std;
+
+namespace etcd {
+  /**
+   * Keeps keys with a ttl alive from a single thread, refreshing their
+   * ttl (without resending their value) before they expire.
+   *
+   * Keys are scheduled on a timer wheel of TICK_MS slots. Each refresh
+   * is due at a random point between a third and half of the ttl after
+   * the last one, so keys registered together spread out instead of
+   * refreshing in bursts, and the keys due in a tick go out as one
+   * batch over parallel connections.
+   *
+   * The failure callback is called on the keeper thread with every key
+   * which failed to refresh. Keys which etcd reports gone (they expired
+   * or were deleted) are dropped, any other failure, such as a host
+   * which couldn't be reached or an election in progress, is retried
+   * after a second.
+   */
+  class LeaseKeeper {
+  public:
+    typedef function<void (const string &key, ResponseError *error)> FailureCallback;
+
+    static const long TICK_MS = 100;
+
+    LeaseKeeper(Session session);
+    LeaseKeeper(Session session, FailureCallback onFailure);
+    ~LeaseKeeper();
+
+    /**
+     * Keeps refreshing key with ttl (in seconds) until released. The
+     * key must already exist, keeping a kept key again replaces its ttl.
+     */
+    void keep(string key, int ttl);
+
+    /**
+     * Stops refreshing key, leaving it to expire.
+     */
+    void release(string key);
+
+    /**
+     * Number of keys being kept.
+     */
+    size_t size() const;
+
+    unsigned long getRefreshed() const { return refreshed; }
+    unsigned long getFailures() const { return failures; }
+
+    /**
+     * Stops the keeper thread, waiting for a batch in flight.
+     */
+    void stop();
+
+  private:
+    typedef chrono::steady_clock clock;
+
+    static const size_t WHEEL_SIZE = 1024;
+    static const long RETRY_MS = 1000;
+
+    struct Lease {
+      int ttl;
+      uint64_t generation;
+    };
+
+    struct Slot {
+      string key;
+      uint64_t generation;
+      size_t rounds;
+    };
+
+    LeaseKeeper(const LeaseKeeper&);
+    LeaseKeeper& operator=(const LeaseKeeper&);
+
+    void run();
+    void schedule(const string &key, uint64_t generation, long delayMs);
+    long refreshDelay(int ttl);
+    void refresh(vector<pair<string, int> > &due,
+                 vector<uint64_t> &generations);
+
+    Session session;
+    FailureCallback onFailure;
+
+    mutable mutex lock;
+    condition_variable wakeup;
+    unordered_map<string, Lease> leases;
+    vector<vector<Slot> > wheel;
+    size_t cursor;
+    uint64_t nextGeneration;
+    minstd_rand random;
+    bool stopped;
+
+    atomic<unsigned long> refreshed;
+    atomic<unsigned long> failures;
+
+    thread worker;
+  };
+}
+
+#endif
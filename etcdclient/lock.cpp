@@ -0,0 +1,299 @@
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "lock.h"
+
+using namespace std;
+using namespace etcd;
+
+/* pause before trying again after etcd failed a request */
+static const long RETRY_MS = 100;
+
+Lock::Lock(vector<Host> hosts, string dir, int ttl) :
+  Lock(hosts, dir, ttl, "") {}
+
+Lock::Lock(vector<Host> hosts, string dir, int ttl, string value) :
+  session(hosts),
+  dir(dir),
+  ttl(ttl),
+  value(value),
+  watching(0),
+  held(false),
+  check(false),
+  stopped(false),
+  requests(0),
+  wakeups(0),
+  keeper(session, [this](const string &key, ResponseError *error) {
+      onLost(key, error);
+    }),
+  watcher(hosts) {}
+
+Lock::~Lock() {
+  unlock();
+  stop();
+}
+
+bool Lock::lock() {
+  return lock(clock::time_point(), true);
+}
+
+bool Lock::lock(long timeoutMillis) {
+  return lock(clock::now() + chrono::milliseconds(timeoutMillis), false);
+}
+
+bool Lock::lock(clock::time_point deadline, bool forever) {
+  unique_lock<mutex> guard(stateLock);
+
+  while (!stopped && !held) {
+    bool failed = false;
+    if (key.empty()) {
+      guard.unlock();
+      failed = !enqueue();
+      guard.lock();
+    } else if (check) {
+      check = false;
+      guard.unlock();
+      failed = !findPredecessor();
+      guard.lock();
+      check = check || failed;
+    } else if (forever) {
+      changed.wait(guard);
+      continue;
+    } else if (changed.wait_until(guard, deadline) == cv_status::timeout
+               && !check && !held) {
+      return false;
+    }
+
+    if (failed) {
+      if (!forever && clock::now() >= deadline) {
+        return false;
+      }
+      changed.wait_for(guard, chrono::milliseconds(RETRY_MS));
+    }
+  }
+  return held;
+}
+
+/**
+ * Adds the key of the contender at the end of the line.
+ */
+bool Lock::enqueue() {
+  requests++;
+  unique_ptr<PutResponse> r = session.addToQueue(dir, value, ttl);
+  if (r->getError() != NULL) {
+    return false;
+  }
+
+  string queued = r->getNode()->getKey();
+  keeper.keep(queued, ttl);
+
+  lock_guard<mutex> guard(stateLock);
+  key = queued;
+  check = true;
+  return true;
+}
+
+/**
+ * Lists the line to find the contender right before this one, taking
+ * the lock if there is none and watching its key otherwise. Returns
+ * false if the line couldn't be read.
+ */
+bool Lock::findPredecessor() {
+  Watcher::WatchId previous;
+  string own;
+  {
+    lock_guard<mutex> guard(stateLock);
+    previous = watching;
+    watching = 0;
+    predecessor.clear();
+    own = key;
+  }
+  if (previous != 0) {
+    watcher.cancel(previous);
+  }
+
+  requests++;
+  unique_ptr<GetResponse> r = session.listQueue(dir);
+  if (r->getError() != NULL || r->getNode() == NULL) {
+    return false;
+  }
+
+  // in-order keys have the same length, sorting them by key sorts
+  // them by createdIndex
+  const Node *before = NULL;
+  bool queued = false;
+  for (const Node &node : r->getNode()->getNodes()) {
+    if (node.getKey() == own) {
+      queued = true;
+    } else if (!node.isDirectory() && node.getKey() < own) {
+      before = &node;
+    }
+  }
+
+  string watched;
+  {
+    lock_guard<mutex> guard(stateLock);
+    if (key != own) {
+      // released or lost meanwhile
+      return true;
+    }
+    if (!queued) {
+      // the key expired before the lock was taken, line up again
+      key.clear();
+    } else if (before == NULL) {
+      held = true;
+    } else {
+      watched = before->getKey();
+      predecessor = watched;
+    }
+  }
+
+  if (!queued) {
+    keeper.release(own);
+    return true;
+  }
+  if (watched.empty()) {
+    return true;
+  }
+
+  // refreshes of its ttl don't notify watchers, the next change after
+  // the listing is the key going away
+  Watcher::WatchId id =
+    watcher.watch(watched, false, before->getModifiedIndex() + 1,
+                  [this, watched](GetResponse *r) {
+                    onPredecessor(watched, r);
+                  });
+
+  // kept even if the key went away already, the next check cancels it
+  lock_guard<mutex> guard(stateLock);
+  watching = id;
+  return true;
+}
+
+void Lock::onPredecessor(const string &watched, GetResponse *r) {
+  ResponseError *error = r->getError();
+  bool gone;
+  if (error != NULL) {
+    // only reported once the watch read the key again and found none
+    gone = error->isKeyNotFound();
+  } else {
+    string action = r->getAction();
+    gone = action == "delete"
+      || action == "compareAndDelete"
+      || action == "expire";
+  }
+  if (!gone) {
+    return;
+  }
+
+  {
+    lock_guard<mutex> guard(stateLock);
+    if (predecessor != watched) {
+      return;
+    }
+    predecessor.clear();
+    check = true;
+    wakeups++;
+  }
+  changed.notify_all();
+}
+
+/**
+ * Called by the keeper when the ttl of lost couldn't be refreshed. Only
+ * a key etcd no longer has is lost, the keeper retries other failures.
+ */
+void Lock::onLost(const string &lost, ResponseError *error) {
+  if (!error->isKeyNotFound()) {
+    return;
+  }
+
+  {
+    lock_guard<mutex> guard(stateLock);
+    if (lost != key) {
+      return;
+    }
+    key.clear();
+    held = false;
+    check = false;
+  }
+  changed.notify_all();
+}
+
+bool Lock::unlock() {
+  string own;
+  Watcher::WatchId previous;
+  {
+    lock_guard<mutex> guard(stateLock);
+    own = key;
+    previous = watching;
+    key.clear();
+    predecessor.clear();
+    watching = 0;
+    held = false;
+    check = false;
+  }
+  changed.notify_all();
+
+  if (previous != 0) {
+    watcher.cancel(previous);
+  }
+  if (own.empty()) {
+    return true;
+  }
+
+  keeper.release(own);
+  requests++;
+  unique_ptr<PutResponse> r = session.deleteKey(own);
+  return r->getError() == NULL || r->getError()->isKeyNotFound();
+}
+
+bool Lock::isHeld() const {
+  lock_guard<mutex> guard(stateLock);
+  return held;
+}
+
+string Lock::getKey() const {
+  lock_guard<mutex> guard(stateLock);
+  return key;
+}
+
+void Lock::stop() {
+  {
+    lock_guard<mutex> guard(stateLock);
+    stopped = true;
+  }
+  changed.notify_all();
+  watcher.stop();
+  keeper.stop();
+}
+
+Election::Election(vector<Host> hosts, string dir, int ttl, string value) :
+  contender(hosts, dir, ttl, value) {}
+
+bool Election::campaign() {
+  return contender.lock();
+}
+
+bool Election::campaign(long timeoutMillis) {
+  return contender.lock(timeoutMillis);
+}
+
+bool Election::resign() {
+  return contender.unlock();
+}
+
+unique_ptr<Node> Election::getLeader() {
+  unique_ptr<GetResponse> r =
+    contender.getSession().listQueue(contender.getDirectory());
+  if (r->getError() != NULL || r->getNode() == NULL) {
+    return NULL;
+  }
+
+  for (const Node &node : r->getNode()->getNodes()) {
+    if (!node.isDirectory()) {
+      return unique_ptr<Node>(new Node(node));
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,168 @@
+#ifndef LIBETCDCLIENT_LOCK_cxx_
+#define LIBETCDCLIENT_LOCK_cxx_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "etcdclient.h"
+#include "leasekeeper.h"
+#include "watcher.h"
+
+using namespace std;
+
+namespace etcd {
+  /**
+   * Lock shared by any number of processes through a directory in
+   * etcd, handed from one holder to the next without waking the other
+   * contenders.
+   *
+   * Contenders line up as in-order keys in the directory (see
+   * Session::addToQueue), so the createdIndex in each key gives its
+   * place in line. The first in line holds the lock. Every other
+   * contender watches only the key right before its own, so a release
+   * wakes the next in line and no one else. A woken contender lists the
+   * directory once, to tell whether it is now first or its predecessor
+   * just gave up waiting.
+   *
+   * The key of a contender has a ttl, refreshed by a LeaseKeeper for
+   * as long as it waits or holds the lock, so the lock of a process
+   * which died passes on once its key expires. Releasing deletes the
+   * key, the one request after which the next in line takes over.
+   *
+   * A Lock is a single contender, meant to be used by one thread at a
+   * time. Threads of a process contend with a Lock each.
+   */
+  class Lock {
+  public:
+    Lock(vector<Host> hosts, string dir, int ttl);
+
+    /**
+     * Contender whose key holds value, such as the name of the process
+     * or its address.
+     */
+    Lock(vector<Host> hosts, string dir, int ttl, string value);
+
+    /**
+     * Releases the lock, or leaves the line, and stops.
+     */
+    ~Lock();
+
+    /**
+     * Waits until the lock is held. Returns false once stopped.
+     */
+    bool lock();
+
+    /**
+     * Waits at most timeoutMillis for the lock, returning false if it
+     * isn't held by then. The contender keeps its place in line, a
+     * later call carries on waiting from there; unlock leaves the line.
+     */
+    bool lock(long timeoutMillis);
+
+    /**
+     * Releases the lock, or leaves the line if it isn't held yet.
+     * Returns false if the key couldn't be deleted, it then expires
+     * after its ttl.
+     */
+    bool unlock();
+
+    /**
+     * Whether the lock is held, which ends early if its key expired
+     * because its ttl couldn't be refreshed in time.
+     */
+    bool isHeld() const;
+
+    /**
+     * Key of the contender in the directory, empty when not in line.
+     */
+    string getKey() const;
+
+    const string& getDirectory() const { return dir; }
+
+    /**
+     * Requests sent to etcd, besides the refreshes of the ttl, and the
+     * times the departure of a predecessor woke this contender.
+     */
+    unsigned long getRequests() const { return requests; }
+    unsigned long getWakeups() const { return wakeups; }
+
+    /**
+     * Stops waiting for the lock, without releasing it.
+     */
+    void stop();
+
+    Session& getSession() { return session; }
+
+  private:
+    typedef chrono::steady_clock clock;
+
+    Lock(const Lock&);
+    Lock& operator=(const Lock&);
+
+    bool lock(clock::time_point deadline, bool forever);
+    bool enqueue();
+    bool findPredecessor();
+    void onPredecessor(const string &watched, GetResponse *r);
+    void onLost(const string &lost, ResponseError *error);
+
+    Session session;
+    string dir;
+    int ttl;
+    string value;
+
+    mutable mutex stateLock;
+    condition_variable changed;
+    string key;
+    string predecessor;
+    Watcher::WatchId watching;
+    bool held;
+    bool check;
+    bool stopped;
+
+    atomic<unsigned long> requests;
+    atomic<unsigned long> wakeups;
+
+    // declared last, so they stop before the state goes away
+    LeaseKeeper keeper;
+    Watcher watcher;
+  };
+
+  /**
+   * Leader election among any number of processes, as a Lock whose
+   * holder is the leader and whose key holds the value of the leader.
+   */
+  class Election {
+  public:
+    Election(vector<Host> hosts, string dir, int ttl, string value);
+
+    /**
+     * Waits until elected, see Lock::lock.
+     */
+    bool campaign();
+    bool campaign(long timeoutMillis);
+
+    /**
+     * Steps down, or stops running, see Lock::unlock.
+     */
+    bool resign();
+
+    bool isLeader() const { return contender.isHeld(); }
+
+    /**
+     * The key of the current leader, holding its value. NULL if there
+     * is none or the directory couldn't be read.
+     */
+    unique_ptr<Node> getLeader();
+
+    Lock& getLock() { return contender; }
+
+  private:
+    Lock contender;
+  };
+}
+
+#endif
@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "metrics.h"
+
+using namespace std;
+using namespace etcd;
+
+static const double BOUNDS[] = {
+  0.0001, 0.00025, 0.0005,
+  0.001, 0.0025, 0.005,
+  0.01, 0.025, 0.05,
+  0.1, 0.25, 0.5,
+  1, 2.5, 5, 10
+};
+
+static const char *OPERATION_NAMES[] = { "get", "put", "wait", "delete" };
+static const char *PHASE_NAMES[] = { "dns", "connect", "transfer" };
+
+MetricsRecorder::MetricsRecorder(vector<Host> hosts) :
+  hosts(hosts),
+  counters(new HostCounters[hosts.size()]) {
+
+  for (AtomicHistogram &histogram : latencies) {
+    for (atomic<uint64_t> &count : histogram.counts) {
+      count = 0;
+    }
+    histogram.nanos = 0;
+  }
+  for (AtomicHistogram &histogram : phases) {
+    for (atomic<uint64_t> &count : histogram.counts) {
+      count = 0;
+    }
+    histogram.nanos = 0;
+  }
+  for (uint host = 0; host < hosts.size(); host++) {
+    counters[host].requests = 0;
+    counters[host].retries = 0;
+    counters[host].errors = 0;
+    counters[host].bytes = 0;
+  }
+}
+
+void MetricsRecorder::AtomicHistogram::add(double seconds) {
+  if (seconds < 0) {
+    seconds = 0;
+  }
+  size_t bucket = lower_bound(BOUNDS, BOUNDS + BUCKETS - 1, seconds) - BOUNDS;
+  counts[bucket].fetch_add(1, memory_order_relaxed);
+  nanos.fetch_add((uint64_t) (seconds * 1e9), memory_order_relaxed);
+}
+
+Histogram MetricsRecorder::AtomicHistogram::read() const {
+  vector<uint64_t> snapshot;
+  snapshot.reserve(BUCKETS);
+  for (const atomic<uint64_t> &count : counts) {
+    snapshot.push_back(count.load(memory_order_relaxed));
+  }
+  return Histogram(vector<double>(BOUNDS, BOUNDS + BUCKETS - 1),
+                   move(snapshot),
+                   nanos.load(memory_order_relaxed) / 1e9);
+}
+
+void MetricsRecorder::request(Metrics::Operation op, double seconds) {
+  latencies[op].add(seconds);
+}
+
+void MetricsRecorder::succeeded(uint host, CURL *curl, bool retry) {
+  curl_off_t bytes = 0;
+  curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+
+  HostCounters &c = counters[host];
+  c.requests.fetch_add(1, memory_order_relaxed);
+  c.bytes.fetch_add(bytes, memory_order_relaxed);
+  if (retry) {
+    c.retries.fetch_add(1, memory_order_relaxed);
+  }
+
+  double lookup = 0, connect = 0, total = 0;
+  long connects = 0;
+  curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &lookup);
+  curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+  curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+  curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+
+  if (connects > 0) {
+    phases[Metrics::DNS].add(lookup);
+    phases[Metrics::CONNECT].add(connect - lookup);
+  }
+  phases[Metrics::TRANSFER].add(total - connect);
+}
+
+void MetricsRecorder::failed(uint host, bool retry) {
+  HostCounters &c = counters[host];
+  c.requests.fetch_add(1, memory_order_relaxed);
+  c.errors.fetch_add(1, memory_order_relaxed);
+  if (retry) {
+    c.retries.fetch_add(1, memory_order_relaxed);
+  }
+}
+
+Metrics MetricsRecorder::snapshot() const {
+  vector<Histogram> ops;
+  for (const AtomicHistogram &histogram : latencies) {
+    ops.push_back(histogram.read());
+  }
+
+  vector<Histogram> timings;
+  for (const AtomicHistogram &histogram : phases) {
+    timings.push_back(histogram.read());
+  }
+
+  vector<HostMetrics> perHost;
+  for (uint host = 0; host < hosts.size(); host++) {
+    const HostCounters &c = counters[host];
+    perHost.push_back(HostMetrics(hosts[host],
+                                  c.requests.load(memory_order_relaxed),
+                                  c.retries.load(memory_order_relaxed),
+                                  c.errors.load(memory_order_relaxed),
+                                  c.bytes.load(memory_order_relaxed)));
+  }
+
+  return Metrics(move(ops), move(timings), move(perHost));
+}
+
+uint64_t Histogram::getCount() const {
+  uint64_t count = 0;
+  for (uint64_t c : counts) {
+    count += c;
+  }
+  return count;
+}
+
+static void writeHistogram(ostringstream &out,
+                           const string &name,
+                           const string &label,
+                           const Histogram &histogram) {
+  const vector<double> &bounds = histogram.getBounds();
+  const vector<uint64_t> &counts = histogram.getCounts();
+  uint64_t cumulative = 0;
+
+  for (size_t i = 0; i < counts.size(); i++) {
+    cumulative += counts[i];
+    out << name << "_bucket{" << label << ",le=\"";
+    if (i < bounds.size()) {
+      out << bounds[i];
+    } else {
+      out << "+Inf";
+    }
+    out << "\"} " << cumulative << "\n";
+  }
+  out << name << "_sum{" << label << "} " << histogram.getSum() << "\n";
+  out << name << "_count{" << label << "} " << cumulative << "\n";
+}
+
+static void writeCounter(ostringstream &out,
+                         const string &name,
+                         const string &help,
+                         const vector<HostMetrics> &hosts,
+                         uint64_t (HostMetrics::*value)() const) {
+  out << "# HELP " << name << " " << help << "\n"
+      << "# TYPE " << name << " counter\n";
+  for (const HostMetrics &host : hosts) {
+    out << name << "{host=\"" << host.getHost().getHost()
+        << ":" << host.getHost().getPort() << "\"} "
+        << (host.*value)() << "\n";
+  }
+}
+
+string Metrics::toPrometheus() const {
+  ostringstream out;
+  out.precision(12);
+
+  out << "# HELP etcdclient_request_duration_seconds"
+      << " Duration of requests by operation, including retries.\n"
+      << "# TYPE etcdclient_request_duration_seconds histogram\n";
+  for (int op = 0; op < OPERATIONS; op++) {
+    writeHistogram(out, "etcdclient_request_duration_seconds",
+                   string("op=\"") + OPERATION_NAMES[op] + "\"",
+                   latencies[op]);
+  }
+
+  out << "# HELP etcdclient_phase_duration_seconds"
+      << " Time spent in name lookup, connecting and transferring.\n"
+      << "# TYPE etcdclient_phase_duration_seconds histogram\n";
+  for (int phase = 0; phase < PHASES; phase++) {
+    writeHistogram(out, "etcdclient_phase_duration_seconds",
+                   string("phase=\"") + PHASE_NAMES[phase] + "\"",
+                   phases[phase]);
+  }
+
+  writeCounter(out, "etcdclient_host_requests_total",
+               "Requests sent to a host.", hosts, &HostMetrics::getRequests);
+  writeCounter(out, "etcdclient_host_retries_total",
+               "Requests sent to a host after another one failed.",
+               hosts, &HostMetrics::getRetries);
+  writeCounter(out, "etcdclient_host_errors_total",
+               "Requests which failed to reach a host.",
+               hosts, &HostMetrics::getErrors);
+  writeCounter(out, "etcdclient_host_response_bytes_total",
+               "Bytes of response bodies received from a host.",
+               hosts, &HostMetrics::getBytes);
+
+  return out.str();
+}
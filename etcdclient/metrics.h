@@ -0,0 +1,69 @@
+#ifndef LIBETCDCLIENT_METRICS_cxx_
+#define LIBETCDCLIENT_METRICS_cxx_
+
+#include <curl/curl.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "etcdclient.h"
+
+using namespace std;
+
+namespace etcd {
+  /**
+   * Collects the metrics of a session. Every sample is a handful of
+   * relaxed atomic increments, so recording never blocks a request and
+   * a snapshot taken while requests complete may be off by the samples
+   * being recorded.
+   */
+  class MetricsRecorder {
+  public:
+    MetricsRecorder(vector<Host> hosts);
+
+    /**
+     * Records the duration of a request made by the caller, including
+     * any retries.
+     */
+    void request(Metrics::Operation op, double seconds);
+
+    /**
+     * Records an attempt which reached host, reading the timings and
+     * size of the transfer from curl.
+     */
+    void succeeded(uint host, CURL *curl, bool retry);
+
+    /**
+     * Records an attempt which failed to reach host.
+     */
+    void failed(uint host, bool retry);
+
+    Metrics snapshot() const;
+
+  private:
+    /* histogram bucket bounds in seconds, from 100us to 10s */
+    static const size_t BUCKETS = 17;
+
+    struct AtomicHistogram {
+      atomic<uint64_t> counts[BUCKETS];
+      atomic<uint64_t> nanos;
+
+      void add(double seconds);
+      Histogram read() const;
+    };
+
+    struct HostCounters {
+      atomic<uint64_t> requests;
+      atomic<uint64_t> retries;
+      atomic<uint64_t> errors;
+      atomic<uint64_t> bytes;
+    };
+
+    vector<Host> hosts;
+    AtomicHistogram latencies[Metrics::OPERATIONS];
+    AtomicHistogram phases[Metrics::PHASES];
+    unique_ptr<HostCounters[]> counters;
+  };
+}
+
+#endif
@@ -0,0 +1,353 @@
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include "internal.h"
+#include "mirror.h"
+
+using namespace std;
+using namespace etcd;
+
+const size_t MirrorSnapshot::SHARDS;
+
+namespace etcd {
+  /**
+   * Next snapshot of a mirror, built from the current one. A shard is
+   * copied the first time a change touches it, the others stay shared.
+   */
+  class MirrorBuilder {
+  public:
+    MirrorBuilder(const shared_ptr<const MirrorSnapshot> &base,
+                  const string &root) :
+      next(base ? new MirrorSnapshot(*base) : new MirrorSnapshot()),
+      owned(MirrorSnapshot::SHARDS, !base),
+      root(root) {}
+
+    /**
+     * Adds or replaces node and everything below it.
+     */
+    void put(const Node &node);
+
+    /**
+     * Removes the node at key and everything below it.
+     */
+    void remove(const string &key);
+
+    /**
+     * Removes every node.
+     */
+    void clear();
+
+    void advance(int64_t index) {
+      next->index = max(next->index, index);
+    }
+
+    shared_ptr<const MirrorSnapshot> build() {
+      return shared_ptr<const MirrorSnapshot>(next.release());
+    }
+
+  private:
+    MirrorSnapshot::Shard& shard(const string &key);
+    set<string>& childrenOf(const string &dir);
+    string parentOf(const string &key) const;
+    void link(const string &key, const Node &like);
+    void unlink(const string &key);
+    void drop(const string &key);
+
+    unique_ptr<MirrorSnapshot> next;
+    vector<bool> owned;
+    // child lists copied or created by this build, changed in place
+    unordered_map<string, shared_ptr<set<string> > > listings;
+    string root;
+  };
+}
+
+MirrorSnapshot::MirrorSnapshot() :
+  index(0),
+  count(0) {
+
+  for (size_t i = 0; i < SHARDS; i++) {
+    shards.push_back(make_shared<Shard>());
+  }
+}
+
+const MirrorSnapshot::Shard& MirrorSnapshot::shard(const string &key) const {
+  return *shards[hash<string>()(key) % SHARDS];
+}
+
+const Node* MirrorSnapshot::get(const string &key) const {
+  const Shard &s = shard(key);
+  unordered_map<string, shared_ptr<const Node> >::const_iterator node =
+    s.nodes.find(key);
+  return node != s.nodes.end() ? node->second.get() : NULL;
+}
+
+void MirrorSnapshot::forEachChild(const string &dir,
+                                  const Visitor &visitor) const {
+  visit(dir, visitor, false);
+}
+
+void MirrorSnapshot::forEach(const string &dir, const Visitor &visitor) const {
+  visit(dir, visitor, true);
+}
+
+/**
+ * Visits the children of dir, and their descendants if recursive,
+ * returning false once the visitor stopped.
+ */
+bool MirrorSnapshot::visit(const string &dir,
+                           const Visitor &visitor,
+                           bool recursive) const {
+  const Shard &s = shard(dir);
+  unordered_map<string, shared_ptr<const set<string> > >::const_iterator children =
+    s.children.find(dir);
+  if (children == s.children.end()) {
+    return true;
+  }
+
+  for (const string &key : *children->second) {
+    const Node *node = get(key);
+    if (node == NULL) {
+      continue;
+    }
+    if (!visitor(*node)) {
+      return false;
+    }
+    if (recursive && node->isDirectory() && !visit(key, visitor, true)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+MirrorSnapshot::Shard& MirrorBuilder::shard(const string &key) {
+  size_t i = hash<string>()(key) % MirrorSnapshot::SHARDS;
+  if (!owned[i]) {
+    next->shards[i] = make_shared<MirrorSnapshot::Shard>(*next->shards[i]);
+    owned[i] = true;
+  }
+  return *next->shards[i];
+}
+
+/**
+ * Child list of dir to change, copied the first time this build touches
+ * it: lists are only shared with published snapshots.
+ */
+set<string>& MirrorBuilder::childrenOf(const string &dir) {
+  shared_ptr<const set<string> > &children = shard(dir).children[dir];
+  shared_ptr<set<string> > &listed = listings[dir];
+  if (!listed || children != listed) {
+    listed = children
+      ? make_shared<set<string> >(*children)
+      : make_shared<set<string> >();
+    children = listed;
+  }
+  return *listed;
+}
+
+string MirrorBuilder::parentOf(const string &key) const {
+  size_t slash = key.rfind('/');
+  return slash == 0 || slash == string::npos ? "/" : key.substr(0, slash);
+}
+
+void MirrorBuilder::put(const Node &node) {
+  string key = node.getKey();
+  MirrorSnapshot::Shard &s = shard(key);
+
+  // children are kept in the index of the directory instead
+  shared_ptr<const Node> stored(node.isDirectory()
+    ? Node::dir(key, vector<Node>(), node.getExpiration(), node.getTtl(),
+                node.getModifiedIndex(), node.getCreatedIndex())
+    : new Node(node));
+
+  shared_ptr<const Node> &slot = s.nodes[key];
+  bool added = !slot;
+  slot = stored;
+  if (added) {
+    next->count++;
+    link(key, node);
+  }
+
+  advance(node.getModifiedIndex());
+  for (const Node &child : node.getNodes()) {
+    put(child);
+  }
+}
+
+/**
+ * Lists key in its parent directory, adding the directories above it
+ * which are missing, as etcd created them along with key.
+ */
+void MirrorBuilder::link(const string &key, const Node &like) {
+  if (key.size() <= root.size()) {
+    return;
+  }
+
+  string parent = parentOf(key);
+  childrenOf(parent).insert(key);
+
+  shared_ptr<const Node> &slot = shard(parent).nodes[parent];
+  if (!slot) {
+    slot.reset(Node::dir(parent, vector<Node>(), "", -1,
+                         like.getModifiedIndex(), like.getCreatedIndex()));
+    next->count++;
+    link(parent, like);
+  }
+}
+
+void MirrorBuilder::unlink(const string &key) {
+  string parent = parentOf(key);
+  MirrorSnapshot::Shard &s = shard(parent);
+  if (s.children.find(parent) == s.children.end()) {
+    return;
+  }
+  childrenOf(parent).erase(key);
+}
+
+void MirrorBuilder::drop(const string &key) {
+  MirrorSnapshot::Shard &s = shard(key);
+  if (s.nodes.erase(key) == 0) {
+    return;
+  }
+  next->count--;
+
+  unordered_map<string, shared_ptr<const set<string> > >::iterator children =
+    s.children.find(key);
+  if (children != s.children.end()) {
+    shared_ptr<const set<string> > listed = children->second;
+    s.children.erase(children);
+    for (const string &child : *listed) {
+      drop(child);
+    }
+  }
+}
+
+void MirrorBuilder::remove(const string &key) {
+  if (key.size() <= root.size()) {
+    clear();
+    return;
+  }
+  drop(key);
+  unlink(key);
+}
+
+void MirrorBuilder::clear() {
+  for (size_t i = 0; i < MirrorSnapshot::SHARDS; i++) {
+    next->shards[i] = make_shared<MirrorSnapshot::Shard>();
+    owned[i] = true;
+  }
+  next->count = 0;
+}
+
+Mirror::Mirror(vector<Host> hosts, string prefix) :
+  session(hosts),
+  prefix(directory_key(prefix)),
+  stopped(false),
+  watcher(hosts) {
+
+  // resume after the newest change the read reflects. If the directory
+  // couldn't be read, start from the oldest change etcd may still have,
+  // which has the watch read the directory once its history is cleared
+  int64_t waitIndex = 1;
+  MirrorBuilder builder(NULL, this->prefix);
+  unique_ptr<GetResponse> r = session.get(this->prefix, true);
+  ResponseError *error = r->getError();
+  if (error == NULL && r->getNode() != NULL) {
+    builder.put(*r->getNode());
+  } else if (error != NULL && error->isKeyNotFound()) {
+    builder.advance(error->getIndex());
+  }
+  current = builder.build();
+  if (error == NULL || error->isKeyNotFound()) {
+    waitIndex = current->getIndex() + 1;
+  }
+
+  watcher.watch(this->prefix, true, waitIndex, [this](GetResponse *r) {
+      onChange(r);
+    });
+}
+
+Mirror::~Mirror() {
+  stop();
+}
+
+shared_ptr<const MirrorSnapshot> Mirror::snapshot() const {
+  return atomic_load(&current);
+}
+
+shared_ptr<const Node> Mirror::get(const string &key) const {
+  shared_ptr<const MirrorSnapshot> s = snapshot();
+  const Node *node = s->get(key);
+  if (node == NULL) {
+    return NULL;
+  }
+  // shares ownership of the snapshot holding the node
+  return shared_ptr<const Node>(s, node);
+}
+
+void Mirror::onChange(GetResponse *r) {
+  MirrorBuilder builder(snapshot(), prefix);
+
+  ResponseError *error = r->getError();
+  if (error != NULL) {
+    // the directory was read again after its history was cleared, and
+    // is gone; other errors of the watch are retried by the watcher
+    if (!error->isKeyNotFound()) {
+      return;
+    }
+    builder.clear();
+    builder.advance(error->getIndex());
+    publish(builder.build());
+    return;
+  }
+
+  const Node &node = *r->getNode();
+  string action = r->getAction();
+  if (action == "get") {
+    // history was cleared, this is a fresh read of the directory
+    builder.clear();
+    builder.put(node);
+  } else if (action == "delete"
+             || action == "compareAndDelete"
+             || action == "expire") {
+    builder.remove(node.getKey());
+    builder.advance(node.getModifiedIndex());
+  } else {
+    builder.put(node);
+  }
+  publish(builder.build());
+}
+
+void Mirror::publish(shared_ptr<const MirrorSnapshot> next) {
+  {
+    lock_guard<mutex> guard(lock);
+    atomic_store(&current, next);
+  }
+  advanced.notify_all();
+}
+
+shared_ptr<const MirrorSnapshot> Mirror::waitFor(int64_t index,
+                                                 long timeoutMillis) {
+  chrono::steady_clock::time_point deadline =
+    chrono::steady_clock::now() + chrono::milliseconds(timeoutMillis);
+
+  unique_lock<mutex> guard(lock);
+  advanced.wait_until(guard, deadline, [&]() {
+      return stopped || atomic_load(&current)->getIndex() >= index;
+    });
+
+  shared_ptr<const MirrorSnapshot> s = atomic_load(&current);
+  return s->getIndex() >= index ? s : NULL;
+}
+
+void Mirror::stop() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopped = true;
+  }
+  advanced.notify_all();
+  watcher.stop();
+}
@@ -0,0 +1,150 @@
+#ifndef LIBETCDCLIENT_MIRROR_cxx_
+#define LIBETCDCLIENT_MIRROR_cxx_
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "etcdclient.h"
+#include "watcher.h"
+
+using namespace std;
+
+namespace etcd {
+  class MirrorBuilder;
+
+  /**
+   * Immutable state of a mirrored directory as of an etcd index. A
+   * snapshot never changes once published, so any number of threads
+   * may read it without locking while the mirror moves on.
+   */
+  class MirrorSnapshot {
+  public:
+    typedef function<bool (const Node&)> Visitor;
+
+    /**
+     * Node at key, NULL if there is none. Directories come without
+     * their children, see forEach. The node lives as long as the
+     * snapshot.
+     */
+    const Node* get(const string &key) const;
+
+    /**
+     * Visits the nodes directly in the directory at dir, in key order.
+     * Returning false from the visitor stops.
+     */
+    void forEachChild(const string &dir, const Visitor &visitor) const;
+
+    /**
+     * Visits every node below the directory at dir depth-first, each
+     * directory before its children and siblings in key order.
+     * Returning false from the visitor stops.
+     */
+    void forEach(const string &dir, const Visitor &visitor) const;
+
+    /**
+     * etcd index the snapshot is consistent as of: every change to the
+     * directory up to it is reflected, none after it.
+     */
+    int64_t getIndex() const { return index; }
+
+    /**
+     * Number of nodes in the snapshot.
+     */
+    size_t size() const { return count; }
+
+  private:
+    friend class MirrorBuilder;
+
+    static const size_t SHARDS = 64;
+
+    /**
+     * Nodes whose key hashes to the shard, and the sorted child keys
+     * of the directories among them. Shards are shared between
+     * snapshots, an update copies only those it touches.
+     */
+    struct Shard {
+      unordered_map<string, shared_ptr<const Node> > nodes;
+      unordered_map<string, shared_ptr<const set<string> > > children;
+    };
+
+    MirrorSnapshot();
+
+    const Shard& shard(const string &key) const;
+    bool visit(const string &dir, const Visitor &visitor, bool recursive) const;
+
+    vector<shared_ptr<Shard> > shards;
+    int64_t index;
+    size_t count;
+  };
+
+  /**
+   * Local copy of a directory in etcd (such as /config), kept up to
+   * date for lookups which never leave the process.
+   *
+   * The directory is read once recursively, after which a recursive
+   * watch applies every change to it. Each change publishes a new
+   * snapshot, copying only the shards of the keys it touches and the
+   * child list of their parent; readers take the current snapshot
+   * without waiting for changes being applied.
+   *
+   * If the directory couldn't be read at first, or its history was
+   * cleared while the watch fell behind, it is read again as soon as
+   * etcd can be reached.
+   */
+  class Mirror {
+  public:
+    Mirror(vector<Host> hosts, string prefix);
+    ~Mirror();
+
+    /**
+     * The current snapshot, for any number of lookups which should see
+     * the same state.
+     */
+    shared_ptr<const MirrorSnapshot> snapshot() const;
+
+    /**
+     * Node at key in the current snapshot, NULL if there is none.
+     */
+    shared_ptr<const Node> get(const string &key) const;
+
+    /**
+     * Waits at most timeoutMillis for a snapshot consistent as of
+     * index, e.g. the modifiedIndex of a write in the directory which
+     * should be visible. Returns NULL on timeout.
+     */
+    shared_ptr<const MirrorSnapshot> waitFor(int64_t index, long timeoutMillis);
+
+    /**
+     * Stops following changes, the last snapshot stays readable.
+     */
+    void stop();
+
+    Session& getSession() { return session; }
+
+  private:
+    Mirror(const Mirror&);
+    Mirror& operator=(const Mirror&);
+
+    void onChange(GetResponse *r);
+    void publish(shared_ptr<const MirrorSnapshot> next);
+
+    Session session;
+    string prefix;
+    shared_ptr<const MirrorSnapshot> current;
+
+    mutable mutex lock;
+    condition_variable advanced;
+    bool stopped;
+
+    // declared last, so the watch stops before the snapshot goes away
+    Watcher watcher;
+  };
+}
+
+#endif
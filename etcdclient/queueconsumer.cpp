@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include "queueconsumer.h"
+
+using namespace std;
+using namespace etcd;
+
+/* items of the queue a claim picks from by default */
+static const size_t DEFAULT_WINDOW = 16;
+
+/* pause before retrying a claim etcd failed for another reason than a race */
+static const long CLAIM_RETRY_MS = 100;
+
+QueueConsumer::QueueConsumer(vector<Host> hosts, string queue) :
+  QueueConsumer(hosts, queue, DEFAULT_WINDOW) {}
+
+QueueConsumer::QueueConsumer(vector<Host> hosts,
+                             string queue,
+                             size_t window) :
+  session(hosts),
+  queue(queue),
+  window(window > 0 ? window : 1),
+  random(random_device()()),
+  stopped(false),
+  claimed(0),
+  conflicts(0),
+  watcher(hosts) {
+
+  // resume after the newest change the listing reflects, so nothing
+  // which happens between the listing and the watch is missed. If the
+  // queue couldn't be listed, start from the oldest change etcd may
+  // still have, which has the watch list it once its history is cleared
+  int64_t waitIndex = 1;
+  unique_ptr<GetResponse> r = session.listQueue(queue);
+  ResponseError *error = r->getError();
+  if (error == NULL && r->getNode() != NULL) {
+    lock_guard<mutex> guard(lock);
+    waitIndex = load(*r->getNode()) + 1;
+  } else if (error != NULL && error->isKeyNotFound()) {
+    waitIndex = error->getIndex() + 1;
+  }
+
+  watcher.watch(queue, true, waitIndex, [this](GetResponse *r) {
+      onChange(r);
+    });
+}
+
+QueueConsumer::~QueueConsumer() {
+  stop();
+}
+
+/**
+ * Whether key is an item of the queue, i.e. directly in its directory.
+ */
+bool QueueConsumer::isItem(const string &key) const {
+  return key.size() > queue.size() + 1
+    && key.compare(0, queue.size(), queue) == 0
+    && key[queue.size()] == '/'
+    && key.find('/', queue.size() + 1) == string::npos;
+}
+
+/**
+ * Adds the items of a listing of the queue, returning the newest
+ * modifiedIndex in it.
+ */
+int64_t QueueConsumer::load(const Node &dir) {
+  int64_t newest = dir.getModifiedIndex();
+  for (const Node &node : dir.getNodes()) {
+    newest = max(newest, node.getModifiedIndex());
+    if (!node.isDirectory()) {
+      Item item = { node.getValue(), node.getModifiedIndex(), node.getCreatedIndex() };
+      items[node.getKey()] = item;
+    }
+  }
+  return newest;
+}
+
+void QueueConsumer::onChange(GetResponse *r) {
+  if (r->getError() != NULL || r->getNode() == NULL) {
+    return;
+  }
+
+  const Node &node = *r->getNode();
+  string action = r->getAction();
+  {
+    lock_guard<mutex> guard(lock);
+    if (action == "get") {
+      // history was cleared, this is a fresh listing of the queue
+      items.clear();
+      load(node);
+    } else if (node.getKey() == queue) {
+      if (action == "delete" || action == "expire") {
+        items.clear();
+      }
+    } else if (!isItem(node.getKey()) || node.isDirectory()) {
+      return;
+    } else if (action == "delete"
+               || action == "compareAndDelete"
+               || action == "expire") {
+      items.erase(node.getKey());
+    } else {
+      Item item = { node.getValue(), node.getModifiedIndex(), node.getCreatedIndex() };
+      items[node.getKey()] = item;
+    }
+  }
+  available.notify_all();
+}
+
+unique_ptr<Node> QueueConsumer::take() {
+  return take(clock::time_point(), true);
+}
+
+unique_ptr<Node> QueueConsumer::take(long timeoutMillis) {
+  return take(clock::now() + chrono::milliseconds(timeoutMillis), false);
+}
+
+unique_ptr<Node> QueueConsumer::take(clock::time_point deadline,
+                                     bool forever) {
+  unique_lock<mutex> guard(lock);
+
+  while (true) {
+    while (items.empty() && !stopped) {
+      if (forever) {
+        available.wait(guard);
+      } else if (available.wait_until(guard, deadline) == cv_status::timeout
+                 && items.empty()) {
+        return NULL;
+      }
+    }
+    if (stopped) {
+      return NULL;
+    }
+
+    // taken out locally first, so threads sharing this consumer never
+    // race each other for the same item
+    uniform_int_distribution<size_t> pick(0, min(window, items.size()) - 1);
+    map<string, Item>::iterator it = items.begin();
+    advance(it, pick(random));
+    string key = it->first;
+    Item item = it->second;
+    items.erase(it);
+
+    guard.unlock();
+    unique_ptr<PutResponse> r = session.compareAndDelete(key, item.modifiedIndex);
+
+    ResponseError *error = r->getError();
+    if (error == NULL) {
+      claimed++;
+      if (r->getPrevNode() != NULL) {
+        return unique_ptr<Node>(new Node(*r->getPrevNode()));
+      }
+      return unique_ptr<Node>(Node::leaf(key, item.value, "", -1,
+                                         item.modifiedIndex,
+                                         item.createdIndex));
+    }
+
+    guard.lock();
+    if (error->isTestFailed() || error->isKeyNotFound()) {
+      // another consumer claimed it first
+      conflicts++;
+      continue;
+    }
+
+    items.insert(make_pair(key, item));
+    if (!forever && clock::now() >= deadline) {
+      return NULL;
+    }
+    available.wait_for(guard, chrono::milliseconds(CLAIM_RETRY_MS));
+  }
+}
+
+size_t QueueConsumer::size() const {
+  lock_guard<mutex> guard(lock);
+  return items.size();
+}
+
+QueueStats QueueConsumer::getStats() const {
+  return QueueStats(claimed, conflicts);
+}
+
+void QueueConsumer::stop() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopped = true;
+  }
+  available.notify_all();
+  watcher.stop();
+}
@@ -0,0 +1,124 @@
+#ifndef LIBETCDCLIENT_QUEUECONSUMER_cxx_
+#define LIBETCDCLIENT_QUEUECONSUMER_cxx_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include "etcdclient.h"
+#include "watcher.h"
+
+using namespace std;
+
+namespace etcd {
+  class QueueStats;
+
+  /**
+   * Consumer of an in-order queue filled by Session::addToQueue, safe
+   * to share between threads and to run in any number of processes.
+   *
+   * The queue is listed once, after which a recursive watch on it keeps
+   * a local copy of its items up to date, so no dequeue lists it again.
+   * An item is claimed by deleting it on the condition that its
+   * modifiedIndex didn't change (compare-and-delete); a consumer which
+   * loses the race to another moves on to the next item.
+   *
+   * Each claim picks a random item among the first window items of the
+   * queue, so consumers don't all race for its head. Items are therefore
+   * taken roughly, not strictly, in order; a window of 1 keeps the order
+   * at the cost of contention.
+   */
+  class QueueConsumer {
+  public:
+    QueueConsumer(vector<Host> hosts, string queue);
+    QueueConsumer(vector<Host> hosts, string queue, size_t window);
+    ~QueueConsumer();
+
+    /**
+     * Claims an item, waiting for one if the queue is empty. Returns
+     * NULL once the consumer is stopped.
+     */
+    unique_ptr<Node> take();
+
+    /**
+     * Claims an item, waiting at most timeoutMillis for one. Returns
+     * NULL if none could be claimed in time.
+     */
+    unique_ptr<Node> take(long timeoutMillis);
+
+    /**
+     * Number of items known to be in the queue.
+     */
+    size_t size() const;
+
+    /**
+     * Claimed items and claims lost to other consumers.
+     */
+    QueueStats getStats() const;
+
+    /**
+     * Stops watching the queue, waking up the threads waiting in take.
+     */
+    void stop();
+
+    Session& getSession() { return session; }
+
+  private:
+    typedef chrono::steady_clock clock;
+
+    struct Item {
+      string value;
+      int64_t modifiedIndex;
+      int64_t createdIndex;
+    };
+
+    QueueConsumer(const QueueConsumer&);
+    QueueConsumer& operator=(const QueueConsumer&);
+
+    unique_ptr<Node> take(clock::time_point deadline, bool forever);
+    int64_t load(const Node &dir);
+    bool isItem(const string &key) const;
+    void onChange(GetResponse *r);
+
+    Session session;
+    string queue;
+    size_t window;
+
+    mutable mutex lock;
+    condition_variable available;
+    map<string, Item> items;
+    minstd_rand random;
+    bool stopped;
+
+    atomic<unsigned long> claimed;
+    atomic<unsigned long> conflicts;
+
+    // declared last, so the watch stops before the items go away
+    Watcher watcher;
+  };
+
+  /**
+   * Snapshot of the counters of a QueueConsumer.
+   */
+  class QueueStats {
+  public:
+    QueueStats(unsigned long claimed, unsigned long conflicts) :
+      claimed(claimed),
+      conflicts(conflicts) {}
+
+    unsigned long getClaimed() const { return claimed; }
+    unsigned long getConflicts() const { return conflicts; }
+
+  private:
+    unsigned long claimed;
+    unsigned long conflicts;
+  };
+}
+
+#endif
@@ -0,0 +1,435 @@
+#include <curl/curl.h>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "rapidjson/reader.h"
+#include "etcdclient.h"
+#include "encoding.h"
+#include "hostselector.h"
+#include "internal.h"
+#include "metrics.h"
+
+using namespace std;
+using namespace rapidjson;
+using namespace etcd;
+
+/* response bytes buffered ahead of the parser before the transfer pauses */
+static const size_t MAX_BUFFERED = 65536;
+
+/**
+ * rapidjson input stream over a transfer in progress. Once the parser
+ * has consumed what arrived so far, the transfer is pumped until more
+ * does; while the parser lags behind, the transfer is paused so no more
+ * than MAX_BUFFERED bytes are held at once.
+ */
+class TransferStream {
+public:
+  typedef char Ch;
+
+  TransferStream(CURLM *multi, CURL *curl) :
+    multi(multi),
+    curl(curl),
+    pos(0),
+    taken(0),
+    paused(false),
+    done(false),
+    result(CURLE_OK) {}
+
+  Ch Peek() {
+    if (pos == buffer.size() && !fill()) {
+      return '\0';
+    }
+    return buffer[pos];
+  }
+
+  Ch Take() {
+    Ch c = Peek();
+    if (pos < buffer.size()) {
+      pos++;
+      taken++;
+    }
+    return c;
+  }
+
+  size_t Tell() const { return taken; }
+
+  /* only read from, rapidjson requires these of an input stream anyway */
+  Ch* PutBegin() { return NULL; }
+  void Put(Ch) {}
+  void Flush() {}
+  size_t PutEnd(Ch*) { return 0; }
+
+  /**
+   * Reads the transfer to its end, for the bytes following the JSON.
+   */
+  void finish() {
+    while (fill()) {
+      pos = buffer.size();
+    }
+  }
+
+  bool isDone() const { return done; }
+  CURLcode getResult() const { return result; }
+
+  static size_t write(char *data, size_t size, size_t nmemb,
+                      TransferStream *stream) {
+    if (stream->buffer.size() >= MAX_BUFFERED) {
+      stream->paused = true;
+      return CURL_WRITEFUNC_PAUSE;
+    }
+    stream->buffer.append(data, size * nmemb);
+    return size * nmemb;
+  }
+
+private:
+  bool fill() {
+    buffer.clear();
+    pos = 0;
+
+    if (paused) {
+      paused = false;
+      curl_easy_pause(curl, CURLPAUSE_CONT);
+    }
+
+    while (buffer.empty() && !done) {
+      int running = 0;
+      curl_multi_perform(multi, &running);
+
+      CURLMsg *msg;
+      int left = 0;
+      while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+        if (msg->msg == CURLMSG_DONE) {
+          done = true;
+          result = msg->data.result;
+        }
+      }
+
+      if (buffer.empty() && !done) {
+        curl_multi_poll(multi, NULL, 0, 1000, NULL);
+      }
+    }
+    return !buffer.empty();
+  }
+
+  CURLM *multi;
+  CURL *curl;
+  string buffer;
+  size_t pos;
+  size_t taken;
+  bool paused;
+  bool done;
+  CURLcode result;
+};
+
+/**
+ * SAX handler picking the nodes out of a GET response: the object under
+ * "node" and every object in a "nodes" array below it. Each node is
+ * handed to the visitor when its object closes, by then its children
+ * have been visited. Only the containers currently open are kept.
+ */
+class NodeStreamHandler
+  : public BaseReaderHandler<UTF8<>, NodeStreamHandler> {
+public:
+  NodeStreamHandler(const Session::NodeVisitor &visitor) :
+    visitor(visitor),
+    depth(0),
+    count(0),
+    stopped(false),
+    errorCode(0),
+    index(0) {}
+
+  bool StartObject() {
+    bool node = (depth == 1 && frames[0].name == "node")
+      || (depth > 0 && frames[depth - 1].nodes);
+    Frame &frame = push();
+    frame.node = node;
+    return true;
+  }
+
+  bool EndObject(SizeType) {
+    Frame &frame = frames[--depth];
+    if (!frame.node) {
+      return true;
+    }
+
+    unique_ptr<Node> node(frame.dir
+      ? Node::dir(frame.key, vector<Node>(), frame.expiration,
+                  frame.ttl, frame.modifiedIndex, frame.createdIndex)
+      : Node::leaf(frame.key, frame.value, frame.expiration,
+                   frame.ttl, frame.modifiedIndex, frame.createdIndex));
+    count++;
+    if (!visitor(*node)) {
+      stopped = true;
+      return false;
+    }
+    return true;
+  }
+
+  bool StartArray() {
+    bool nodes = depth > 0
+      && frames[depth - 1].node
+      && frames[depth - 1].name == "nodes";
+    Frame &frame = push();
+    frame.nodes = nodes;
+    return true;
+  }
+
+  bool EndArray(SizeType) {
+    depth--;
+    return true;
+  }
+
+  bool Key(const char *str, SizeType length, bool) {
+    frames[depth - 1].name.assign(str, length);
+    return true;
+  }
+
+  bool String(const char *str, SizeType length, bool) {
+    if (depth == 0) {
+      return true;
+    }
+
+    Frame &frame = frames[depth - 1];
+    if (frame.node) {
+      if (frame.name == "key") {
+        frame.key.assign(str, length);
+      } else if (frame.name == "value") {
+        frame.value.assign(str, length);
+      } else if (frame.name == "expiration") {
+        frame.expiration.assign(str, length);
+      }
+    } else if (depth == 1) {
+      if (frame.name == "action") {
+        action.assign(str, length);
+      } else if (frame.name == "message") {
+        message.assign(str, length);
+      } else if (frame.name == "cause") {
+        cause.assign(str, length);
+      }
+    }
+    return true;
+  }
+
+  bool Bool(bool b) {
+    if (depth > 0 && frames[depth - 1].node && frames[depth - 1].name == "dir") {
+      frames[depth - 1].dir = b;
+    }
+    return true;
+  }
+
+  bool Int(int i) { return number(i); }
+  bool Uint(unsigned u) { return number(u); }
+  bool Int64(int64_t i) { return number(i); }
+  bool Uint64(uint64_t u) { return number(u); }
+
+  size_t getCount() const { return count; }
+  bool isStopped() const { return stopped; }
+  const string& getAction() const { return action; }
+
+  /**
+   * The error reported by etcd in place of a node, NULL if none.
+   */
+  ResponseError* getError() const {
+    if (errorCode == 0) {
+      return NULL;
+    }
+    return new ResponseError(errorCode, message, cause, index);
+  }
+
+private:
+  struct Frame {
+    bool node;
+    bool nodes;
+    string name;
+    string key;
+    string value;
+    string expiration;
+    bool dir;
+    int ttl;
+    int64_t modifiedIndex;
+    int64_t createdIndex;
+  };
+
+  /**
+   * Opens a container, reusing the strings of the frame left at this
+   * depth by a previous sibling.
+   */
+  Frame& push() {
+    if (depth == frames.size()) {
+      frames.push_back(Frame());
+    }
+    Frame &frame = frames[depth++];
+    frame.node = false;
+    frame.nodes = false;
+    frame.name.clear();
+    frame.key.clear();
+    frame.value.clear();
+    frame.expiration.clear();
+    frame.dir = false;
+    frame.ttl = -1;
+    frame.modifiedIndex = 0;
+    frame.createdIndex = 0;
+    return frame;
+  }
+
+  bool number(int64_t n) {
+    if (depth == 0) {
+      return true;
+    }
+
+    Frame &frame = frames[depth - 1];
+    if (frame.node) {
+      if (frame.name == "ttl") {
+        frame.ttl = n;
+      } else if (frame.name == "modifiedIndex") {
+        frame.modifiedIndex = n;
+      } else if (frame.name == "createdIndex") {
+        frame.createdIndex = n;
+      }
+    } else if (depth == 1) {
+      if (frame.name == "errorCode") {
+        errorCode = n;
+      } else if (frame.name == "index") {
+        index = n;
+      }
+    }
+    return true;
+  }
+
+  const Session::NodeVisitor &visitor;
+  vector<Frame> frames;
+  size_t depth;
+  size_t count;
+  bool stopped;
+
+  string action;
+  int errorCode;
+  string message;
+  string cause;
+  int64_t index;
+};
+
+unique_ptr<StreamResponse> Session::streamHelper(const string &key,
+                                                 const char *query,
+                                                 const NodeVisitor &visitor) {
+  uint host = selector->select(0);
+  string url = prefixes[host];
+  appendEncoded(url, key, true).append(query);
+
+  CURL *curl = pool->acquire(host);
+  if (!curl) {
+    return failure<StreamResponse>(unique_ptr<ResponseError>(
+      ResponseError::transport(CURLE_FAILED_INIT,
+                               curl_easy_strerror(CURLE_FAILED_INIT), url)));
+  }
+  CURLM *multi = pool->acquireMulti();
+
+  TransferStream stream(multi, curl);
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &TransferStream::write);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &stream);
+  curl_multi_add_handle(multi, curl);
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  NodeStreamHandler handler(visitor);
+  Reader reader;
+  bool parsed;
+  try {
+    parsed = !reader.Parse(stream, handler).IsError();
+  } catch (...) {
+    curl_multi_remove_handle(multi, curl);
+    pool->releaseMulti(multi);
+    pool->discard(curl);
+    throw;
+  }
+
+  if (parsed) {
+    stream.finish();
+  }
+
+  // a transfer cut short by the visitor or bad JSON can't be reused
+  bool completed = stream.isDone() && stream.getResult() == CURLE_OK;
+  long status = 0;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+  if (completed) {
+    metrics->succeeded(host, curl, false);
+  }
+  curl_multi_remove_handle(multi, curl);
+  pool->releaseMulti(multi);
+
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  metrics->request(Metrics::GET, elapsed.count());
+
+  if (stream.isDone() && stream.getResult() != CURLE_OK) {
+    CURLcode res = stream.getResult();
+    pool->discard(curl);
+    selector->failed(host);
+    metrics->failed(host, false);
+    if (logger.isEnabled(LEVEL_ERROR)) {
+      logger.log(LEVEL_ERROR, url + " failed: " + curl_easy_strerror(res));
+    }
+    return failure<StreamResponse>(unique_ptr<ResponseError>(
+      ResponseError::transport(res, curl_easy_strerror(res), url)));
+  }
+
+  if (completed) {
+    pool->release(host, curl);
+    selector->succeeded(host, elapsed.count());
+  } else {
+    pool->discard(curl);
+  }
+
+  if (logger.isEnabled(LEVEL_INFO)) {
+    ostringstream message;
+    message << url << " streamed " << handler.getCount()
+            << " nodes in " << elapsed.count() * 1000 << "ms";
+    logger.log(LEVEL_INFO, message.str());
+  }
+
+  ResponseError *error = handler.getError();
+  if (error != NULL) {
+    return failure<StreamResponse>(unique_ptr<ResponseError>(error));
+  }
+
+  if (status >= 300) {
+    ostringstream message;
+    message << "HTTP status " << status;
+    return failure<StreamResponse>(unique_ptr<ResponseError>(
+      ResponseError::http(status, message.str(), url)));
+  }
+
+  if (!parsed && !handler.isStopped()) {
+    ostringstream message;
+    message << "invalid JSON at offset " << reader.GetErrorOffset();
+    return failure<StreamResponse>(unique_ptr<ResponseError>(
+      ResponseError::transport(CURLE_WEIRD_SERVER_REPLY, message.str(), url)));
+  }
+
+  return unique_ptr<StreamResponse>(
+    StreamResponse::success(handler.getAction(),
+                            handler.getCount(),
+                            handler.isStopped()));
+}
+
+unique_ptr<StreamResponse> Session::getStream(const string &key,
+                                              const NodeVisitor &visitor) {
+  return streamHelper(key, "?recursive=true", visitor);
+}
+
+unique_ptr<StreamResponse> Session::listQueueStream(const string &key,
+                                                    const NodeVisitor &visitor) {
+  return streamHelper(key, "?recursive=true&sorted=true", visitor);
+}
+
+StreamResponse* StreamResponse::success(string action,
+                                        size_t count,
+                                        bool stopped) {
+  return new StreamResponse(move(action), count, stopped, NULL);
+}
+
+StreamResponse* StreamResponse::failure(unique_ptr<ResponseError> error) {
+  return new StreamResponse("", 0, false, move(error));
+}
@@ -0,0 +1,758 @@
+#include <curl/curl.h>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "rapidjson/document.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+#include "etcdclient.h"
+#include "encoding.h"
+#include "hostselector.h"
+#include "internal.h"
+#include "metrics.h"
+
+using namespace std;
+using namespace rapidjson;
+using namespace etcd;
+
+/* gRPC status codes the gateway reports failures with */
+static const int GRPC_CANCELLED = 1;
+static const int GRPC_OUT_OF_RANGE = 11;
+
+typedef Writer<StringBuffer> JsonWriter;
+
+/**
+ * Key right after every key starting with prefix, the range end of a
+ * prefix: its last byte below 0xff incremented, "\0" (every key) if
+ * there is none.
+ */
+static string prefixEnd(const string &prefix) {
+  string end = prefix;
+  while (!end.empty()) {
+    unsigned char last = end[end.size() - 1];
+    if (last < 0xff) {
+      end[end.size() - 1] = last + 1;
+      return end;
+    }
+    end.erase(end.size() - 1);
+  }
+  return string(1, '\0');
+}
+
+/**
+ * First key of the range of a prefix: the prefix, "\0" for the empty
+ * prefix, as the gateway rejects an empty key.
+ */
+static string prefixStart(const string &prefix) {
+  return prefix.empty() ? string(1, '\0') : prefix;
+}
+
+static void writeBytes(JsonWriter &writer, const char *name, const string &value) {
+  string encoded;
+  appendBase64(encoded, value);
+  writer.Key(name);
+  writer.String(encoded.data(), encoded.size());
+}
+
+static void writeNumber(JsonWriter &writer, const char *name, int64_t value) {
+  writer.Key(name);
+  writer.Int64(value);
+}
+
+static void writeFlag(JsonWriter &writer, const char *name) {
+  writer.Key(name);
+  writer.Bool(true);
+}
+
+/**
+ * Members of a RangeRequest, fields left at their default are left out
+ * as the gateway does.
+ */
+static void writeRange(JsonWriter &writer,
+                       const string &key,
+                       const string &rangeEnd,
+                       const RangeOptions &options) {
+  writeBytes(writer, "key", key);
+  if (!rangeEnd.empty()) {
+    writeBytes(writer, "range_end", rangeEnd);
+  }
+  if (options.getLimit() > 0) {
+    writeNumber(writer, "limit", options.getLimit());
+  }
+  if (options.getRevision() > 0) {
+    writeNumber(writer, "revision", options.getRevision());
+  }
+  if (options.isKeysOnly()) {
+    writeFlag(writer, "keys_only");
+  }
+  if (options.isCountOnly()) {
+    writeFlag(writer, "count_only");
+  }
+}
+
+static void writePut(JsonWriter &writer,
+                     const string &key,
+                     const string &value,
+                     int64_t lease) {
+  writeBytes(writer, "key", key);
+  writeBytes(writer, "value", value);
+  if (lease != 0) {
+    writeNumber(writer, "lease", lease);
+  }
+  writeFlag(writer, "prev_kv");
+}
+
+static void writeDelete(JsonWriter &writer,
+                        const string &key,
+                        const string &rangeEnd) {
+  writeBytes(writer, "key", key);
+  if (!rangeEnd.empty()) {
+    writeBytes(writer, "range_end", rangeEnd);
+  }
+}
+
+static void writeCompare(JsonWriter &writer, const Compare &compare) {
+  static const char *TARGETS[] = { "VALUE", "VERSION", "CREATE", "MOD" };
+  static const char *RESULTS[] = { "EQUAL", "NOT_EQUAL", "GREATER", "LESS" };
+
+  writer.StartObject();
+  writeBytes(writer, "key", compare.getKey());
+  writer.Key("target");
+  writer.String(TARGETS[compare.getTarget()]);
+  writer.Key("result");
+  writer.String(RESULTS[compare.getResult()]);
+  switch (compare.getTarget()) {
+  case Compare::VALUE:
+    writeBytes(writer, "value", compare.getValue());
+    break;
+  case Compare::VERSION:
+    writeNumber(writer, "version", compare.getNumber());
+    break;
+  case Compare::CREATE:
+    writeNumber(writer, "create_revision", compare.getNumber());
+    break;
+  case Compare::MOD:
+    writeNumber(writer, "mod_revision", compare.getNumber());
+    break;
+  }
+  writer.EndObject();
+}
+
+static void writeOp(JsonWriter &writer, const TxnOp &op) {
+  string key = op.isPrefix() ? prefixStart(op.getKey()) : op.getKey();
+  string rangeEnd = op.isPrefix() ? prefixEnd(op.getKey()) : "";
+
+  writer.StartObject();
+  switch (op.getType()) {
+  case TxnOp::GET:
+    writer.Key("request_range");
+    writer.StartObject();
+    writeRange(writer, key, rangeEnd, RangeOptions());
+    break;
+  case TxnOp::PUT:
+    writer.Key("request_put");
+    writer.StartObject();
+    writePut(writer, op.getKey(), op.getValue(), op.getLease());
+    break;
+  case TxnOp::DELETE:
+    writer.Key("request_delete_range");
+    writer.StartObject();
+    writeDelete(writer, key, rangeEnd);
+    break;
+  }
+  writer.EndObject();
+  writer.EndObject();
+}
+
+static void writeOps(JsonWriter &writer,
+                     const char *name,
+                     const vector<TxnOp> &ops) {
+  writer.Key(name);
+  writer.StartArray();
+  for (const TxnOp &op : ops) {
+    writeOp(writer, op);
+  }
+  writer.EndArray();
+}
+
+static string bodyOf(const StringBuffer &buffer) {
+  return string(buffer.GetString(), buffer.GetSize());
+}
+
+/**
+ * int64 member of a response, which the gateway writes as a string.
+ * Missing members are 0, the gateway leaves out default values.
+ */
+static int64_t readInt64(const Value &object, const char *name) {
+  Value::ConstMemberIterator member = object.FindMember(name);
+  if (member == object.MemberEnd()) {
+    return 0;
+  }
+  if (member->value.IsString()) {
+    return strtoll(member->value.GetString(), NULL, 10);
+  }
+  return member->value.IsInt64() ? member->value.GetInt64() : 0;
+}
+
+static bool readBool(const Value &object, const char *name) {
+  Value::ConstMemberIterator member = object.FindMember(name);
+  return member != object.MemberEnd() && member->value.IsTrue();
+}
+
+/**
+ * Decoded bytes member of a response, empty if missing.
+ */
+static string readBytes(const Value &object, const char *name) {
+  string bytes;
+  Value::ConstMemberIterator member = object.FindMember(name);
+  if (member != object.MemberEnd() && member->value.IsString()) {
+    appendBase64Decoded(bytes,
+                        member->value.GetString(),
+                        member->value.GetStringLength());
+  }
+  return bytes;
+}
+
+static KeyValue readKeyValue(const Value &kv) {
+  return KeyValue(readBytes(kv, "key"),
+                  readBytes(kv, "value"),
+                  readInt64(kv, "create_revision"),
+                  readInt64(kv, "mod_revision"),
+                  readInt64(kv, "version"),
+                  readInt64(kv, "lease"));
+}
+
+static int64_t readRevision(const Value &response) {
+  Value::ConstMemberIterator header = response.FindMember("header");
+  if (header == response.MemberEnd() || !header->value.IsObject()) {
+    return 0;
+  }
+  return readInt64(header->value, "revision");
+}
+
+static void readKeyValues(const Value &response,
+                          const char *name,
+                          vector<KeyValue> &kvs) {
+  Value::ConstMemberIterator member = response.FindMember(name);
+  if (member == response.MemberEnd()) {
+    return;
+  }
+  const Value &value = member->value;
+  if (value.IsArray()) {
+    kvs.reserve(value.Size());
+    for (SizeType i = 0; i < value.Size(); i++) {
+      kvs.push_back(readKeyValue(value[i]));
+    }
+  } else if (value.IsObject()) {
+    kvs.push_back(readKeyValue(value));
+  }
+}
+
+static RangeResponse* readRange(const Value &response, int64_t revision) {
+  vector<KeyValue> kvs;
+  readKeyValues(response, "kvs", kvs);
+  return RangeResponse::success(move(kvs),
+                                readBool(response, "more"),
+                                readInt64(response, "count"),
+                                revision);
+}
+
+static RangeResponse* readPut(const Value &response, int64_t revision) {
+  vector<KeyValue> kvs;
+  readKeyValues(response, "prev_kv", kvs);
+  int64_t count = kvs.size();
+  return RangeResponse::success(move(kvs), false, count, revision);
+}
+
+static RangeResponse* readDelete(const Value &response, int64_t revision) {
+  return RangeResponse::success(vector<KeyValue>(),
+                                false,
+                                readInt64(response, "deleted"),
+                                revision);
+}
+
+/**
+ * The failure the gateway reported in response for url: the gRPC code
+ * and message of the body of a failed request, or of the error member
+ * of a watch. NULL if response holds neither.
+ */
+static ResponseError* gatewayError(const Value &response, const string &url) {
+  if (!response.IsObject()) {
+    return NULL;
+  }
+
+  const Value *error = &response;
+  const char *code = "code";
+  Value::ConstMemberIterator member = response.FindMember("error");
+  if (member != response.MemberEnd() && member->value.IsObject()) {
+    error = &member->value;
+    code = "grpc_code";
+  }
+
+  Value::ConstMemberIterator status = error->FindMember(code);
+  if (status == error->MemberEnd() || !status->value.IsInt()) {
+    return NULL;
+  }
+  Value::ConstMemberIterator message = error->FindMember("message");
+  return new ResponseError(
+    status->value.GetInt(),
+    message != error->MemberEnd() && message->value.IsString()
+      ? message->value.GetString()
+      : "",
+    url,
+    0);
+}
+
+/**
+ * Posts body to the gateway endpoint at path, see send. A failure the
+ * gateway reports replaces the HTTP error of its status.
+ */
+static unique_ptr<ParsedResponse> post(ConnectionPool &pool,
+                                       HostSelector &selector,
+                                       MetricsRecorder &metrics,
+                                       const Logger &logger,
+                                       const vector<string> &prefixes,
+                                       int leader,
+                                       const string &path,
+                                       const string &body,
+                                       bool retry,
+                                       Metrics::Operation op,
+                                       unique_ptr<ResponseError> &error) {
+  KeyRequest request = { path, "", NULL, &body };
+  unique_ptr<ParsedResponse> resp =
+    send(pool, selector, metrics, logger, prefixes, leader,
+         request, retry, op, error);
+
+  if (resp && error && error->getKind() == ResponseError::HTTP
+      && !resp->failed()) {
+    ResponseError *reported = gatewayError(resp->getDocument(),
+                                           error->getCause());
+    if (reported != NULL) {
+      error.reset(reported);
+    }
+  }
+  return resp;
+}
+
+unique_ptr<RangeResponse> Session::kvRangeHelper(const string &key,
+                                                 const string &rangeEnd,
+                                                 const RangeOptions &options) {
+  StringBuffer buffer;
+  JsonWriter writer(buffer);
+  writer.StartObject();
+  writeRange(writer, key, rangeEnd, options);
+  writer.EndObject();
+
+  unique_ptr<ResponseError> error;
+  unique_ptr<ParsedResponse> resp =
+    post(*pool, *selector, *metrics, logger, v3Prefixes, HostSelector::NONE,
+         "/kv/range", bodyOf(buffer), true, Metrics::GET, error);
+  if (error) {
+    return failure<RangeResponse>(move(error));
+  }
+
+  Document &d = resp->getDocument();
+  return unique_ptr<RangeResponse>(readRange(d, readRevision(d)));
+}
+
+unique_ptr<RangeResponse> Session::kvGet(const string &key) {
+  return kvRangeHelper(key, "", RangeOptions());
+}
+
+unique_ptr<RangeResponse> Session::kvRange(const string &key,
+                                           const string &rangeEnd,
+                                           const RangeOptions &options) {
+  return kvRangeHelper(key, rangeEnd, options);
+}
+
+unique_ptr<RangeResponse> Session::kvPrefix(const string &prefix,
+                                            const RangeOptions &options) {
+  return kvRangeHelper(prefixStart(prefix), prefixEnd(prefix), options);
+}
+
+unique_ptr<RangeResponse> Session::kvScan(const string &prefix,
+                                          size_t pageSize,
+                                          const KeyValueVisitor &visitor) {
+  string key = prefixStart(prefix);
+  string end = prefixEnd(prefix);
+  RangeOptions options;
+  options.setLimit(pageSize);
+  int64_t visited = 0;
+
+  for (;;) {
+    unique_ptr<RangeResponse> page = kvRangeHelper(key, end, options);
+    if (page->getError() != NULL) {
+      return page;
+    }
+    // the following pages are read as of the same revision
+    options.setRevision(page->getRevision());
+
+    const vector<KeyValue> &kvs = page->getKvs();
+    for (const KeyValue &kv : kvs) {
+      visited++;
+      if (!visitor(kv)) {
+        return unique_ptr<RangeResponse>(RangeResponse::success(
+          vector<KeyValue>(), true, visited, page->getRevision()));
+      }
+    }
+
+    if (!page->hasMore() || kvs.empty()) {
+      return unique_ptr<RangeResponse>(RangeResponse::success(
+        vector<KeyValue>(), false, visited, page->getRevision()));
+    }
+    // the smallest key after the last one read
+    key = kvs.back().getKey();
+    key.push_back('\0');
+  }
+}
+
+unique_ptr<RangeResponse> Session::kvPut(const string &key,
+                                         const string &value) {
+  return kvPut(key, value, 0);
+}
+
+unique_ptr<RangeResponse> Session::kvPut(const string &key,
+                                         const string &value,
+                                         int64_t lease) {
+  StringBuffer buffer;
+  JsonWriter writer(buffer);
+  writer.StartObject();
+  writePut(writer, key, value, lease);
+  writer.EndObject();
+
+  int leader = selector->getPreferLeader() ? findLeader() : HostSelector::NONE;
+  unique_ptr<ResponseError> error;
+  unique_ptr<ParsedResponse> resp =
+    post(*pool, *selector, *metrics, logger, v3Prefixes, leader,
+         "/kv/put", bodyOf(buffer), false, Metrics::PUT, error);
+  if (error) {
+    return failure<RangeResponse>(move(error));
+  }
+
+  Document &d = resp->getDocument();
+  return unique_ptr<RangeResponse>(readPut(d, readRevision(d)));
+}
+
+unique_ptr<RangeResponse> Session::kvDeleteHelper(const string &key,
+                                                  const string &rangeEnd) {
+  StringBuffer buffer;
+  JsonWriter writer(buffer);
+  writer.StartObject();
+  writeDelete(writer, key, rangeEnd);
+  writer.EndObject();
+
+  int leader = selector->getPreferLeader() ? findLeader() : HostSelector::NONE;
+  unique_ptr<ResponseError> error;
+  unique_ptr<ParsedResponse> resp =
+    post(*pool, *selector, *metrics, logger, v3Prefixes, leader,
+         "/kv/deleterange", bodyOf(buffer), false, Metrics::DELETE, error);
+  if (error) {
+    return failure<RangeResponse>(move(error));
+  }
+
+  Document &d = resp->getDocument();
+  return unique_ptr<RangeResponse>(readDelete(d, readRevision(d)));
+}
+
+unique_ptr<RangeResponse> Session::kvDelete(const string &key) {
+  return kvDeleteHelper(key, "");
+}
+
+unique_ptr<RangeResponse> Session::kvDeletePrefix(const string &prefix) {
+  return kvDeleteHelper(prefixStart(prefix), prefixEnd(prefix));
+}
+
+unique_ptr<TxnResponse> Session::kvTxn(const Txn &txn) {
+  StringBuffer buffer;
+  JsonWriter writer(buffer);
+  writer.StartObject();
+  writer.Key("compare");
+  writer.StartArray();
+  for (const Compare &compare : txn.getCompares()) {
+    writeCompare(writer, compare);
+  }
+  writer.EndArray();
+  writeOps(writer, "success", txn.getSuccess());
+  writeOps(writer, "failure", txn.getFailure());
+  writer.EndObject();
+
+  int leader = selector->getPreferLeader() ? findLeader() : HostSelector::NONE;
+  unique_ptr<ResponseError> error;
+  unique_ptr<ParsedResponse> resp =
+    post(*pool, *selector, *metrics, logger, v3Prefixes, leader,
+         "/kv/txn", bodyOf(buffer), false, Metrics::PUT, error);
+  if (error) {
+    return failure<TxnResponse>(move(error));
+  }
+
+  Document &d = resp->getDocument();
+  int64_t revision = readRevision(d);
+  vector<unique_ptr<RangeResponse> > responses;
+  Value::MemberIterator ops = d.FindMember("responses");
+  if (ops != d.MemberEnd() && ops->value.IsArray()) {
+    for (SizeType i = 0; i < ops->value.Size(); i++) {
+      const Value &op = ops->value[i];
+      if (!op.IsObject() || op.MemberBegin() == op.MemberEnd()) {
+        continue;
+      }
+      // each response is an object with a single member named by its type
+      const char *name = op.MemberBegin()->name.GetString();
+      const Value &body = op.MemberBegin()->value;
+      RangeResponse *r;
+      if (strcmp(name, "response_range") == 0) {
+        r = readRange(body, revision);
+      } else if (strcmp(name, "response_put") == 0) {
+        r = readPut(body, revision);
+      } else {
+        r = readDelete(body, revision);
+      }
+      responses.push_back(unique_ptr<RangeResponse>(r));
+    }
+  }
+
+  return unique_ptr<TxnResponse>(TxnResponse::success(
+    readBool(d, "succeeded"), revision, move(responses)));
+}
+
+/**
+ * Reads the newline delimited results of a watch as they arrive, and
+ * has the transfer stop at the first one ending the wait: one with
+ * events, the cancellation of the watch or an error. The results
+ * confirming the watch was created come before and are skipped.
+ */
+class WatchStream {
+public:
+  WatchStream(const string &url) : url(url) {}
+
+  static size_t write(char *data, size_t size, size_t nmemb,
+                      WatchStream *stream) {
+    size_t length = size * nmemb;
+    stream->buffer.append(data, length);
+
+    size_t newline;
+    while (!stream->isDone()
+           && (newline = stream->buffer.find('\n')) != string::npos) {
+      string line = stream->buffer.substr(0, newline);
+      stream->buffer.erase(0, newline + 1);
+      stream->read(line);
+    }
+    // stops the transfer, the rest of the stream is of no interest
+    return stream->isDone() ? 0 : length;
+  }
+
+  /**
+   * Reads what followed the last newline once the transfer ended, as
+   * the error body of a failed request.
+   */
+  void finish() {
+    if (!isDone() && !buffer.empty()) {
+      read(buffer);
+    }
+  }
+
+  bool isDone() const { return response || error; }
+
+  unique_ptr<WatchResponse> response;
+  unique_ptr<ResponseError> error;
+
+private:
+  void read(string &line) {
+    ParsedResponse parsed(line);
+    Document &d = parsed.getDocument();
+    if (parsed.failed() || !d.IsObject()) {
+      return;
+    }
+
+    Value::MemberIterator member = d.FindMember("result");
+    if (member == d.MemberEnd() || !member->value.IsObject()) {
+      error.reset(gatewayError(d, url));
+      return;
+    }
+
+    const Value &result = member->value;
+    int64_t compacted = readInt64(result, "compact_revision");
+    if (readBool(result, "canceled") || compacted > 0) {
+      Value::ConstMemberIterator reason = result.FindMember("cancel_reason");
+      error.reset(new ResponseError(
+        compacted > 0 ? GRPC_OUT_OF_RANGE : GRPC_CANCELLED,
+        reason != result.MemberEnd() && reason->value.IsString()
+          ? reason->value.GetString()
+          : "watch canceled",
+        url,
+        compacted));
+      return;
+    }
+
+    Value::ConstMemberIterator events = result.FindMember("events");
+    if (events == result.MemberEnd()
+        || !events->value.IsArray()
+        || events->value.Empty()) {
+      return;
+    }
+
+    vector<WatchEvent> changes;
+    changes.reserve(events->value.Size());
+    for (SizeType i = 0; i < events->value.Size(); i++) {
+      const Value &event = events->value[i];
+      Value::ConstMemberIterator type = event.FindMember("type");
+      Value::ConstMemberIterator kv = event.FindMember("kv");
+      // PUT is the default type, which the gateway leaves out
+      bool deleted = type != event.MemberEnd()
+        && type->value.IsString()
+        && strcmp(type->value.GetString(), "DELETE") == 0;
+      changes.push_back(WatchEvent(
+        deleted ? WatchEvent::DELETE : WatchEvent::PUT,
+        kv != event.MemberEnd()
+          ? readKeyValue(kv->value)
+          : KeyValue("", "", 0, 0, 0, 0)));
+    }
+    response.reset(WatchResponse::success(move(changes), readRevision(result)));
+  }
+
+  const string &url;
+  string buffer;
+};
+
+/**
+ * Opens a watch stream on a host, retrying the others if it can't be
+ * reached, and waits for the first result ending the wait. The transfer
+ * is then cut short, which closes its connection.
+ */
+unique_ptr<WatchResponse> Session::kvWatchHelper(const string &key,
+                                                 const string &rangeEnd,
+                                                 int64_t startRevision) {
+  StringBuffer buffer;
+  JsonWriter writer(buffer);
+  writer.StartObject();
+  writer.Key("create_request");
+  writer.StartObject();
+  writeDelete(writer, key, rangeEnd);
+  if (startRevision > 0) {
+    writeNumber(writer, "start_revision", startRevision);
+  }
+  writer.EndObject();
+  writer.EndObject();
+  string body = bodyOf(buffer);
+
+  uint64_t tried = 0;
+  chrono::steady_clock::time_point requested = chrono::steady_clock::now();
+
+  for (size_t attempt = 1; ; attempt++) {
+    uint host = selector->select(tried);
+    tried |= host < 64 ? 1ull << host : 0;
+    string url = v3Prefixes[host] + "/watch";
+
+    CURL *curl = pool->acquire(host);
+    if (curl == NULL) {
+      return failure<WatchResponse>(unique_ptr<ResponseError>(
+        ResponseError::transport(CURLE_FAILED_INIT,
+                                 curl_easy_strerror(CURLE_FAILED_INIT), url)));
+    }
+
+    WatchStream stream(url);
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) body.size());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &WatchStream::write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &stream);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    CURLcode res = curl_easy_perform(curl);
+
+    if (res == CURLE_OK || stream.isDone()) {
+      chrono::steady_clock::time_point end = chrono::steady_clock::now();
+      chrono::duration<double> elapsed = end - start;
+      chrono::duration<double> total = end - requested;
+      selector->succeeded(host, -1);
+      metrics->succeeded(host, curl, attempt > 1);
+      metrics->request(Metrics::WAIT, total.count());
+
+      long status = 0;
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+      if (res == CURLE_OK) {
+        stream.finish();
+        pool->release(host, curl);
+      } else {
+        pool->count(curl);
+        pool->discard(curl);
+      }
+
+      if (logger.isEnabled(LEVEL_INFO)) {
+        ostringstream message;
+        message << url << " took " << elapsed.count() * 1000 << "ms";
+        logger.log(LEVEL_INFO, message.str());
+      }
+
+      if (stream.response) {
+        return move(stream.response);
+      }
+      if (!stream.error) {
+        ostringstream message;
+        message << "HTTP status " << status;
+        stream.error.reset(status >= 300
+          ? ResponseError::http(status, message.str(), url)
+          : ResponseError::transport(CURLE_WEIRD_SERVER_REPLY,
+                                     "watch ended without events", url));
+      }
+      return failure<WatchResponse>(move(stream.error));
+    }
+
+    pool->discard(curl);
+    selector->failed(host);
+    metrics->failed(host, attempt > 1);
+    if (logger.isEnabled(LEVEL_ERROR)) {
+      logger.log(LEVEL_ERROR, url + " failed: " + curl_easy_strerror(res));
+    }
+    if (attempt >= v3Prefixes.size()) {
+      chrono::duration<double> total = chrono::steady_clock::now() - requested;
+      metrics->request(Metrics::WAIT, total.count());
+      return failure<WatchResponse>(unique_ptr<ResponseError>(
+        ResponseError::transport(res, curl_easy_strerror(res), url)));
+    }
+  }
+}
+
+unique_ptr<WatchResponse> Session::kvWatch(const string &key,
+                                           int64_t startRevision) {
+  return kvWatchHelper(key, "", startRevision);
+}
+
+unique_ptr<WatchResponse> Session::kvWatchPrefix(const string &prefix,
+                                                 int64_t startRevision) {
+  return kvWatchHelper(prefixStart(prefix), prefixEnd(prefix), startRevision);
+}
+
+RangeResponse* RangeResponse::success(vector<KeyValue> kvs,
+                                      bool more,
+                                      int64_t count,
+                                      int64_t revision) {
+  return new RangeResponse(move(kvs), more, count, revision, NULL);
+}
+
+RangeResponse* RangeResponse::failure(unique_ptr<ResponseError> error) {
+  return new RangeResponse(vector<KeyValue>(), false, 0, 0, move(error));
+}
+
+TxnResponse* TxnResponse::success(bool succeeded,
+                                  int64_t revision,
+                                  vector<unique_ptr<RangeResponse> > responses) {
+  return new TxnResponse(succeeded, revision, move(responses), NULL);
+}
+
+TxnResponse* TxnResponse::failure(unique_ptr<ResponseError> error) {
+  return new TxnResponse(false, 0, vector<unique_ptr<RangeResponse> >(),
+                         move(error));
+}
+
+WatchResponse* WatchResponse::success(vector<WatchEvent> events,
+                                      int64_t revision) {
+  return new WatchResponse(move(events), revision, NULL);
+}
+
+WatchResponse* WatchResponse::failure(unique_ptr<ResponseError> error) {
+  return new WatchResponse(vector<WatchEvent>(), 0, move(error));
+}
@@ -0,0 +1,281 @@
+#include <curl/curl.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include "rapidjson/document.h"
+#include "watcher.h"
+#include "eventloop.h"
+#include "internal.h"
+
+using namespace std;
+using namespace rapidjson;
+using namespace etcd;
+
+/* upper bound of the delay before a failed watch is retried */
+static const long MAX_RETRY_DELAY_MS = 10000;
+
+namespace etcd {
+  struct Watch {
+    Watcher::WatchId id;
+    string key;
+    bool recursive;
+    Watcher::Callback cb;
+
+    // only touched by the event loop thread once armed
+    int64_t waitIndex;
+    int failures;
+
+    // guarded by the watcher lock
+    uint64_t transfer;
+    bool cancelled;
+  };
+}
+
+/**
+ * Delay before retrying a failed watch, growing with each failure.
+ */
+static long backoff(Watch &watch) {
+  long delay = min(MAX_RETRY_DELAY_MS, 100L << min(watch.failures, 7));
+  watch.failures++;
+  return delay;
+}
+
+Watcher::Watcher(vector<Host> hosts) :
+  hostNo(0),
+  hosts(hosts),
+  stopped(false),
+  nextId(1),
+  loop(new EventLoop) {}
+
+Watcher::~Watcher() {
+  stop();
+}
+
+Host &Watcher::nextHost() {
+  return hosts[hostNo++ % hosts.size()];
+}
+
+Watcher::WatchId Watcher::watch(string key, Callback cb) {
+  return watch(key, false, 0, cb);
+}
+
+Watcher::WatchId Watcher::watch(string key, bool recursive, Callback cb) {
+  return watch(key, recursive, 0, cb);
+}
+
+Watcher::WatchId Watcher::watch(string key,
+                                bool recursive,
+                                int64_t waitIndex,
+                                Callback cb) {
+  shared_ptr<Watch> watch = make_shared<Watch>();
+  watch->key = key;
+  watch->recursive = recursive;
+  watch->cb = cb;
+  watch->waitIndex = waitIndex;
+  watch->failures = 0;
+  watch->transfer = 0;
+  watch->cancelled = false;
+
+  {
+    lock_guard<mutex> guard(lock);
+    if (stopped) {
+      return 0;
+    }
+    watch->id = nextId++;
+    watches[watch->id] = watch;
+  }
+
+  arm(watch);
+  return watch->id;
+}
+
+void Watcher::cancel(WatchId id) {
+  uint64_t transfer = 0;
+  {
+    lock_guard<mutex> guard(lock);
+    auto it = watches.find(id);
+    if (it == watches.end()) {
+      return;
+    }
+    it->second->cancelled = true;
+    transfer = it->second->transfer;
+    watches.erase(it);
+  }
+
+  loop->cancel(transfer);
+
+  // wait for a callback in progress on the loop thread, which already
+  // holds delivering if the callback itself cancels
+  lock_guard<recursive_mutex> guard(delivering);
+}
+
+void Watcher::stop() {
+  {
+    lock_guard<mutex> guard(lock);
+    if (stopped) {
+      return;
+    }
+    stopped = true;
+    for (auto &entry : watches) {
+      entry.second->cancelled = true;
+    }
+    watches.clear();
+  }
+
+  loop->stop();
+}
+
+bool Watcher::isCancelled(shared_ptr<Watch> watch) {
+  lock_guard<mutex> guard(lock);
+  return watch->cancelled;
+}
+
+/**
+ * Starts the long-poll for the next change of the watch.
+ */
+void Watcher::arm(shared_ptr<Watch> watch) {
+  ostringstream url;
+  url << base_url(nextHost(), watch->key) << "?wait=true";
+  if (watch->waitIndex > 0) {
+    url << "&waitIndex=" << watch->waitIndex;
+  }
+  if (watch->recursive) {
+    url << "&recursive=true";
+  }
+
+  string u = url.str();
+  uint64_t transfer = loop->submit([u](CURL *curl) {
+      curl_easy_setopt(curl, CURLOPT_URL, u.c_str());
+    },
+    [this, watch](CURLcode res, long status, string &body) {
+      onWait(watch, res, status, body);
+    });
+
+  track(watch, transfer);
+}
+
+/**
+ * Records the transfer in flight for the watch. A cancel which ran
+ * while it was being submitted only saw the one before, so it is
+ * cancelled here instead.
+ */
+void Watcher::track(shared_ptr<Watch> watch, uint64_t transfer) {
+  {
+    lock_guard<mutex> guard(lock);
+    watch->transfer = transfer;
+    if (!watch->cancelled) {
+      return;
+    }
+  }
+  loop->cancel(transfer);
+}
+
+/**
+ * Arms the watch again after a backoff.
+ */
+void Watcher::retry(shared_ptr<Watch> watch) {
+  loop->after(backoff(*watch), [this, watch]() {
+      if (!isCancelled(watch)) {
+        arm(watch);
+      }
+    });
+}
+
+void Watcher::onWait(shared_ptr<Watch> watch,
+                     int res,
+                     long status,
+                     string &body) {
+  if (res == CURLE_ABORTED_BY_CALLBACK || isCancelled(watch)) {
+    return;
+  }
+
+  if (res != CURLE_OK) {
+    retry(watch);
+    return;
+  }
+
+  // etcd ends long-polls which saw no change with an empty body
+  if (body.empty()) {
+    arm(watch);
+    return;
+  }
+
+  ParsedResponse resp(body, status);
+  unique_ptr<ResponseError> invalid(checkResponse(resp, watch->key));
+  if (invalid) {
+    retry(watch);
+    return;
+  }
+
+  unique_ptr<GetResponse> r = readGetResponse(resp.getDocument());
+  ResponseError *error = r->getError();
+  if (error != NULL) {
+    if (error->getErrorCode() == ResponseError::EVENT_INDEX_CLEARED) {
+      resync(watch, error->getIndex() + 1);
+    } else {
+      deliver(watch, r.get());
+      retry(watch);
+    }
+    return;
+  }
+
+  watch->waitIndex = r->getNode()->getModifiedIndex() + 1;
+  watch->failures = 0;
+  deliver(watch, r.get());
+  arm(watch);
+}
+
+/**
+ * Reads the current state of the watched key after its history was
+ * cleared, then resumes waiting at resumeIndex.
+ */
+void Watcher::resync(shared_ptr<Watch> watch, int64_t resumeIndex) {
+  ostringstream url;
+  url << base_url(nextHost(), watch->key);
+  if (watch->recursive) {
+    url << "?recursive=true";
+  }
+
+  string u = url.str();
+  uint64_t transfer = loop->submit([u](CURL *curl) {
+      curl_easy_setopt(curl, CURLOPT_URL, u.c_str());
+    },
+    [this, watch, resumeIndex](CURLcode res, long status, string &body) {
+      if (res == CURLE_ABORTED_BY_CALLBACK || isCancelled(watch)) {
+        return;
+      }
+
+      string empty;
+      ParsedResponse resp(res == CURLE_OK ? body : empty, status);
+      unique_ptr<ResponseError> invalid(checkResponse(resp, watch->key));
+      if (res != CURLE_OK || invalid) {
+        loop->after(backoff(*watch), [this, watch, resumeIndex]() {
+            if (!isCancelled(watch)) {
+              resync(watch, resumeIndex);
+            }
+          });
+        return;
+      }
+
+      unique_ptr<GetResponse> r = readGetResponse(resp.getDocument());
+      deliver(watch, r.get());
+      watch->waitIndex = resumeIndex;
+      watch->failures = 0;
+      arm(watch);
+    });
+
+  track(watch, transfer);
+}
+
+/**
+ * Calls the callback unless the watch was cancelled. Held for the call,
+ * delivering lets cancel wait for a callback in progress.
+ */
+void Watcher::deliver(shared_ptr<Watch> watch, GetResponse *r) {
+  lock_guard<recursive_mutex> guard(delivering);
+  if (!isCancelled(watch)) {
+    watch->cb(r);
+  }
+}
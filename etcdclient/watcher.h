@@ -0,0 +1,103 @@
+#ifndef LIBETCDCLIENT_WATCHER_cxx_
+#define LIBETCDCLIENT_WATCHER_cxx_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "etcdclient.h"
+
+using namespace std;
+
+namespace etcd {
+  class EventLoop;
+  struct Watch;
+
+  /**
+   * Watches any number of keys from a single event loop thread, in place
+   * of blocking one thread per key in Session::poll.
+   *
+   * Each watch long-polls its key, resuming after the modifiedIndex of
+   * the last change seen so no change is missed between polls. When etcd
+   * has already cleared that index from its history (error 401) the key
+   * is read again, the callback is given the current node (action "get"),
+   * and waiting resumes from the index reported with the error.
+   *
+   * Callbacks run on the event loop thread and must not block. Errors
+   * reported by etcd are passed to the callback as well, after which the
+   * watch retries with a backoff until it is cancelled.
+   *
+   * Classes whose callbacks use their own members declare their Watcher
+   * last, so it is destroyed first and no callback runs on a half
+   * destroyed object.
+   */
+  class Watcher {
+  public:
+    typedef function<void (GetResponse*)> Callback;
+    typedef uint64_t WatchId;
+
+    Watcher(vector<Host> hosts);
+
+    /**
+     * Cancels all watches and stops the event loop.
+     */
+    ~Watcher();
+
+    /**
+     * Watches key for changes, calling cb for every change.
+     */
+    WatchId watch(string key, Callback cb);
+
+    /**
+     * Watches key, or anything in the directory at key if recursive
+     * is true, calling cb for every change.
+     */
+    WatchId watch(string key, bool recursive, Callback cb);
+
+    /**
+     * Watches key, or anything in the directory at key if recursive
+     * is true, for changes starting at waitIndex.
+     */
+    WatchId watch(string key, bool recursive, int64_t waitIndex, Callback cb);
+
+    /**
+     * Cancels a watch, waiting for a callback in progress. Its callback
+     * is not called again once this returns, unless called from a
+     * callback of this watcher.
+     */
+    void cancel(WatchId id);
+
+    /**
+     * Cancels all watches and stops the event loop.
+     */
+    void stop();
+
+  private:
+    Watcher(const Watcher&);
+    Watcher& operator=(const Watcher&);
+
+    void arm(shared_ptr<Watch> watch);
+    void retry(shared_ptr<Watch> watch);
+    void resync(shared_ptr<Watch> watch, int64_t resumeIndex);
+    void onWait(shared_ptr<Watch> watch, int res, long status, string &body);
+    void track(shared_ptr<Watch> watch, uint64_t transfer);
+    void deliver(shared_ptr<Watch> watch, GetResponse *r);
+    bool isCancelled(shared_ptr<Watch> watch);
+    Host &nextHost();
+
+    atomic<uint> hostNo;
+    vector<Host> hosts;
+    mutex lock;
+    recursive_mutex delivering;
+    bool stopped;
+    WatchId nextId;
+    map<WatchId, shared_ptr<Watch> > watches;
+    unique_ptr<EventLoop> loop;
+  };
+}
+
+#endif
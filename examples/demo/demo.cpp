@@ -47,23 +47,15 @@ int main(int argc, char *argv[]) {
 
 vector<string> listQueueValues(Session& s, string key) {
   vector<string> values;
-  unique_ptr<GetResponse> r = s.listQueue(key);
-  if (r->getNode() == NULL) {
+  unique_ptr<TreeResponse> r = s.listQueueTree(key);
+  if (r->getTree() == NULL) {
     return values;
   }
 
-  vector<Node> queueNodes = r->getNode()->getNodes();
-  vector<string> queueValues;
-  queueValues.reserve(queueNodes.size());
-
-  auto getValue = [](Node const& node) {
-    return node.getValue();
-  };
-
-  transform(queueNodes.begin(),
-            queueNodes.end(),
-            back_inserter(queueValues),
-            getValue);
+  NodeTree *tree = r->getTree();
+  for (const TreeNode &node : tree->getChildren(0)) {
+    values.push_back(tree->getValue(tree->indexOf(node)).str());
+  }
 
-  return queueValues;
+  return values;
 }